@@ -0,0 +1,467 @@
+/**
+ * @file concurrent_hash_map.h
+ * @brief 并发散列表: 开放寻址, 一个桶占一个缓存行, 分片写锁, 读无锁
+ * @version 0.1
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#ifndef __SERVER_CONCURRENT_HASH_MAP_H__
+#define __SERVER_CONCURRENT_HASH_MAP_H__
+
+#include <atomic>
+#include <new>
+#include <functional>
+#include <utility>
+#include <stdint.h>
+#include <stdlib.h>
+#include "mutex.h"
+#include "epoch.h"
+
+namespace dx {
+
+/**
+ * @brief 并发散列表
+ *  键值对存放在不可变的节点里, 修改时换成新节点, 旧节点和扩容前的表都通过 EBR 延迟释放;
+ *  读操作只在 EpochGuard 内读取桶和节点, 不加锁, 除了本线程的纪元记录不写任何共享内存;
+ *  但 Find/Get 按值返回, 拷贝 V 本身可能写共享内存(如 shared_ptr 的引用计数),
+ *  只需要读取值时用 FindVisit 在 EpochGuard 内直接访问节点里的值
+ *  写操作按散列高位选择分片, 只锁一个分片
+ *
+ *  桶: 8字节标签字 + 7个节点指针 = 64字节, 标签取散列高位中的8位,
+ *  0 表示空槽(探测到此结束), 1 表示已删除, 查找时先比较标签再读节点
+ *
+ *  V 需要能在多个线程中同时拷贝, 如 std::shared_ptr
+ */
+template<class K, class V, class Hash = std::hash<K>, class Equal = std::equal_to<K> >
+class ConcurrentHashMap {
+public:
+    enum { SHARD_BITS = 4, SHARD_COUNT = 1 << SHARD_BITS };
+
+    ConcurrentHashMap() {}
+
+    /**
+     * @brief 析构时不能再有其他线程访问
+     */
+    ~ConcurrentHashMap() {
+        for(int i = 0; i < SHARD_COUNT; i++) {
+            Table t(m_shards[i].table.load(std::memory_order_relaxed));
+            if(t) {
+                t.DeleteEntries();
+                DeleteTable(t);
+            }
+        }
+    }
+
+    bool Find(const K& key, V& value) const {
+        return FindHashed(HashKey(key), key, Equal(), value);
+    }
+
+    V Get(const K& key, const V& def = V()) const {
+        V v;
+        return Find(key, v) ? v : def;
+    }
+
+    bool Contains(const K& key) const {
+        return FindVisit(key, [](const V&) {});
+    }
+
+    /**
+     * @brief 用其他类型的键查找, 调用方保证 hash == Hash()(等价的K), eq(const K&, const Q&)
+     */
+    template<class Q, class Eq>
+    bool FindHashed(uint64_t hash, const Q& key, Eq eq, V& value) const {
+        return FindVisitHashed(hash, key, eq, [&value](const V& v) { value = v; });
+    }
+
+    /**
+     * @brief 找到时以 const V& 调用 fn, 不拷贝值; fn 在 EpochGuard 内执行,
+     *  不要阻塞, 也不要在 fn 之外保留这个引用
+     * @return 是否找到
+     */
+    template<class F>
+    bool FindVisit(const K& key, F fn) const {
+        return FindVisitHashed(HashKey(key), key, Equal(), fn);
+    }
+
+    /**
+     * @brief 同上, 用其他类型的键查找
+     */
+    template<class Q, class Eq, class F>
+    bool FindVisitHashed(uint64_t hash, const Q& key, Eq eq, F fn) const {
+        hash = Mix(hash);
+        EpochGuard g;
+        const Entry* e = FindEntry(Table(m_shards[ShardIndex(hash)].table.load(std::memory_order_acquire)), hash, key, eq);
+        if(!e)
+            return false;
+        fn(e->value);
+        return true;
+    }
+
+    /**
+     * @brief 不存在时插入, 已存在时不修改
+     * @return 是否插入
+     */
+    bool Insert(const K& key, const V& value) {
+        return GetOrCreate(key, [&value]() { return value; }).second;
+    }
+
+    /**
+     * @brief 插入或替换
+     */
+    void Set(const K& key, const V& value) {
+        uint64_t hash = Mix(HashKey(key));
+        Shard& shard = m_shards[ShardIndex(hash)];
+        FastMutex::MutexGuard g(shard.mutex);
+        Entry* e = new Entry(hash, key, value);
+        std::atomic<Entry*>* slot = FindSlot(shard, hash, key, Equal());
+        if(slot) {
+            Entry* old = slot->load(std::memory_order_relaxed);
+            slot->store(e, std::memory_order_release);
+            EpochManager::Retire(old);
+            return;
+        }
+        InsertNoLock(shard, e);
+    }
+
+    /**
+     * @brief 存在时返回已有的值, 否则在分片锁内调用 create 生成并插入
+     * @return (值, 是否新插入)
+     */
+    template<class F>
+    std::pair<V, bool> GetOrCreate(const K& key, F create) {
+        return GetOrCreateHashed(HashKey(key), key, Equal(), [&key]() { return key; }, create);
+    }
+
+    /**
+     * @brief 同上, 用其他类型的键查找, make_key 只在插入时调用
+     */
+    template<class Q, class Eq, class MakeKey, class F>
+    std::pair<V, bool> GetOrCreateHashed(uint64_t hash, const Q& key, Eq eq, MakeKey make_key, F create) {
+        hash = Mix(hash);
+        Shard& shard = m_shards[ShardIndex(hash)];
+        {
+            EpochGuard g;
+            const Entry* e = FindEntry(Table(shard.table.load(std::memory_order_acquire)), hash, key, eq);
+            if(e)
+                return std::make_pair(e->value, false);
+        }
+        FastMutex::MutexGuard g(shard.mutex);
+        std::atomic<Entry*>* slot = FindSlot(shard, hash, key, eq);
+        if(slot)
+            return std::make_pair(slot->load(std::memory_order_relaxed)->value, false);
+        Entry* e = new Entry(hash, make_key(), create());
+        InsertNoLock(shard, e);
+        return std::make_pair(e->value, true);
+    }
+
+    bool Erase(const K& key) {
+        uint64_t hash = Mix(HashKey(key));
+        Shard& shard = m_shards[ShardIndex(hash)];
+        FastMutex::MutexGuard g(shard.mutex);
+        Table t(shard.table.load(std::memory_order_relaxed));
+        if(!t)
+            return false;
+        size_t bucket_idx = 0;
+        int s = 0;
+        if(!Locate(t, hash, key, Equal(), bucket_idx, s))
+            return false;
+        Bucket& b = t.buckets[bucket_idx];
+        Entry* old = b.entries[s].load(std::memory_order_relaxed);
+        // 先标记删除, 再清空指针, 读端看到旧标签时读到空指针或者仍然有效的旧节点
+        b.SetTag(s, TAG_DELETED);
+        b.entries[s].store(nullptr, std::memory_order_release);
+        shard.size.store(shard.size.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+        EpochManager::Retire(old);
+        return true;
+    }
+
+    size_t Size() const {
+        size_t n = 0;
+        for(int i = 0; i < SHARD_COUNT; i++) {
+            n += m_shards[i].size.load(std::memory_order_relaxed);
+        }
+        return n;
+    }
+
+    /**
+     * @brief 遍历所有键值对, 顺序不确定; 回调在 EpochGuard 内执行, 不要在回调中阻塞
+     *  遍历期间的并发修改可能看到, 也可能看不到
+     */
+    template<class F>
+    void Visit(F cb) const {
+        EpochGuard g;
+        for(int i = 0; i < SHARD_COUNT; i++) {
+            Table t(m_shards[i].table.load(std::memory_order_acquire));
+            if(!t)
+                continue;
+            for(size_t n = 0; n <= t.mask; n++) {
+                for(int s = 0; s < SLOTS; s++) {
+                    const Entry* e = t.buckets[n].entries[s].load(std::memory_order_acquire);
+                    if(e)
+                        cb(e->key, e->value);
+                }
+            }
+        }
+    }
+
+    void Clear() {
+        for(int i = 0; i < SHARD_COUNT; i++) {
+            Shard& shard = m_shards[i];
+            FastMutex::MutexGuard g(shard.mutex);
+            uintptr_t t = shard.table.exchange(0, std::memory_order_acq_rel);
+            shard.size.store(0, std::memory_order_relaxed);
+            shard.used = 0;
+            if(t)
+                EpochManager::Retire(reinterpret_cast<void*>(t), &RetireTableAndEntries);
+        }
+    }
+
+private:
+    enum { SLOTS = 7, TAG_EMPTY = 0, TAG_DELETED = 1 };
+
+    struct Entry {
+        uint64_t hash;
+        K key;
+        V value;
+
+        Entry(uint64_t h, const K& k, const V& v)
+            :hash(h), key(k), value(v) {}
+    };
+
+    /**
+     * @brief 一个缓存行; 标签字和指针只由持有分片锁的线程修改
+     */
+    struct Bucket {
+        std::atomic<uint64_t> tags;
+        std::atomic<Entry*> entries[SLOTS];
+
+        Bucket() : tags(0) {
+            for(int i = 0; i < SLOTS; i++) {
+                entries[i].store(nullptr, std::memory_order_relaxed);
+            }
+        }
+
+        static int GetTag(uint64_t tags, int s) {
+            return (tags >> (s * 8)) & 0xff;
+        }
+
+        void SetTag(int s, int tag) {
+            uint64_t v = tags.load(std::memory_order_relaxed);
+            v = (v & ~(0xffull << (s * 8))) | ((uint64_t)tag << (s * 8));
+            tags.store(v, std::memory_order_release);
+        }
+    };
+    static_assert(sizeof(Bucket) == 64, "Bucket must fill one cache line");
+
+    /**
+     * @brief 桶数组按64字节对齐, 分片中保存 数组地址 | log2(桶数),
+     *  读端一次加载就得到数组和大小, 不用再读一个表头
+     */
+    struct Table {
+        Bucket* buckets;
+        size_t mask;        // 桶数 - 1
+
+        explicit Table(uintptr_t word = 0)
+            :buckets(reinterpret_cast<Bucket*>(word & ~(uintptr_t)63))
+            ,mask(word ? ((size_t)1 << (word & 63)) - 1 : 0) {}
+
+        explicit operator bool() const { return buckets != nullptr; }
+
+        uintptr_t Word() const {
+            int bits = 0;
+            while(((size_t)1 << bits) <= mask) {
+                ++bits;
+            }
+            return reinterpret_cast<uintptr_t>(buckets) | bits;
+        }
+
+        void DeleteEntries() const {
+            for(size_t n = 0; n <= mask; n++) {
+                for(int s = 0; s < SLOTS; s++) {
+                    delete buckets[n].entries[s].load(std::memory_order_relaxed);
+                }
+            }
+        }
+    };
+
+    struct Shard {
+        FastMutex mutex;
+        std::atomic<uintptr_t> table;
+        std::atomic<size_t> size;
+        size_t used = 0;        // 有效 + 已删除的槽位数, 决定何时重建
+        char pad[64];
+
+        Shard() : table(0), size(0) {}
+    };
+
+    static uint64_t HashKey(const K& key) {
+        return Hash()(key);
+    }
+
+    /**
+     * @brief 低质量的散列(如 FNV 的低位)打散后再用
+     */
+    static uint64_t Mix(uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 33;
+        return h;
+    }
+
+    static int ShardIndex(uint64_t hash) {
+        return hash >> (64 - SHARD_BITS);
+    }
+
+    static int TagOf(uint64_t hash) {
+        int tag = (hash >> (56 - SHARD_BITS)) & 0xff;
+        return tag < 2 ? tag + 2 : tag;
+    }
+
+    template<class Q, class Eq>
+    static const Entry* Locate(const Table& t, uint64_t hash, const Q& key, Eq eq, size_t& bucket_idx, int& slot) {
+        int tag = TagOf(hash);
+        size_t idx = hash & t.mask;
+        for(size_t probe = 0; probe <= t.mask; probe++) {
+            const Bucket& b = t.buckets[idx];
+            uint64_t tags = b.tags.load(std::memory_order_acquire);
+            bool has_empty = false;
+            for(int s = 0; s < SLOTS; s++) {
+                int tg = Bucket::GetTag(tags, s);
+                if(tg == tag) {
+                    const Entry* e = b.entries[s].load(std::memory_order_acquire);
+                    if(e && e->hash == hash && eq(e->key, key)) {
+                        bucket_idx = idx;
+                        slot = s;
+                        return e;
+                    }
+                } else if(tg == TAG_EMPTY) {
+                    has_empty = true;
+                }
+            }
+            // 空槽之后不会有同一条探测链上的键
+            if(has_empty)
+                return nullptr;
+            idx = (idx + 1) & t.mask;
+        }
+        return nullptr;
+    }
+
+    template<class Q, class Eq>
+    static const Entry* FindEntry(const Table& t, uint64_t hash, const Q& key, Eq eq) {
+        if(!t)
+            return nullptr;
+        size_t idx = 0;
+        int s = 0;
+        // 返回比较过的节点, 不能重新读槽位, 其间可能被删除或替换
+        return Locate(t, hash, key, eq, idx, s);
+    }
+
+    template<class Q, class Eq>
+    static std::atomic<Entry*>* FindSlot(Shard& shard, uint64_t hash, const Q& key, Eq eq) {
+        Table t(shard.table.load(std::memory_order_relaxed));
+        if(!t)
+            return nullptr;
+        size_t idx = 0;
+        int s = 0;
+        if(!Locate(t, hash, key, eq, idx, s))
+            return nullptr;
+        return &t.buckets[idx].entries[s];
+    }
+
+    /**
+     * @brief 放入第一个空槽或已删除的槽, 先写指针再写标签
+     */
+    static bool Place(const Table& t, Entry* e) {
+        int tag = TagOf(e->hash);
+        size_t idx = e->hash & t.mask;
+        for(size_t probe = 0; probe <= t.mask; probe++) {
+            Bucket& b = t.buckets[idx];
+            uint64_t tags = b.tags.load(std::memory_order_relaxed);
+            for(int s = 0; s < SLOTS; s++) {
+                int tg = Bucket::GetTag(tags, s);
+                if(tg == TAG_EMPTY || tg == TAG_DELETED) {
+                    b.entries[s].store(e, std::memory_order_release);
+                    b.SetTag(s, tag);
+                    return tg == TAG_EMPTY;
+                }
+            }
+            idx = (idx + 1) & t.mask;
+        }
+        return false;
+    }
+
+    void InsertNoLock(Shard& shard, Entry* e) {
+        Table t(shard.table.load(std::memory_order_relaxed));
+        size_t size = shard.size.load(std::memory_order_relaxed);
+        // 有效 + 已删除 超过 3/4 时重建, 容量按有效个数的两倍计算
+        if(!t || (shard.used + 1) * 4 > (t.mask + 1) * SLOTS * 3) {
+            size_t buckets = 1;
+            while(buckets * SLOTS < (size + 1) * 2) {
+                buckets <<= 1;
+            }
+            Table nt = NewTable(buckets);
+            if(t) {
+                for(size_t n = 0; n <= t.mask; n++) {
+                    for(int s = 0; s < SLOTS; s++) {
+                        Entry* old = t.buckets[n].entries[s].load(std::memory_order_relaxed);
+                        if(old)
+                            Place(nt, old);
+                    }
+                }
+            }
+            shard.used = size;
+            shard.table.store(nt.Word(), std::memory_order_release);
+            if(t)
+                EpochManager::Retire(t.buckets, &RetireTable);
+            t = nt;
+        }
+        if(Place(t, e))
+            ++shard.used;
+        shard.size.store(size + 1, std::memory_order_relaxed);
+    }
+
+    static Table NewTable(size_t buckets) {
+        void* mem = nullptr;
+        if(posix_memalign(&mem, 64, buckets * sizeof(Bucket)) != 0)
+            throw std::bad_alloc();
+        Bucket* b = static_cast<Bucket*>(mem);
+        for(size_t i = 0; i < buckets; i++) {
+            new (&b[i]) Bucket();
+        }
+        Table t;
+        t.buckets = b;
+        t.mask = buckets - 1;
+        return t;
+    }
+
+    static void DeleteTable(const Table& t) {
+        free(t.buckets);
+    }
+
+    /**
+     * @brief 扩容后的旧桶数组, 节点已经转移到新表
+     */
+    static void RetireTable(void* ptr) {
+        free(ptr);
+    }
+
+    static void RetireTableAndEntries(void* ptr) {
+        Table t(reinterpret_cast<uintptr_t>(ptr));
+        t.DeleteEntries();
+        DeleteTable(t);
+    }
+
+private:
+    ConcurrentHashMap(const ConcurrentHashMap&) = delete;
+    ConcurrentHashMap& operator=(const ConcurrentHashMap&) = delete;
+
+private:
+    Shard m_shards[SHARD_COUNT];
+};
+
+}
+
+#endif
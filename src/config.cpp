@@ -10,6 +10,9 @@
  */
 #include "src/config.h"
 #include "thread.h"
+#include <algorithm>
+#include <unistd.h>
+#include <limits.h>
 
 namespace dx
 {
@@ -45,6 +48,8 @@ void Config::LoarFromYaml(const YAML::Node &node)
     std::list<std::pair<std::string, const YAML::Node>> all_nodes;
     ListAllMember("", node, all_nodes);
 
+    ConfigTransaction trans;
+
     for (auto &i : all_nodes)
     {
         std::string key = i.first;
@@ -56,32 +61,405 @@ void Config::LoarFromYaml(const YAML::Node &node)
 
         if (var)
         {
-            if (i.second.IsScalar())
+            trans.SetYaml(var.get(), i.second);
+        }
+    }
+    trans.Commit();
+}
+
+static SMutex& GetCommitMutex() {
+    static SMutex s_mutex;
+    return s_mutex;
+}
+
+static ConfigSnapshot::ptr& GetCurrentSnapshot() {
+    static ConfigSnapshot::ptr s_snapshot(new ConfigSnapshot(0));
+    return s_snapshot;
+}
+
+/**
+ * @brief 同步通知按提交版本排队, 版本 v 的通知在 v-1 的通知全部返回后才开始
+ *  监听回调里再次提交时, 同一线程直接通知, 不再排队(否则会等自己)
+ */
+class ConfigNotifyOrder {
+public:
+    void Enter(uint64_t version) {
+        pid_t self = GetThreadId();
+        while(true) {
+            int seq = m_seq.load(std::memory_order_acquire);
+            {
+                SMutex::MutexGuard g(m_mutex);
+                if(m_owner == self || (m_owner == 0 && m_done + 1 >= version)) {
+                    m_owner = self;
+                    ++m_depth;
+                    return;
+                }
+            }
+            FutexWait(&m_seq, seq);
+        }
+    }
+
+    void Leave(uint64_t version) {
+        {
+            SMutex::MutexGuard g(m_mutex);
+            m_done = std::max(m_done, version);
+            if(--m_depth == 0)
+                m_owner = 0;
+        }
+        m_seq.fetch_add(1, std::memory_order_release);
+        FutexWake(&m_seq, INT_MAX);
+    }
+
+private:
+    SMutex m_mutex;
+    std::atomic<int> m_seq{0};
+    uint64_t m_done = 0;    // 已通知完的版本
+    pid_t m_owner = 0;      // 正在通知的线程
+    int m_depth = 0;
+};
+
+static ConfigNotifyOrder& GetNotifyOrder() {
+    static ConfigNotifyOrder s_order;
+    return s_order;
+}
+
+/**
+ * @brief 作用域内占有通知顺序, 回调抛异常也会让出
+ */
+struct ConfigNotifyTurn {
+    ConfigNotifyTurn(uint64_t version) : m_version(version) {
+        GetNotifyOrder().Enter(version);
+    }
+    ~ConfigNotifyTurn() {
+        GetNotifyOrder().Leave(m_version);
+    }
+    uint64_t m_version;
+};
+
+static RWMutex& GetBatchMutex() {
+    static RWMutex s_mutex;
+    return s_mutex;
+}
+
+static std::map<uint64_t, Config::batch_cb>& GetBatchListeners() {
+    static std::map<uint64_t, Config::batch_cb> s_cbs;
+    return s_cbs;
+}
+
+static std::map<uint64_t, Config::batch_cb>& GetAsyncBatchListeners() {
+    static std::map<uint64_t, Config::batch_cb> s_cbs;
+    return s_cbs;
+}
+
+/**
+ * @brief 异步监听派发线程
+ *  提交时在提交锁内入队, 所以队列顺序就是提交顺序; 同一配置未派发的变化合并成一项,
+ *  保留最早的旧值和最新的新值, 批量监听的变化集同样合并
+ *  Scheduler 还没有实现 Tickle/Idle, 空闲时无法阻塞等待, 这里使用独立线程
+ */
+class ConfigDispatcher {
+public:
+    typedef SMutex MutexType;
+
+    static ConfigDispatcher* GetInstance() {
+        // 不析构, 避免进程退出时线程仍阻塞在信号量上
+        static ConfigDispatcher* s_dispatcher = new ConfigDispatcher;
+        return s_dispatcher;
+    }
+
+    void PostVar(ConfigVarBase* var, const std::shared_ptr<const void>& old_val, 
+                 const std::shared_ptr<const void>& new_val) {
+        bool wake = false;
+        {
+            MutexType::MutexGuard g(m_mutex);
+            ++m_posted;
+            auto it = m_varIndex.find(var);
+            if(it != m_varIndex.end()) {
+                it->second->new_val = new_val;
+                return;
+            }
+            wake = m_items.empty();
+            Item item;
+            item.var = var;
+            item.old_val = old_val;
+            item.new_val = new_val;
+            m_varIndex[var] = m_items.insert(m_items.end(), item);
+            StartNoLock();
+        }
+        if(wake)
+            m_sem.Notify();
+    }
+
+    void PostBatch(const ConfigChangeSet& cs) {
+        bool wake = false;
+        {
+            MutexType::MutexGuard g(m_mutex);
+            ++m_posted;
+            if(m_batchPending) {
+                ConfigChangeSet& pending = m_batchIt->cs;
+                for(auto& i : cs.changes) {
+                    bool found = false;
+                    for(auto& j : pending.changes) {
+                        if(j.var == i.var) {
+                            j.new_val = i.new_val;
+                            found = true;
+                            break;
+                        }
+                    }
+                    if(!found)
+                        pending.changes.push_back(i);
+                }
+                pending.version = cs.version;
+                pending.snapshot = cs.snapshot;
+                return;
+            }
+            wake = m_items.empty();
+            Item item;
+            item.batch = true;
+            item.cs = cs;
+            m_batchIt = m_items.insert(m_items.end(), item);
+            m_batchPending = true;
+            StartNoLock();
+        }
+        if(wake)
+            m_sem.Notify();
+    }
+
+    void Flush() {
+        uint64_t target = 0;
+        {
+            MutexType::MutexGuard g(m_mutex);
+            // 在异步监听者里调用会等待自己
+            if(!m_thread || m_thread->GetId() == GetThreadId())
+                return;
+            target = m_posted;
+        }
+        while(true) {
             {
-                var->FromString(i.second.Scalar());
+                MutexType::MutexGuard g(m_mutex);
+                if(m_done >= target)
+                    return;
             }
-            else
+            usleep(100);
+        }
+    }
+
+private:
+    struct Item {
+        bool batch = false;
+        ConfigVarBase* var = nullptr;
+        std::shared_ptr<const void> old_val;
+        std::shared_ptr<const void> new_val;
+        ConfigChangeSet cs;
+    };
+
+    ConfigDispatcher() {}
+
+    void StartNoLock() {
+        if(!m_thread)
+            m_thread.reset(new Thread(std::bind(&ConfigDispatcher::Run, this), "config_notify"));
+    }
+
+    void Run() {
+        while(true) {
+            m_sem.Wait();
+            while(true) {
+                Item item;
+                {
+                    MutexType::MutexGuard g(m_mutex);
+                    if(m_items.empty()) {
+                        m_done = m_posted;
+                        break;
+                    }
+                    item = m_items.front();
+                    if(item.batch)
+                        m_batchPending = false;
+                    else
+                        m_varIndex.erase(item.var);
+                    m_items.pop_front();
+                }
+                Dispatch(item);
+            }
+        }
+    }
+
+    void Dispatch(const Item& item) {
+        if(!item.batch) {
+            item.var->NotifyAsync(item.old_val, item.new_val);
+            return;
+        }
+        std::map<uint64_t, Config::batch_cb> cbs;
+        {
+            RWMutex::ReadLock g(GetBatchMutex());
+            cbs = GetAsyncBatchListeners();
+        }
+        for(auto& i : cbs) {
+            i.second(item.cs);
+        }
+    }
+
+private:
+    MutexType m_mutex;
+    SSemaphore m_sem;
+    Thread::ptr m_thread;
+    std::list<Item> m_items;
+    std::unordered_map<ConfigVarBase*, std::list<Item>::iterator> m_varIndex;
+    bool m_batchPending = false;
+    std::list<Item>::iterator m_batchIt;
+    uint64_t m_posted = 0;  // 入队次数(含被合并的)
+    uint64_t m_done = 0;    // 队列清空时已派发到的入队次数
+};
+
+bool ConfigTransaction::SetYaml(ConfigVarBase* var, const YAML::Node& node) {
+    std::shared_ptr<const void> val = var->ParseYaml(node);
+    if(!val)
+        return false;
+    Stage(var, val);
+    return true;
+}
+
+bool ConfigTransaction::SetString(ConfigVarBase* var, const std::string& val) {
+    std::shared_ptr<const void> v = var->ParseString(val);
+    if(!v)
+        return false;
+    Stage(var, v);
+    return true;
+}
+
+void ConfigTransaction::Stage(ConfigVarBase* var, std::shared_ptr<const void> val) {
+    auto it = m_index.find(var);
+    if(it != m_index.end()) {
+        m_staged[it->second].new_val = val;
+        return;
+    }
+    m_index[var] = m_staged.size();
+    ConfigChange c;
+    c.var = var;
+    c.new_val = val;
+    m_staged.push_back(c);
+}
+
+void ConfigSnapshot::Set(const ConfigVarBase* var, const std::shared_ptr<const void>& val) {
+    m_root = SetNode(m_root, 0, Hash(var), var, val);
+}
+
+std::shared_ptr<const ConfigSnapshot::Node> ConfigSnapshot::SetNode(const std::shared_ptr<const Node>& node, int level, uint64_t h
+                                    ,const ConfigVarBase* var, const std::shared_ptr<const void>& val) {
+    std::shared_ptr<Node> rt = node ? std::make_shared<Node>(*node) : std::make_shared<Node>();
+    if(level < LEVELS) {
+        size_t idx = Index(h, level);
+        rt->children[idx] = SetNode(rt->children[idx], level + 1, h, var, val);
+        return rt;
+    }
+    for(auto& i : rt->values) {
+        if(i.first == var) {
+            i.second = val;
+            return rt;
+        }
+    }
+    rt->values.push_back(std::make_pair(var, val));
+    return rt;
+}
+
+size_t ConfigTransaction::Commit() {
+    ConfigChangeSet cs;
+    {
+        SMutex::MutexGuard g(GetCommitMutex());
+        for(auto& i : m_staged) {
+            i.old_val = i.var->GetValuePtr();
+            if(!i.var->IsEqual(i.old_val.get(), i.new_val.get()))
+                cs.changes.push_back(i);
+        }
+        if(!cs.changes.empty()) {
+            ConfigSnapshot::ptr cur = std::atomic_load(&GetCurrentSnapshot());
+            std::shared_ptr<ConfigSnapshot> snap(new ConfigSnapshot(cur->GetVersion() + 1));
+            snap->m_root = cur->m_root;
+            for(auto& i : cs.changes) {
+                snap->Set(i.var, i.new_val);
+                i.var->Publish(i.new_val);
+            }
+            cs.version = snap->GetVersion();
+            cs.snapshot = snap;
+            std::atomic_store(&GetCurrentSnapshot(), cs.snapshot);
+
+            // 异步监听在提交锁内入队, 保证派发顺序与提交顺序一致
+            for(auto& i : cs.changes) {
+                if(i.var->HasAsyncListener())
+                    ConfigDispatcher::GetInstance()->PostVar(i.var, i.old_val, i.new_val);
+            }
+            bool has_async_batch = false;
             {
-                std::stringstream ss;
-                ss << i.second;
-                var->FromString(ss.str());
+                RWMutex::ReadLock g(GetBatchMutex());
+                has_async_batch = !GetAsyncBatchListeners().empty();
             }
+            if(has_async_batch)
+                ConfigDispatcher::GetInstance()->PostBatch(cs);
         }
     }
+    m_staged.clear();
+    m_index.clear();
+    if(cs.changes.empty())
+        return 0;
+
+    // 全部生效以后才通知, 监听者看到的是一致的新状态
+    // 按版本顺序通知, 并发提交时旧值不会在新值之后送达
+    ConfigNotifyTurn turn(cs.version);
+    for(auto& i : cs.changes) {
+        i.var->Notify(i.old_val, i.new_val);
+    }
+    std::map<uint64_t, Config::batch_cb> cbs;
+    {
+        RWMutex::ReadLock g(GetBatchMutex());
+        cbs = GetBatchListeners();
+    }
+    for(auto& i : cbs) {
+        i.second(cs);
+    }
+    return cs.changes.size();
+}
+
+ConfigSnapshot::ptr Config::Pin() {
+    return std::atomic_load(&GetCurrentSnapshot());
+}
+
+uint64_t Config::AddBatchListener(batch_cb cb, bool async) {
+    static uint64_t s_fun_id = 0;
+    RWMutex::WriteLock g(GetBatchMutex());
+    ++s_fun_id;
+    if(async)
+        GetAsyncBatchListeners()[s_fun_id] = cb;
+    else
+        GetBatchListeners()[s_fun_id] = cb;
+    return s_fun_id;
+}
+
+void Config::DelBatchListener(uint64_t key) {
+    RWMutex::WriteLock g(GetBatchMutex());
+    GetBatchListeners().erase(key);
+    GetAsyncBatchListeners().erase(key);
+}
+
+void Config::FlushListeners() {
+    ConfigDispatcher::GetInstance()->Flush();
 }
 
-ConfigVarBase::ptr Config::LookupBase(const std::string &name)
+ConfigVarBase::ptr Config::LookupBase(const ConfigKey& name)
 {
-    MutexType::ReadLock g(GetMutex());
-    auto it = GetDatas().find(name);
-    return it == GetDatas().end() ? nullptr : it->second;
+    ConfigVarBase::ptr var;
+    GetDatas().FindHashed(name.GetHash(), name, NameEqual(), var);
+    return var;
 }
 
 void Config::Visit(std::function<void(ConfigVarBase::ptr)> cb) {
-    MutexType::ReadLock g(GetMutex());
-    ConfigVarMap& m = GetDatas();
-    for(auto it = m.begin(); it != m.end(); it++) {
-        cb(it->second);
+    std::vector<ConfigVarBase::ptr> all;
+    GetDatas().Visit([&all](const std::string&, const ConfigVarBase::ptr& var) {
+        all.push_back(var);
+    });
+    std::sort(all.begin(), all.end(), [](const ConfigVarBase::ptr& a, const ConfigVarBase::ptr& b) {
+        return a->GetName() < b->GetName();
+    });
+    for(auto& i : all) {
+        cb(i);
     }
 }
 
@@ -23,8 +23,12 @@
 #include <unordered_set>
 #include <list>
 #include <functional>
+#include <atomic>
+#include <type_traits>
+#include <string.h>
 #include "thread.h"
 #include "mutex.h"
+#include "concurrent_hash_map.h"
 
 
 namespace dx {
@@ -51,13 +55,204 @@ public:
 
     virtual std::string ToString() = 0;
     virtual bool FromString(const std::string& val) = 0;
+    /**
+     * @brief 直接从yaml节点设置值, 不经过字符串
+     */
+    virtual bool FromYaml(const YAML::Node& node) = 0;
     virtual std::string GetTypeName() const = 0; 
+
+    /**
+     * @brief 类型擦除的当前值, 实际类型为 std::shared_ptr<const T>
+     */
+    virtual std::shared_ptr<const void> GetValuePtr() const = 0;
+
+    /**
+     * @brief 类型擦除的默认值, 即从未被提交过时的值
+     */
+    virtual std::shared_ptr<const void> GetDefaultPtr() const = 0;
+protected:
+    friend class ConfigTransaction;
+    friend class ConfigDispatcher;
+
+    /**
+     * @brief 解析yaml节点得到新值, 不生效, 失败返回nullptr
+     */
+    virtual std::shared_ptr<const void> ParseYaml(const YAML::Node& node) = 0;
+
+    /**
+     * @brief 解析字符串得到新值, 不生效, 失败返回nullptr
+     */
+    virtual std::shared_ptr<const void> ParseString(const std::string& val) = 0;
+    virtual bool IsEqual(const void* a, const void* b) const = 0;
+
+    /**
+     * @brief 替换当前值, 由 ConfigTransaction 在提交锁内调用
+     */
+    virtual void Publish(const std::shared_ptr<const void>& val) = 0;
+
+    /**
+     * @brief 同步通知该配置自己的监听者
+     */
+    virtual void Notify(const std::shared_ptr<const void>& old_val, const std::shared_ptr<const void>& new_val) = 0;
+
+    virtual bool HasAsyncListener() = 0;
+
+    /**
+     * @brief 在派发线程上调用异步监听者
+     */
+    virtual void NotifyAsync(const std::shared_ptr<const void>& old_val, const std::shared_ptr<const void>& new_val) = 0;
+
+
+    /**
+     * @brief 全局递增的版本号, 配置变量被销毁后同一地址上的新变量也不会拿到相同版本
+     */
+    static uint64_t NextVersion() {
+        static std::atomic<uint64_t> s_version(0);
+        return ++s_version;
+    }
 private:
     std::string m_name;
     std::string m_description;
 
 };
 
+/**
+ * @brief 某次提交后所有配置值的不可变快照, 固定住以后读取任意多个配置不加锁, 彼此一致
+ *  Pin 本身是一次 atomic_load(shared_ptr), 适合一组相关配置一起读, 不适合每次读一个配置
+ *  auto snap = Config::Pin();
+ *  int size = *snap->Get(g_pool_size);
+ *  int timeout = *snap->Get(g_pool_timeout);
+ */
+class ConfigSnapshot {
+friend class ConfigTransaction;
+public:
+    typedef std::shared_ptr<const ConfigSnapshot> ptr;
+
+    ConfigSnapshot(uint64_t version = 0) : m_version(version) {}
+
+    /**
+     * @brief 提交版本号, 每次提交加1
+     */
+    uint64_t GetVersion() const { return m_version; }
+
+    /**
+     * @brief 快照中的值, 到这个快照为止从未被提交过的配置就是它的默认值
+     */
+    std::shared_ptr<const void> GetRaw(const ConfigVarBase* var) const {
+        uint64_t h = Hash(var);
+        const Node* node = m_root.get();
+        for(int i = 0; node && i < LEVELS; i++) {
+            node = node->children[Index(h, i)].get();
+        }
+        if(node) {
+            for(auto& i : node->values) {
+                if(i.first == var)
+                    return i.second;
+            }
+        }
+        return var->GetDefaultPtr();
+    }
+
+    template<class Var>
+    typename Var::ValuePtr Get(const std::shared_ptr<Var>& var) const {
+        return std::static_pointer_cast<const typename Var::value_type>(GetRaw(var.get()));
+    }
+private:
+    enum { BITS = 4, FANOUT = 1 << BITS, LEVELS = 3 };
+
+    /**
+     * @brief 持久化的前缀树节点, 按配置地址的哈希分 LEVELS 层, 每层 FANOUT 路
+     *  新快照只复制被修改配置所在的一条路径, 其余节点与旧快照共享
+     */
+    struct Node {
+        std::shared_ptr<const Node> children[FANOUT];
+        std::vector<std::pair<const ConfigVarBase*, std::shared_ptr<const void> > > values;   // 只有最底层使用
+    };
+
+    static uint64_t Hash(const ConfigVarBase* var) {
+        return (uint64_t)(uintptr_t)var * 0x9E3779B97F4A7C15ull;
+    }
+
+    static size_t Index(uint64_t h, int level) {
+        return (h >> (64 - BITS * (level + 1))) & (FANOUT - 1);
+    }
+
+    /**
+     * @brief 设置一个配置的值, 只在发布之前由 ConfigTransaction 调用
+     */
+    void Set(const ConfigVarBase* var, const std::shared_ptr<const void>& val);
+    static std::shared_ptr<const Node> SetNode(const std::shared_ptr<const Node>& node, int level, uint64_t h
+                                    ,const ConfigVarBase* var, const std::shared_ptr<const void>& val);
+private:
+    uint64_t m_version;
+    std::shared_ptr<const Node> m_root;
+};
+
+/**
+ * @brief 一次提交中单个配置的变化
+ */
+struct ConfigChange {
+    ConfigVarBase* var = nullptr;
+    std::shared_ptr<const void> old_val;
+    std::shared_ptr<const void> new_val;
+};
+
+/**
+ * @brief 一次提交的全部变化, 提交完成后交给批量监听者
+ */
+struct ConfigChangeSet {
+    uint64_t version = 0;
+    ConfigSnapshot::ptr snapshot;       // 提交后的快照, 读取相关配置时使用
+    std::vector<ConfigChange> changes;
+
+    bool Contains(const ConfigVarBase* var) const {
+        for(auto& i : changes) {
+            if(i.var == var)
+                return true;
+        }
+        return false;
+    }
+};
+
+/**
+ * @brief 配置事务: 先暂存所有新值, Commit 时在一个提交锁内一起生效并发布新快照,
+ *  然后在锁外依次通知单个配置的监听者和批量监听者
+ */
+class ConfigTransaction {
+public:
+    template<class Var>
+    void Set(const std::shared_ptr<Var>& var, const typename Var::value_type& val) {
+        Stage(var.get(), std::make_shared<const typename Var::value_type>(val));
+    }
+
+    /**
+     * @brief 解析yaml节点并暂存, 解析失败返回false, 不影响其他暂存的值
+     */
+    bool SetYaml(ConfigVarBase* var, const YAML::Node& node);
+
+    /**
+     * @brief 解析字符串并暂存, 与 SetYaml 相同
+     */
+    bool SetString(ConfigVarBase* var, const std::string& val);
+
+    /**
+     * @brief 暂存新值, 同一配置多次暂存以最后一次为准
+     */
+    void Stage(ConfigVarBase* var, std::shared_ptr<const void> val);
+
+    /**
+     * @brief 提交
+     * 
+     * @return 实际变化的配置个数
+     */
+    size_t Commit();
+
+    bool Empty() const { return m_staged.empty(); }
+private:
+    std::vector<ConfigChange> m_staged;
+    std::unordered_map<ConfigVarBase*, size_t> m_index;
+};
+
 /**
  * @brief 
  * 
@@ -72,22 +267,106 @@ public:
     }
 };
 
+/**
+ * @brief 直接从 YAML::Node 构造值, 容器逐个元素递归转换, 不再把子节点序列化成字符串再解析
+ *  标量直接取 Scalar(), 其他节点回退到 LexicalCast<std::string, T> (自定义类型只实现了字符串转换时)
+ * 
+ * @tparam T 
+ */
 template<class T>
-class LexicalCast<std::string, std::vector<T> > {
-public:    
-    std::vector<T> operator() (const std::string& v) {
-        YAML::Node node = YAML::Load(v);
+class YamlCast {
+public:
+    T operator()(const YAML::Node& node) {
+        if(node.IsScalar())
+            return LexicalCast<std::string, T>()(node.Scalar());
         std::stringstream ss;
-        typename std::vector<T> vec;
-        for(size_t i = 0; i < node.size(); i++) {
-            ss.str("");
-            ss << node[i];
-            vec.push_back(LexicalCast<std::string, T>()(ss.str()));
+        ss << node;
+        return LexicalCast<std::string, T>()(ss.str());
+    }
+};
+
+template<class T>
+class YamlCast<std::vector<T> > {
+public:
+    std::vector<T> operator()(const YAML::Node& node) {
+        std::vector<T> vec;
+        vec.reserve(node.size());
+        for(auto it = node.begin(); it != node.end(); it++) {
+            vec.push_back(YamlCast<T>()(*it));
+        }
+        return vec;
+    }
+};
+
+template<class T>
+class YamlCast<std::list<T> > {
+public:
+    std::list<T> operator()(const YAML::Node& node) {
+        std::list<T> vec;
+        for(auto it = node.begin(); it != node.end(); it++) {
+            vec.push_back(YamlCast<T>()(*it));
+        }
+        return vec;
+    }
+};
+
+template<class T>
+class YamlCast<std::set<T> > {
+public:
+    std::set<T> operator()(const YAML::Node& node) {
+        std::set<T> vec;
+        for(auto it = node.begin(); it != node.end(); it++) {
+            vec.insert(YamlCast<T>()(*it));
         }
         return vec;
     }
 };
 
+template<class T>
+class YamlCast<std::unordered_set<T> > {
+public:
+    std::unordered_set<T> operator()(const YAML::Node& node) {
+        std::unordered_set<T> vec;
+        for(auto it = node.begin(); it != node.end(); it++) {
+            vec.insert(YamlCast<T>()(*it));
+        }
+        return vec;
+    }
+};
+
+template<class T>
+class YamlCast<std::map<std::string, T> > {
+public:
+    std::map<std::string, T> operator()(const YAML::Node& node) {
+        std::map<std::string, T> vec;
+        for(auto it = node.begin(); it != node.end(); it++) {
+            vec.insert(std::make_pair(it->first.Scalar(), YamlCast<T>()(it->second)));
+        }
+        return vec;
+    }
+};
+
+template<class T>
+class YamlCast<std::unordered_map<std::string, T> > {
+public:
+    std::unordered_map<std::string, T> operator()(const YAML::Node& node) {
+        std::unordered_map<std::string, T> vec;
+        vec.reserve(node.size());
+        for(auto it = node.begin(); it != node.end(); it++) {
+            vec.insert(std::make_pair(it->first.Scalar(), YamlCast<T>()(it->second)));
+        }
+        return vec;
+    }
+};
+
+template<class T>
+class LexicalCast<std::string, std::vector<T> > {
+public:    
+    std::vector<T> operator() (const std::string& v) {
+        return YamlCast<std::vector<T> >()(YAML::Load(v));
+    }
+};
+
 template<class T>
 class LexicalCast<std::vector<T>, std::string> {
 public:
@@ -112,15 +391,7 @@ template<class T>
 class LexicalCast<std::string, std::list<T> > {
 public:
     std::list<T> operator() (const std::string& v) {
-        YAML::Node node = YAML::Load(v);
-        std::stringstream ss;
-        typename std::list<T> vec;
-        for(size_t i = 0; i < node.size(); i++) {
-            ss.str("");
-            ss << node[i];
-            vec.push_back(LexicalCast<std::string, T>()(ss.str()));
-        }
-        return vec;
+        return YamlCast<std::list<T> >()(YAML::Load(v));
     }
 };
 
@@ -152,15 +423,7 @@ template<class T>
 class LexicalCast<std::string, std::set<T> > {
 public:
     std::set<T> operator() (const std::string& v) {
-        YAML::Node node = YAML::Load(v);
-        std::stringstream ss;
-        typename std::set<T> vec;
-        for(size_t i = 0; i < node.size(); i++) {
-            ss.str("");
-            ss << node[i];
-            vec.insert(LexicalCast<std::string, T>()(ss.str()));
-        }
-        return vec;
+        return YamlCast<std::set<T> >()(YAML::Load(v));
     }
 };
 
@@ -192,15 +455,7 @@ template<class T>
 class LexicalCast<std::string, std::unordered_set<T> > {
 public:
     std::unordered_set<T> operator() (const std::string& v) {
-        YAML::Node node = YAML::Load(v);
-        std::stringstream ss;
-        typename std::unordered_set<T> vec;
-        for(size_t i = 0; i < node.size(); i++) {
-            ss.str("");
-            ss << node[i];
-            vec.insert(LexicalCast<std::string, T>()(ss.str()));
-        }
-        return vec;
+        return YamlCast<std::unordered_set<T> >()(YAML::Load(v));
     }
 };
 
@@ -232,15 +487,7 @@ template<class T>
 class LexicalCast<std::string, std::map<std::string, T> > {
 public:
     std::map<std::string, T> operator() (const std::string& v) {
-        YAML::Node node = YAML::Load(v);
-        std::stringstream ss;
-        typename std::map<std::string, T> vec;
-        for(auto it = node.begin(); it != node.end(); it++) {
-            ss.str("");
-            ss << it->second;
-            vec.insert(std::make_pair(it->first.Scalar(), LexicalCast<std::string, T>()(ss.str())));
-        }
-        return vec;
+        return YamlCast<std::map<std::string, T> >()(YAML::Load(v));
     }
 };
 
@@ -272,15 +519,7 @@ template<class T>
 class LexicalCast<std::string, std::unordered_map<std::string, T> > {
 public:
     std::unordered_map<std::string, T> operator() (const std::string& v) {
-        YAML::Node node = YAML::Load(v);
-        std::stringstream ss;
-        typename std::unordered_map<std::string, T> vec;
-        for(auto it = node.begin(); it != node.end(); it++) {
-            ss.str("");
-            ss << it->second;
-            vec.insert(std::make_pair(it->first.Scalar(), LexicalCast<std::string, T>()(ss.str())));
-        }
-        return vec;
+        return YamlCast<std::unordered_map<std::string, T> >()(YAML::Load(v));
     }
 };
 
@@ -304,23 +543,54 @@ public:
 };
 
 
+/**
+ * @brief 可平凡复制的小类型(int/bool/double/小结构体)另存一份 SeqLock 副本,
+ *  GetValue 直接从顺序锁读取, 不需要 atomic_load shared_ptr, 读者不写共享内存
+ */
+template<class T, bool Enable = std::is_trivially_copyable<T>::value
+                               && std::is_default_constructible<T>::value && sizeof(T) <= 64>
+class ConfigSeqValue {
+public:
+    enum { ENABLED = 0 };
+    ConfigSeqValue(const T& val) {}
+    void Store(const T& val) {}
+};
+
+template<class T>
+class ConfigSeqValue<T, true> {
+public:
+    enum { ENABLED = 1 };
+    ConfigSeqValue(const T& val) : m_val(val) {}
+    void Store(const T& val) { m_val.Store(val); }
+    T Load() const { return m_val.Load(); }
+private:
+    SeqLock<T> m_val;
+};
+
 /**
  * @brief 
  * 
  * @tparam T 
  * @tparam FromStr T operator()(const std::string&) 
  * @tparam ToStr   std::string operator()(cosnt T& t)
+ * @tparam FromNode T operator()(const YAML::Node&)
  */
-template<class T, class FromStr = LexicalCast<std::string, T>, class ToStr = LexicalCast<T, std::string> >
+template<class T, class FromStr = LexicalCast<std::string, T>, class ToStr = LexicalCast<T, std::string>,
+         class FromNode = YamlCast<T> >
 class ConfigVar : public ConfigVarBase {
 public:
     typedef RWMutex MutexType;
     typedef std::shared_ptr<ConfigVar> ptr;
+    typedef T value_type;
+    typedef std::shared_ptr<const T> ValuePtr;
     typedef std::function<void (const T& old_val, const T& new_val)> on_change_cb;
 
     ConfigVar(const std::string& name, const T& default_value, const std::string& description = "")
     : ConfigVarBase(name, description)
-    , m_val(default_value) {}
+    , m_default(std::make_shared<const T>(default_value))
+    , m_val(m_default)
+    , m_seqVal(default_value)
+    , m_version(NextVersion()) {}
 
     /**
      * @brief 
@@ -329,12 +599,12 @@ public:
      * 
      */
     std::string ToString() override {
+        ValuePtr val = GetSnapshot();
         try {
-            MutexType::ReadLock g(m_mutex);
-            return ToStr()(m_val);
+            return ToStr()(*val);
         } catch(std::exception& e) {
             SERVER_LOG_ERROR(SERVER_LOG_ROOT()) << "ConfigVar::ToString Exception" << e.what()
-            << " convert:" << typeid(m_val).name() << " to string";
+            << " convert:" << typeid(T).name() << " to string";
         }
         return "";
     }
@@ -346,60 +616,272 @@ public:
             SetValue(FromStr()(val));
         } catch(std::exception& e) {
             SERVER_LOG_ERROR(SERVER_LOG_ROOT()) << "ConfigVar::ToString Exception" << e.what()
-            << " convert: string to " << typeid(m_val).name();
+            << " convert: string to " << typeid(T).name();
         }
         return "";
     }
 
+    bool FromYaml(const YAML::Node& node) override {
+        ConfigTransaction trans;
+        if(!trans.SetYaml(this, node))
+            return false;
+        trans.Commit();
+        return true;
+    }
+
+    /**
+     * @brief 返回当前值的拷贝
+     *  可平凡复制的类型从顺序锁读取; 其他类型从 GetCached 的线程局部快照拷贝,
+     *  值未变化时不经过 atomic_load
+     */
     const T GetValue() { 
-        MutexType::ReadLock g(m_mutex);
-        return m_val; 
+        return GetValue(std::integral_constant<bool, ConfigSeqValue<T>::ENABLED>());
     }
-    
-    void SetValue(const T& v) { 
-        {
-            MutexType::ReadLock g(m_mutex);
-            if(v == m_val)
-                return;
 
-            for(auto& i : m_cbs) {
-                i.second(m_val, v);
-            }
+    /**
+     * @brief 返回当前值的不可变快照, SetValue 只替换指针, 已取得的快照不受影响
+     *  注意 libstdc++ 的 atomic_load(shared_ptr) 要取全局锁池里的一把自旋锁并修改共享引用计数,
+     *  不是无锁的, 频繁读取的地方用 GetCached
+     */
+    ValuePtr GetSnapshot() const {
+        return std::atomic_load(&m_val);
+    }
+
+    /**
+     * @brief 热路径上读取配置的接口
+     *  线程局部缓存的当前值, 版本号未变时只有一次原子读, 不加锁不拷贝值
+     *  返回的指针固定住取得时的快照, 之后的修改和缓存替换都不影响它;
+     *  它与全局快照别名, 但引用计数在本线程分配的控制块上, 拷贝不和其他线程争用同一个计数
+     */
+    ValuePtr GetCached() const {
+        struct CacheEntry {
+            const ConfigVar* var = nullptr;
+            uint64_t version = 0;
+            ValuePtr val;
+        };
+        static thread_local CacheEntry s_cache[CACHE_SIZE];
+
+        // 乘法散列取高位, 对齐的地址低位都是0
+        CacheEntry& e = s_cache[((uint64_t)(uintptr_t)this * 0x9E3779B97F4A7C15ull) >> (64 - CACHE_BITS)];
+        uint64_t version = m_version.load(std::memory_order_acquire);
+        if(e.var != this || e.version != version) {
+            std::shared_ptr<const ValuePtr> holder = std::make_shared<const ValuePtr>(GetSnapshot());
+            e.val = ValuePtr(holder, holder->get());
+            e.var = this;
+            e.version = version;
         }
-        MutexType::WriteLock g(m_mutex);
-        m_val = v;
+        return e.val;
+    }
+
+    /**
+     * @brief 当前值的版本号, 每次修改都会变化, 全局不重复
+     */
+    uint64_t GetVersion() const { return m_version.load(std::memory_order_acquire); }
+    
+    /**
+     * @brief 设置新值, 相当于只包含这一个配置的事务
+     *  值发生变化时在锁外按注册顺序通知监听者
+     */
+    void SetValue(const T& v) { 
+        ConfigTransaction trans;
+        trans.Stage(this, std::make_shared<const T>(v));
+        trans.Commit();
     }
     std::string GetTypeName() const { return typeid(T).name(); }
 
-    uint64_t AddListener(on_change_cb cb) {
+    std::shared_ptr<const void> GetValuePtr() const override { return GetSnapshot(); }
+    std::shared_ptr<const void> GetDefaultPtr() const override { return m_default; }
+
+    /**
+     * @brief 添加变更监听
+     * 
+     * @param  cb 回调
+     * @param  async true 在后台派发线程上调用, 修改配置的线程不等待回调;
+     *               派发前的多次变化合并成一次, 同一配置的回调保持顺序
+     */
+    uint64_t AddListener(on_change_cb cb, bool async = false) {
         static uint64_t s_fun_id = 0;
         MutexType::WriteLock g(m_mutex);
         s_fun_id++;
-        m_cbs[s_fun_id] = cb;
+        if(async)
+            m_asyncCbs[s_fun_id] = cb;
+        else
+            m_cbs[s_fun_id] = cb;
         return s_fun_id;
     }
 
     void DelListener(uint64_t key) {
         MutexType::WriteLock g(m_mutex);
         m_cbs.erase(key);
+        m_asyncCbs.erase(key);
     }
 
     on_change_cb GetListener(uint64_t key) {
         MutexType::ReadLock g(m_mutex);
-        auto& it = m_cbs.find(key);
-        return it == m_cbs.end() ? nullptr : it->second;
+        auto it = m_cbs.find(key);
+        if(it != m_cbs.end())
+            return it->second;
+        it = m_asyncCbs.find(key);
+        return it == m_asyncCbs.end() ? nullptr : it->second;
     }
 
     void ClearListener() {
         MutexType::WriteLock g(m_mutex);
         m_cbs.clear();
+        m_asyncCbs.clear();
+    }
+
+protected:
+    std::shared_ptr<const void> ParseYaml(const YAML::Node& node) override {
+        try {
+            return std::make_shared<const T>(FromNode()(node));
+        } catch(std::exception& e) {
+            SERVER_LOG_ERROR(SERVER_LOG_ROOT()) << "ConfigVar::FromYaml Exception" << e.what()
+            << " convert: yaml to " << typeid(T).name();
+        }
+        return nullptr;
+    }
+
+    std::shared_ptr<const void> ParseString(const std::string& val) override {
+        try {
+            return std::make_shared<const T>(FromStr()(val));
+        } catch(std::exception& e) {
+            SERVER_LOG_ERROR(SERVER_LOG_ROOT()) << "ConfigVar::FromString Exception" << e.what()
+            << " convert: string to " << typeid(T).name();
+        }
+        return nullptr;
+    }
+
+    bool IsEqual(const void* a, const void* b) const override {
+        return *static_cast<const T*>(a) == *static_cast<const T*>(b);
+    }
+
+    void Publish(const std::shared_ptr<const void>& val) override {
+        std::atomic_store(&m_val, std::static_pointer_cast<const T>(val));
+        m_seqVal.Store(*static_cast<const T*>(val.get()));
+        m_version.store(NextVersion(), std::memory_order_release);
+    }
+
+    void Notify(const std::shared_ptr<const void>& old_val, const std::shared_ptr<const void>& new_val) override {
+        std::map<uint64_t, on_change_cb> cbs;
+        {
+            MutexType::ReadLock g(m_mutex);
+            cbs = m_cbs;
+        }
+        for(auto& i : cbs) {
+            i.second(*static_cast<const T*>(old_val.get()), *static_cast<const T*>(new_val.get()));
+        }
+    }
+
+    bool HasAsyncListener() override {
+        MutexType::ReadLock g(m_mutex);
+        return !m_asyncCbs.empty();
+    }
+
+    void NotifyAsync(const std::shared_ptr<const void>& old_val, const std::shared_ptr<const void>& new_val) override {
+        std::map<uint64_t, on_change_cb> cbs;
+        {
+            MutexType::ReadLock g(m_mutex);
+            cbs = m_asyncCbs;
+        }
+        for(auto& i : cbs) {
+            i.second(*static_cast<const T*>(old_val.get()), *static_cast<const T*>(new_val.get()));
+        }
+    }
+
+private:
+    T GetValue(std::true_type) const {
+        return m_seqVal.Load();
+    }
+
+    T GetValue(std::false_type) const {
+        return *GetCached();
     }
 
 private:
-    T m_val;
+    enum { CACHE_BITS = 4, CACHE_SIZE = 1 << CACHE_BITS };
+
+    ValuePtr m_default;
+    // 只通过 atomic_load/atomic_store 访问, 修改都经过 ConfigTransaction
+    ValuePtr m_val;
+    // 可平凡复制的类型同时保存在顺序锁里, 与 m_val 一起在 Publish 中更新
+    ConfigSeqValue<T> m_seqVal;
+    std::atomic<uint64_t> m_version;
+    // 保护 m_cbs
     MutexType m_mutex;
     // 变更回调函数数组, uint64_t key 唯一，
     std::map<uint64_t, on_change_cb> m_cbs;
+    // 在派发线程上调用的回调
+    std::map<uint64_t, on_change_cb> m_asyncCbs;
+};
+
+/**
+ * @brief 配置名及其预先计算的FNV-1a散列, 字符串字面量在编译期完成散列
+ *  static constexpr ConfigKey s_key("system.port");
+ *  字符数组和 const char* 按 '\0' 结尾计算长度
+ */
+class ConfigKey {
+public:
+    /**
+     * @brief 字面量的快速路径, 长度和散列都是 constexpr; 普通字符数组在运行时计算, 长度不超过 N-1
+     */
+    template<size_t N>
+    constexpr ConfigKey(const char (&str)[N])
+        :m_str(str)
+        ,m_len(Length(str, N - 1))
+        ,m_hash(Hash(str, Length(str, N - 1))) {}
+
+    /**
+     * @brief const char* 变量, 用 strlen 计算长度
+     *  写成模板是为了让字面量优先匹配上面的数组版本
+     */
+    template<class T, class = typename std::enable_if<std::is_same<T, const char*>::value
+                                                    || std::is_same<T, char*>::value>::type>
+    ConfigKey(const T& str)
+        :m_str(str)
+        ,m_len(strlen(str))
+        ,m_hash(HashRuntime(str, m_len)) {}
+
+    ConfigKey(const std::string& str)
+        :m_str(str.c_str())
+        ,m_len(str.size())
+        ,m_hash(HashRuntime(str.c_str(), str.size())) {}
+
+    /**
+     * @brief 散列已经算好(如从配置缓存中读出), 调用方保证 hash == Hash(str, len)
+     */
+    constexpr ConfigKey(const char* str, size_t len, uint64_t hash)
+        :m_str(str)
+        ,m_len(len)
+        ,m_hash(hash) {}
+
+    constexpr const char* GetStr() const { return m_str; }
+    constexpr size_t GetLen() const { return m_len; }
+    constexpr uint64_t GetHash() const { return m_hash; }
+    std::string ToString() const { return std::string(m_str, m_len); }
+
+    /**
+     * @brief constexpr 的 strlen, 最多检查 max 个字符
+     */
+    static constexpr size_t Length(const char* str, size_t max, size_t n = 0) {
+        return n == max || str[n] == '\0' ? n : Length(str, max, n + 1);
+    }
+
+    static constexpr uint64_t Hash(const char* str, size_t len, uint64_t h = 14695981039346656037ull) {
+        return len == 0 ? h : Hash(str + 1, len - 1, (h ^ (uint8_t)*str) * 1099511628211ull);
+    }
+
+    static uint64_t HashRuntime(const char* str, size_t len) {
+        uint64_t h = 14695981039346656037ull;
+        for(size_t i = 0; i < len; i++) {
+            h = (h ^ (uint8_t)str[i]) * 1099511628211ull;
+        }
+        return h;
+    }
+private:
+    const char* m_str;
+    size_t      m_len;
+    uint64_t    m_hash;
 };
 
 /**
@@ -411,58 +893,117 @@ private:
  */
 class Config {
 public:
-    typedef std::map<std::string, ConfigVarBase::ptr> ConfigVarMap;
-    typedef RWMutex MutexType;
+    /**
+     * @brief 与 ConfigKey 相同的散列, 按 ConfigKey 查找时不用再算一遍
+     */
+    struct NameHash {
+        uint64_t operator()(const std::string& name) const {
+            return ConfigKey::HashRuntime(name.c_str(), name.size());
+        }
+    };
+    // 几乎每次请求都会按名字查找, 查找不加锁
+    typedef ConcurrentHashMap<std::string, ConfigVarBase::ptr, NameHash> ConfigVarMap;
 
     template<class T>
-    static typename ConfigVar<T>::ptr Lookup(const std::string& name, const T& default_value, const std::string& description = "") {
-        
-        MutexType::WriteLock g(GetMutex());
-        auto it = GetDatas().find(name);
-        if(it != GetDatas().end()) {
-            auto tmp = std::dynamic_pointer_cast<ConfigVar<T> >(it->second);
-            if(tmp) {
-                SERVER_LOG_INFO(SERVER_LOG_ROOT()) << "Lookup name=" << name << " exists";
-                return tmp;
-            } else {
-                SERVER_LOG_ERROR(SERVER_LOG_ROOT()) << "Lookup name=" << name<< " exists but type not " << typeid(T).name() << "real_type=" << it->second->GetTypeName() << " " << it->second->ToString(); 
-                return nullptr;
+    static typename ConfigVar<T>::ptr Lookup(const ConfigKey& name, const T& default_value, const std::string& description = "") {
+        // 已存在时不加锁, 在节点上直接转换, 只增加一次引用计数
+        typename ConfigVar<T>::ptr exists;
+        ConfigVarBase::ptr other;
+        if(GetDatas().FindVisitHashed(name.GetHash(), name, NameEqual(), [&exists, &other](const ConfigVarBase::ptr& var) {
+                    exists = std::dynamic_pointer_cast<ConfigVar<T> >(var);
+                    if(!exists)
+                        other = var;
+                })) {
+            if(exists) {
+                SERVER_LOG_DEBUG(SERVER_LOG_ROOT()) << "Lookup name=" << name.ToString() << " exists";
+                return exists;
             }
+            return CastExists<T>(name, other);
         }
-        
-        if(name.find_first_not_of("abcdefghijklmnopqrstuvwxyz._0123456789") != std::string::npos) {
-            SERVER_LOG_ERROR(SERVER_LOG_ROOT()) << "Lookup name invalid " << name; 
-            throw std::invalid_argument(name);
+
+        if(!IsValidName(name)) {
+            SERVER_LOG_ERROR(SERVER_LOG_ROOT()) << "Lookup name invalid " << name.ToString(); 
+            throw std::invalid_argument(name.ToString());
         }
 
-        typename ConfigVar<T>::ptr v(new ConfigVar<T>(name, default_value, description));
-        GetDatas()[name] = v;
-        return v;
+        auto rt = GetDatas().GetOrCreateHashed(name.GetHash(), name, NameEqual(),
+            [&name]() { return name.ToString(); },
+            [&]() { return ConfigVarBase::ptr(new ConfigVar<T>(name.ToString(), default_value, description)); });
+        if(!rt.second)
+            return CastExists<T>(name, rt.first);
+        return std::static_pointer_cast<ConfigVar<T> >(rt.first);
     }
 
     template<class T>
-    static typename ConfigVar<T>::ptr Lookup(const std::string& name) {
-        MutexType::ReadLock g(GetMutex());
-        auto it = GetDatas().find(name);
-        if(it == GetDatas().end()) {
-            return nullptr;
-        }
-        return std::dynamic_pointer_cast<ConfigVar<T> >(it->second);
+    static typename ConfigVar<T>::ptr Lookup(const ConfigKey& name) {
+        typename ConfigVar<T>::ptr rt;
+        GetDatas().FindVisitHashed(name.GetHash(), name, NameEqual(), [&rt](const ConfigVarBase::ptr& var) {
+            rt = std::dynamic_pointer_cast<ConfigVar<T> >(var);
+        });
+        return rt;
     }
 
+    typedef std::function<void (const ConfigChangeSet& changes)> batch_cb;
+
+    /**
+     * @brief 整个yaml作为一个事务提交
+     */
     static void LoarFromYaml (const YAML::Node& root);
-    static ConfigVarBase::ptr LookupBase(const std::string& name);
+
+    /**
+     * @brief 固定住当前快照, 之后的提交不影响已取得的快照
+     */
+    static ConfigSnapshot::ptr Pin();
+
+    /**
+     * @brief 批量监听: 每次提交完成后收到这次提交的全部变化
+     * 
+     * @param  async true 在后台派发线程上调用, 派发前的多次提交合并成一个变化集
+     */
+    static uint64_t AddBatchListener(batch_cb cb, bool async = false);
+    static void DelBatchListener(uint64_t key);
+
+    /**
+     * @brief 等待调用时已经提交的变化全部派发给异步监听者
+     */
+    static void FlushListeners();
+    static ConfigVarBase::ptr LookupBase(const ConfigKey& name);
+
+    /**
+     * @brief 按名字顺序遍历所有配置, 回调不在锁内执行
+     */
     static void Visit(std::function<void(ConfigVarBase::ptr)> cb);
 
 private:
+    struct NameEqual {
+        bool operator()(const std::string& n, const ConfigKey& name) const {
+            return n.size() == name.GetLen() && memcmp(n.c_str(), name.GetStr(), name.GetLen()) == 0;
+        }
+    };
+
     static ConfigVarMap& GetDatas() {
         static ConfigVarMap s_datas;
         return s_datas;
     }
 
-    static Config::MutexType& GetMutex() {
-        static Config::MutexType m_mutex;
-        return m_mutex;
+    static bool IsValidName(const ConfigKey& name) {
+        for(size_t i = 0; i < name.GetLen(); i++) {
+            char c = name.GetStr()[i];
+            if(!((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '.' || c == '_'))
+                return false;
+        }
+        return true;
+    }
+
+    template<class T>
+    static typename ConfigVar<T>::ptr CastExists(const ConfigKey& name, const ConfigVarBase::ptr& var) {
+        auto tmp = std::dynamic_pointer_cast<ConfigVar<T> >(var);
+        if(tmp) {
+            SERVER_LOG_DEBUG(SERVER_LOG_ROOT()) << "Lookup name=" << name.ToString() << " exists";
+            return tmp;
+        }
+        SERVER_LOG_ERROR(SERVER_LOG_ROOT()) << "Lookup name=" << name.ToString() << " exists but type not " << typeid(T).name() << "real_type=" << var->GetTypeName() << " " << var->ToString(); 
+        return nullptr;
     }
 };
 
@@ -0,0 +1,416 @@
+/**
+ * @file config_cache.cpp
+ * @brief 预编译配置缓存
+ * @version 0.1
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include "config_cache.h"
+#include "config.h"
+#include "log.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fstream>
+#include <sstream>
+
+namespace dx {
+
+static dx::Logger::ptr g_logger = SERVER_LOG_NAME("system");
+
+/**
+ * @brief 镜像格式
+ *  [ImageHeader][ImageNode * node_count][字符串表 string_size 字节]
+ *  节点按先序排列, 子树连续存放, subtree 用来跳过整个子树;
+ *  能按名字查找的节点(与 ListAllMember 展开的一致)记录全名和它的散列
+ */
+static const char IMAGE_MAGIC[4] = {'D', 'X', 'C', 'C'};
+static const uint32_t IMAGE_VERSION = 1;
+
+enum ImageNodeType {
+    IMAGE_NULL      = 0,
+    IMAGE_SCALAR    = 1,
+    IMAGE_SEQUENCE  = 2,
+    IMAGE_MAP       = 3
+};
+
+struct ImageHeader {
+    char     magic[4];
+    uint32_t version;
+    uint64_t source_hash;   // 源yaml内容的散列
+    uint32_t node_count;
+    uint32_t string_size;
+};
+
+struct ImageNode {
+    uint64_t key_hash;      // 全名的散列, 与 ConfigKey 相同
+    uint32_t key_off;       // 全名, key_len 为0表示不能按名字查找
+    uint32_t key_len;
+    uint32_t name_off;      // 在父map中的键
+    uint32_t name_len;
+    uint32_t val_off;       // 标量的值
+    uint32_t val_len;
+    uint32_t type;
+    uint32_t children;      // 直接子节点个数
+    uint32_t subtree;       // 子树节点个数, 含自身
+    uint32_t pad;
+};
+
+static bool IsValidName(const std::string& name) {
+    return name.find_first_not_of("abcdefghijklmnopqrstuvwxyz._0123456789") == std::string::npos;
+}
+
+/**
+ * @brief 在内存中生成镜像
+ */
+class ImageBuilder {
+public:
+    /**
+     * @param  key 展开后的全名
+     * @param  listed 是否会被 ListAllMember 展开到(可以按名字查找)
+     * @param  name 在父map中的键
+     */
+    void Add(const YAML::Node& node, const std::string& key, bool listed, const std::string& name) {
+        uint32_t idx = m_nodes.size();
+        m_nodes.push_back(ImageNode());
+        ImageNode n;
+        memset(&n, 0, sizeof(n));
+        if(listed && !key.empty()) {
+            n.key_off = AddString(key);
+            n.key_len = key.size();
+            n.key_hash = ConfigKey::HashRuntime(key.c_str(), key.size());
+            // 键就是全名的后缀, 不用再存一次
+            n.name_off = n.key_off + n.key_len - name.size();
+            n.name_len = name.size();
+        } else {
+            n.name_off = AddString(name);
+            n.name_len = name.size();
+        }
+
+        if(node.IsScalar()) {
+            n.type = IMAGE_SCALAR;
+            n.val_off = AddString(node.Scalar());
+            n.val_len = node.Scalar().size();
+        } else if(node.IsSequence()) {
+            n.type = IMAGE_SEQUENCE;
+            for(auto it = node.begin(); it != node.end(); ++it) {
+                Add(*it, "", false, "");
+                ++n.children;
+            }
+        } else if(node.IsMap()) {
+            n.type = IMAGE_MAP;
+            for(auto it = node.begin(); it != node.end(); ++it) {
+                std::string child_name = it->first.Scalar();
+                std::string child_key = key.empty() ? child_name : (key + "." + child_name);
+                // 与 ListAllMember 一致: 名字非法的节点及其子树不展开
+                Add(it->second, child_key, listed && IsValidName(child_key), child_name);
+                ++n.children;
+            }
+        } else {
+            n.type = IMAGE_NULL;
+        }
+        n.subtree = m_nodes.size() - idx;
+        m_nodes[idx] = n;
+    }
+
+    std::string Dump(uint64_t source_hash) const {
+        ImageHeader h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, IMAGE_MAGIC, sizeof(h.magic));
+        h.version = IMAGE_VERSION;
+        h.source_hash = source_hash;
+        h.node_count = m_nodes.size();
+        h.string_size = m_strings.size();
+
+        std::string out;
+        out.reserve(sizeof(h) + m_nodes.size() * sizeof(ImageNode) + m_strings.size());
+        out.append((const char*)&h, sizeof(h));
+        out.append((const char*)m_nodes.data(), m_nodes.size() * sizeof(ImageNode));
+        out.append(m_strings);
+        return out;
+    }
+
+    const std::vector<ImageNode>& GetNodes() const { return m_nodes; }
+    const std::string& GetStrings() const { return m_strings; }
+private:
+    uint32_t AddString(const std::string& str) {
+        uint32_t off = m_strings.size();
+        m_strings.append(str);
+        return off;
+    }
+private:
+    std::vector<ImageNode> m_nodes;
+    std::string m_strings;
+};
+
+/**
+ * @brief 只读的镜像视图, 可以指向mmap的文件或 ImageBuilder 的内存
+ */
+class ImageView {
+public:
+    ImageView(const ImageNode* nodes, uint32_t count, const char* strings, uint32_t string_size)
+        :m_nodes(nodes)
+        ,m_count(count)
+        ,m_strings(strings)
+        ,m_stringSize(string_size) {}
+
+    /**
+     * @brief 检查所有偏移都在范围内, 损坏的镜像不会越界访问
+     */
+    bool Validate() const {
+        for(uint32_t i = 0; i < m_count; i++) {
+            const ImageNode& n = m_nodes[i];
+            if((uint64_t)n.key_off + n.key_len > m_stringSize
+                    || (uint64_t)n.name_off + n.name_len > m_stringSize
+                    || (uint64_t)n.val_off + n.val_len > m_stringSize
+                    || n.type > IMAGE_MAP
+                    || n.subtree == 0 || (uint64_t)i + n.subtree > m_count
+                    || n.children >= n.subtree) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @brief 按 ListAllMember 的顺序把所有已注册配置项暂存到事务中
+     *
+     * @return 暂存的配置项个数
+     */
+    size_t Apply(ConfigTransaction& trans) const {
+        size_t staged = 0;
+        for(uint32_t i = 0; i < m_count; i++) {
+            const ImageNode& n = m_nodes[i];
+            if(!n.key_len)
+                continue;
+            ConfigVarBase::ptr var = Config::LookupBase(ConfigKey(m_strings + n.key_off, n.key_len, n.key_hash));
+            if(!var)
+                continue;
+
+            bool ok = false;
+            if(n.type == IMAGE_SCALAR) {
+                // 标量直接转换, 不构造yaml节点
+                ok = trans.SetString(var.get(), std::string(m_strings + n.val_off, n.val_len));
+            } else {
+                YAML::Node node;
+                if(BuildNode(i, node)) {
+                    ok = trans.SetYaml(var.get(), node);
+                }
+            }
+            if(ok) {
+                ++staged;
+            } else {
+                SERVER_LOG_ERROR(g_logger) << "ConfigCache apply " << var->GetName() << " failed";
+            }
+        }
+        return staged;
+    }
+
+private:
+    /**
+     * @brief 从镜像的子树重建yaml节点, 给容器和自定义类型的配置项使用
+     */
+    bool BuildNode(uint32_t idx, YAML::Node& out) const {
+        const ImageNode& n = m_nodes[idx];
+        switch(n.type) {
+            case IMAGE_SCALAR:
+                out = YAML::Node(std::string(m_strings + n.val_off, n.val_len));
+                return true;
+            case IMAGE_SEQUENCE:
+            case IMAGE_MAP: {
+                out = YAML::Node(n.type == IMAGE_MAP ? YAML::NodeType::Map : YAML::NodeType::Sequence);
+                uint32_t child = idx + 1;
+                for(uint32_t k = 0; k < n.children; k++) {
+                    if(child >= idx + n.subtree || child + m_nodes[child].subtree > idx + n.subtree)
+                        return false;
+                    YAML::Node c;
+                    if(!BuildNode(child, c))
+                        return false;
+                    const ImageNode& cn = m_nodes[child];
+                    if(n.type == IMAGE_MAP)
+                        out[std::string(m_strings + cn.name_off, cn.name_len)] = c;
+                    else
+                        out.push_back(c);
+                    child += cn.subtree;
+                }
+                return true;
+            }
+            default:
+                out = YAML::Node(YAML::NodeType::Null);
+                return true;
+        }
+    }
+
+private:
+    const ImageNode* m_nodes;
+    uint32_t m_count;
+    const char* m_strings;
+    uint32_t m_stringSize;
+};
+
+static bool ReadFiles(const std::vector<std::string>& files, std::vector<std::string>& contents) {
+    for(auto& i : files) {
+        std::ifstream ifs(i, std::ios::binary);
+        if(!ifs) {
+            SERVER_LOG_ERROR(g_logger) << "ConfigCache open " << i << " error errno=" << errno << " " << strerror(errno);
+            return false;
+        }
+        std::stringstream ss;
+        ss << ifs.rdbuf();
+        contents.push_back(ss.str());
+    }
+    return true;
+}
+
+static uint64_t HashContents(const std::vector<std::string>& contents) {
+    uint64_t h = 14695981039346656037ull;
+    // 文件个数和长度也参与散列, 内容在文件之间挪动也能发现
+    uint64_t meta[2] = {IMAGE_VERSION, contents.size()};
+    for(size_t i = 0; i < sizeof(meta); i++) {
+        h = (h ^ ((const uint8_t*)meta)[i]) * 1099511628211ull;
+    }
+    for(auto& c : contents) {
+        uint64_t len = c.size();
+        for(size_t i = 0; i < sizeof(len); i++) {
+            h = (h ^ ((const uint8_t*)&len)[i]) * 1099511628211ull;
+        }
+        for(size_t i = 0; i < c.size(); i++) {
+            h = (h ^ (uint8_t)c[i]) * 1099511628211ull;
+        }
+    }
+    return h;
+}
+
+static bool BuildImage(const std::vector<std::string>& files, const std::vector<std::string>& contents,
+                       ImageBuilder& builder) {
+    for(size_t i = 0; i < contents.size(); i++) {
+        try {
+            builder.Add(YAML::Load(contents[i]), "", true, "");
+        } catch(std::exception& e) {
+            SERVER_LOG_ERROR(g_logger) << "ConfigCache load " << files[i] << " error: " << e.what();
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool WriteImage(const std::string& cache_file, const std::string& data) {
+    std::string tmp = cache_file + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0) {
+        SERVER_LOG_ERROR(g_logger) << "ConfigCache open " << tmp << " error errno=" << errno << " " << strerror(errno);
+        return false;
+    }
+    size_t offset = 0;
+    while(offset < data.size()) {
+        ssize_t n = write(fd, data.c_str() + offset, data.size() - offset);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0) {
+            SERVER_LOG_ERROR(g_logger) << "ConfigCache write " << tmp << " error errno=" << errno << " " << strerror(errno);
+            close(fd);
+            unlink(tmp.c_str());
+            return false;
+        }
+        offset += n;
+    }
+    close(fd);
+    if(rename(tmp.c_str(), cache_file.c_str()) != 0) {
+        SERVER_LOG_ERROR(g_logger) << "ConfigCache rename " << tmp << " error errno=" << errno << " " << strerror(errno);
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief mmap镜像并应用, 镜像不存在/损坏/散列不一致时返回false, 不修改任何配置
+ */
+static bool LoadImage(const std::string& cache_file, uint64_t source_hash) {
+    int fd = open(cache_file.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return false;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ImageHeader)) {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED) {
+        SERVER_LOG_ERROR(g_logger) << "ConfigCache mmap " << cache_file << " error errno=" << errno << " " << strerror(errno);
+        return false;
+    }
+
+    bool ok = false;
+    const char* base = (const char*)addr;
+    const ImageHeader* h = (const ImageHeader*)base;
+    if(memcmp(h->magic, IMAGE_MAGIC, sizeof(h->magic)) != 0 || h->version != IMAGE_VERSION) {
+        SERVER_LOG_WARN(g_logger) << "ConfigCache " << cache_file << " bad magic or version";
+    } else if(h->source_hash != source_hash) {
+        SERVER_LOG_INFO(g_logger) << "ConfigCache " << cache_file << " out of date";
+    } else if(sizeof(ImageHeader) + (uint64_t)h->node_count * sizeof(ImageNode) + h->string_size != size) {
+        SERVER_LOG_WARN(g_logger) << "ConfigCache " << cache_file << " size mismatch";
+    } else {
+        const ImageNode* nodes = (const ImageNode*)(base + sizeof(ImageHeader));
+        ImageView view(nodes, h->node_count, (const char*)(nodes + h->node_count), h->string_size);
+        if(!view.Validate()) {
+            SERVER_LOG_WARN(g_logger) << "ConfigCache " << cache_file << " corrupted";
+        } else {
+            ConfigTransaction trans;
+            view.Apply(trans);
+            trans.Commit();
+            ok = true;
+        }
+    }
+    munmap(addr, size);
+    return ok;
+}
+
+bool ConfigCache::HashSources(const std::vector<std::string>& files, uint64_t& hash) {
+    std::vector<std::string> contents;
+    if(!ReadFiles(files, contents))
+        return false;
+    hash = HashContents(contents);
+    return true;
+}
+
+bool ConfigCache::Compile(const std::vector<std::string>& files, const std::string& cache_file) {
+    std::vector<std::string> contents;
+    if(!ReadFiles(files, contents))
+        return false;
+    // 用读到的内容同时散列和解析, 编译期间文件被修改也不会对不上
+    ImageBuilder builder;
+    if(!BuildImage(files, contents, builder))
+        return false;
+    return WriteImage(cache_file, builder.Dump(HashContents(contents)));
+}
+
+int ConfigCache::Load(const std::vector<std::string>& files, const std::string& cache_file, bool rebuild) {
+    std::vector<std::string> contents;
+    if(!ReadFiles(files, contents))
+        return LOAD_ERROR;
+    uint64_t hash = HashContents(contents);
+    if(LoadImage(cache_file, hash))
+        return FROM_CACHE;
+
+    // 退回yaml: 解析后同样生成镜像再应用, 所有文件作为一个事务提交
+    ImageBuilder builder;
+    if(!BuildImage(files, contents, builder))
+        return LOAD_ERROR;
+    ImageView view(builder.GetNodes().data(), builder.GetNodes().size(),
+                   builder.GetStrings().c_str(), builder.GetStrings().size());
+    ConfigTransaction trans;
+    view.Apply(trans);
+    trans.Commit();
+    if(rebuild)
+        WriteImage(cache_file, builder.Dump(hash));
+    return FROM_YAML;
+}
+
+}
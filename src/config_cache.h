@@ -0,0 +1,53 @@
+/**
+ * @file config_cache.h
+ * @brief 预编译配置缓存: 把yaml展开成扁平的节点表 + 字符串表写成二进制镜像,
+ *        启动时mmap镜像直接给已注册的配置项赋值, 不调用yaml解析器;
+ *        镜像记录源yaml内容的散列, 不一致时退回到yaml加载
+ * @version 0.1
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#ifndef __SERVER_CONFIG_CACHE_H__
+#define __SERVER_CONFIG_CACHE_H__
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+namespace dx {
+
+class ConfigCache {
+public:
+    enum Result {
+        /// 加载失败(源文件读不到或yaml错误)
+        LOAD_ERROR = -1,
+        /// 从镜像加载
+        FROM_CACHE = 0,
+        /// 镜像不存在/损坏/过期, 从yaml加载
+        FROM_YAML = 1
+    };
+
+    /**
+     * @brief 把yaml文件编译成镜像, 多个文件按顺序加载, 后面的覆盖前面的
+     *        先写临时文件再rename, 读端不会看到写了一半的镜像
+     */
+    static bool Compile(const std::vector<std::string>& files, const std::string& cache_file);
+
+    /**
+     * @brief 加载配置, 所有文件的变化作为一个事务提交
+     *
+     * @param  rebuild 退回到yaml加载时是否重新生成镜像
+     * @return Result
+     */
+    static int Load(const std::vector<std::string>& files, const std::string& cache_file, bool rebuild = true);
+
+    /**
+     * @brief 源yaml文件内容的散列, 任何一个文件读取失败返回false
+     */
+    static bool HashSources(const std::vector<std::string>& files, uint64_t& hash);
+};
+
+}
+
+#endif
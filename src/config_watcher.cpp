@@ -0,0 +1,299 @@
+/**
+ * @file config_watcher.cpp
+ * @brief 配置文件热加载
+ * @version 0.1
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include "config_watcher.h"
+#include "config.h"
+#include "log.h"
+#include <sys/inotify.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+
+namespace dx {
+
+static dx::Logger::ptr g_logger = SERVER_LOG_NAME("system");
+
+static uint64_t GetCurrentMS() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000ul + tv.tv_usec / 1000;
+}
+
+static bool IsYamlFile(const std::string& name) {
+    size_t pos = name.rfind('.');
+    if(pos == std::string::npos)
+        return false;
+    std::string ext = name.substr(pos);
+    return ext == ".yml" || ext == ".yaml";
+}
+
+static void SplitPath(const std::string& path, std::string& dir, std::string& name) {
+    size_t pos = path.rfind('/');
+    if(pos == std::string::npos) {
+        dir = ".";
+        name = path;
+    } else {
+        dir = pos ? path.substr(0, pos) : "/";
+        name = path.substr(pos + 1);
+    }
+}
+
+/**
+ * @brief 与 Config::LoarFromYaml 相同的展开规则, 只记录已注册配置项的节点
+ */
+static void FlattenNode(const std::string& prefix, const YAML::Node& node,
+                        std::map<std::string, YAML::Node>& output) {
+    if(prefix.find_first_not_of("abcdefghijklmnopqrstuvwxyz._0123456789") != std::string::npos) {
+        SERVER_LOG_ERROR(g_logger) << "Config invalid name: " << prefix;
+        return;
+    }
+    if(!prefix.empty() && Config::LookupBase(prefix))
+        output[prefix] = node;
+    if(node.IsMap()) {
+        // 与 ListAllMember 一样先校验原始的键, 含大写字母的键和它的子树都被拒绝
+        for(auto it = node.begin(); it != node.end(); it++) {
+            const std::string& key = it->first.Scalar();
+            FlattenNode(prefix.empty() ? key : (prefix + "." + key), it->second, output);
+        }
+    }
+}
+
+ConfigWatcher::ConfigWatcher(uint32_t debounce_ms)
+    :m_debounce(debounce_ms)
+    ,m_stopping(false) {
+    m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(m_fd < 0) {
+        SERVER_LOG_ERROR(g_logger) << "inotify_init1 error errno=" << errno << " " << strerror(errno);
+    }
+    if(pipe2(m_wakeFd, O_NONBLOCK | O_CLOEXEC) != 0) {
+        SERVER_LOG_ERROR(g_logger) << "pipe2 error errno=" << errno << " " << strerror(errno);
+    }
+}
+
+ConfigWatcher::~ConfigWatcher() {
+    Stop();
+    if(m_fd >= 0)
+        close(m_fd);
+    if(m_wakeFd[0] >= 0) {
+        close(m_wakeFd[0]);
+        close(m_wakeFd[1]);
+    }
+}
+
+bool ConfigWatcher::WatchDirNoLock(const std::string& dir) {
+    for(auto& i : m_wds) {
+        if(i.second == dir)
+            return true;
+    }
+    if(m_fd < 0)
+        return false;
+    // 编辑器常用 写临时文件再rename 的方式保存, 所以监听目录而不是文件本身
+    int wd = inotify_add_watch(m_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_MODIFY);
+    if(wd < 0) {
+        SERVER_LOG_ERROR(g_logger) << "inotify_add_watch " << dir << " error errno=" << errno << " " << strerror(errno);
+        return false;
+    }
+    m_wds[wd] = dir;
+    return true;
+}
+
+bool ConfigWatcher::IsWatchedNoLock(const std::string& dir, const std::string& name) const {
+    if(m_dirs.count(dir) && IsYamlFile(name))
+        return true;
+    return m_files.count(dir + "/" + name) > 0;
+}
+
+bool ConfigWatcher::AddFile(const std::string& path) {
+    std::string dir, name;
+    SplitPath(path, dir, name);
+    {
+        MutexType::MutexGuard g(m_mutex);
+        if(!WatchDirNoLock(dir))
+            return false;
+        m_files.insert(dir + "/" + name);
+    }
+    return ReloadFile(dir + "/" + name) >= 0;
+}
+
+bool ConfigWatcher::AddDir(const std::string& path) {
+    std::string dir = path;
+    while(dir.size() > 1 && dir.back() == '/')
+        dir.pop_back();
+    {
+        MutexType::MutexGuard g(m_mutex);
+        if(!WatchDirNoLock(dir))
+            return false;
+        m_dirs.insert(dir);
+    }
+
+    DIR* d = opendir(dir.c_str());
+    if(!d)
+        return false;
+    std::vector<std::string> files;
+    struct dirent* e = nullptr;
+    while((e = readdir(d))) {
+        if(IsYamlFile(e->d_name))
+            files.push_back(dir + "/" + e->d_name);
+    }
+    closedir(d);
+    std::sort(files.begin(), files.end());
+    for(auto& i : files) {
+        ReloadFile(i);
+    }
+    return true;
+}
+
+int ConfigWatcher::ReloadFile(const std::string& path) {
+    YAML::Node root;
+    try {
+        root = YAML::LoadFile(path);
+    } catch(std::exception& e) {
+        SERVER_LOG_ERROR(g_logger) << "ConfigWatcher load " << path << " error: " << e.what();
+        return -1;
+    }
+
+    std::map<std::string, YAML::Node> nodes;
+    FlattenNode("", root, nodes);
+
+    FlatTree tree;
+    for(auto& i : nodes) {
+        // 标量直接比较文本, 只有复杂节点才需要序列化
+        if(i.second.IsScalar()) {
+            tree[i.first] = "=" + i.second.Scalar();
+        } else {
+            std::stringstream ss;
+            ss << i.second;
+            tree[i.first] = ss.str();
+        }
+    }
+
+    std::vector<std::string> changed;
+    {
+        MutexType::MutexGuard g(m_mutex);
+        const FlatTree& old_tree = m_trees[path];
+        for(auto& i : tree) {
+            auto it = old_tree.find(i.first);
+            if(it == old_tree.end() || it->second != i.second)
+                changed.push_back(i.first);
+        }
+    }
+
+    // 在锁外赋值, 监听回调里可以再访问watcher; 整个文件的变化作为一个事务提交
+    ConfigTransaction trans;
+    std::vector<std::string> failed;
+    for(auto& i : changed) {
+        ConfigVarBase::ptr var = Config::LookupBase(i);
+        if(!var || !trans.SetYaml(var.get(), nodes[i]))
+            failed.push_back(i);
+    }
+    trans.Commit();
+
+    {
+        MutexType::MutexGuard g(m_mutex);
+        // 没有生效的键保留上次的内容, 下次加载这个文件时仍然算作变化, 会再次尝试
+        FlatTree& old_tree = m_trees[path];
+        for(auto& i : failed) {
+            auto it = old_tree.find(i);
+            if(it != old_tree.end())
+                tree[i] = it->second;
+            else
+                tree.erase(i);
+        }
+        old_tree.swap(tree);
+    }
+    int applied = changed.size() - failed.size();
+    SERVER_LOG_INFO(g_logger) << "ConfigWatcher reload " << path << " keys=" << nodes.size()
+                              << " changed=" << applied << " failed=" << failed.size();
+    return applied;
+}
+
+void ConfigWatcher::Start() {
+    MutexType::MutexGuard g(m_mutex);
+    if(m_thread || m_fd < 0)
+        return;
+    m_stopping = false;
+    m_thread.reset(new Thread(std::bind(&ConfigWatcher::Loop, this), "config_watcher"));
+}
+
+void ConfigWatcher::Stop() {
+    Thread::ptr thr;
+    {
+        MutexType::MutexGuard g(m_mutex);
+        thr.swap(m_thread);
+    }
+    if(!thr)
+        return;
+    m_stopping = true;
+    if(write(m_wakeFd[1], "x", 1) < 0) {
+        SERVER_LOG_ERROR(g_logger) << "ConfigWatcher wake error errno=" << errno;
+    }
+    thr->Join();
+}
+
+void ConfigWatcher::Loop() {
+    std::set<std::string> pending;  // 等待加载的文件
+    uint64_t last_event = 0;        // 最后一次事件的时间(ms)
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while(!m_stopping) {
+        int timeout = -1;
+        if(!pending.empty()) {
+            uint64_t now = GetCurrentMS();
+            timeout = last_event + m_debounce > now ? last_event + m_debounce - now : 0;
+        }
+
+        struct pollfd fds[2];
+        fds[0].fd = m_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = m_wakeFd[0];
+        fds[1].events = POLLIN;
+        int rt = poll(fds, 2, timeout);
+        if(rt < 0 && errno != EINTR) {
+            SERVER_LOG_ERROR(g_logger) << "ConfigWatcher poll error errno=" << errno << " " << strerror(errno);
+            break;
+        }
+
+        if(rt > 0 && (fds[1].revents & POLLIN)) {
+            char tmp[16];
+            while(read(m_wakeFd[0], tmp, sizeof(tmp)) > 0);
+        }
+
+        if(rt > 0 && (fds[0].revents & POLLIN)) {
+            ssize_t len;
+            while((len = read(m_fd, buf, sizeof(buf))) > 0) {
+                MutexType::MutexGuard g(m_mutex);
+                for(char* p = buf; p < buf + len; ) {
+                    struct inotify_event* ev = (struct inotify_event*)p;
+                    p += sizeof(struct inotify_event) + ev->len;
+                    auto it = m_wds.find(ev->wd);
+                    if(it == m_wds.end() || !ev->len)
+                        continue;
+                    if(IsWatchedNoLock(it->second, ev->name)) {
+                        pending.insert(it->second + "/" + ev->name);
+                        last_event = GetCurrentMS();
+                    }
+                }
+            }
+        }
+
+        if(!pending.empty() && GetCurrentMS() >= last_event + m_debounce) {
+            for(auto& i : pending) {
+                if(access(i.c_str(), R_OK) == 0)
+                    ReloadFile(i);
+            }
+            pending.clear();
+        }
+    }
+}
+
+}
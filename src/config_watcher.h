@@ -0,0 +1,85 @@
+/**
+ * @file config_watcher.h
+ * @brief 配置文件热加载: inotify 监听yaml文件/目录, 防抖后只解析变化的文件,
+ *        与上次解析结果比较, 只对子树真正变化的配置项重新赋值
+ * @version 0.1
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#ifndef __SERVER_CONFIG_WATCHER_H__
+#define __SERVER_CONFIG_WATCHER_H__
+
+#include <memory>
+#include <string>
+#include <map>
+#include <set>
+#include <atomic>
+#include <yaml-cpp/yaml.h>
+#include "thread.h"
+#include "mutex.h"
+
+namespace dx {
+
+class ConfigWatcher {
+public:
+    typedef std::shared_ptr<ConfigWatcher> ptr;
+    typedef SMutex MutexType;
+
+    /**
+     * @brief Construct a new Config Watcher object
+     *
+     * @param  debounce_ms 最后一次文件事件之后等待多久再加载, 合并编辑器的多次写入
+     */
+    ConfigWatcher(uint32_t debounce_ms = 200);
+    ~ConfigWatcher();
+
+    /**
+     * @brief 监听单个yaml文件, 立即加载一次
+     */
+    bool AddFile(const std::string& path);
+
+    /**
+     * @brief 监听目录下的 .yml/.yaml 文件, 立即加载一次
+     */
+    bool AddDir(const std::string& path);
+
+    /**
+     * @brief 启动后台监听线程
+     */
+    void Start();
+    void Stop();
+
+    /**
+     * @brief 重新解析文件并应用变化的配置项
+     *
+     * @return 重新赋值的配置项个数, 解析失败返回 -1
+     */
+    int ReloadFile(const std::string& path);
+
+private:
+    /**
+     * @brief 配置名 -> 节点序列化结果, 只记录已注册的配置项
+     */
+    typedef std::map<std::string, std::string> FlatTree;
+
+    bool WatchDirNoLock(const std::string& dir);
+    bool IsWatchedNoLock(const std::string& dir, const std::string& name) const;
+    void Loop();
+
+private:
+    uint32_t    m_debounce;
+    int         m_fd = -1;                  // inotify
+    int         m_wakeFd[2] = {-1, -1};     // Stop 唤醒
+    std::map<int, std::string> m_wds;       // watch descriptor -> 目录
+    std::set<std::string> m_files;          // 单独监听的文件
+    std::set<std::string> m_dirs;           // 整个监听的目录
+    std::map<std::string, FlatTree> m_trees;// 每个文件上次解析结果
+    Thread::ptr m_thread;
+    std::atomic<bool> m_stopping;
+    MutexType   m_mutex;
+};
+
+}
+
+#endif
@@ -0,0 +1,499 @@
+/**
+ * @file epoch.cpp
+ * @brief 基于纪元的内存回收 和 风险指针
+ * @version 0.1
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include "epoch.h"
+#include "mutex.h"
+#include "macro.h"
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+
+namespace dx {
+
+namespace {
+
+struct Retired {
+    void* ptr;
+    void (*deleter)(void*);
+    uint64_t epoch;     // EBR: 退休时的全局纪元
+};
+
+/**
+ * @brief 已退出线程留下的未回收对象
+ */
+struct OrphanList {
+    SMutex mutex;
+    std::vector<Retired> list;
+    std::atomic<size_t> size;
+
+    OrphanList() : size(0) {}
+
+    void Add(std::vector<Retired>& items) {
+        if(items.empty())
+            return;
+        SMutex::MutexGuard g(mutex);
+        list.insert(list.end(), items.begin(), items.end());
+        size.store(list.size(), std::memory_order_relaxed);
+        items.clear();
+    }
+};
+
+/**
+ * @brief 全局统计, 各线程攒一批再加, 避免每次退休都写同一个缓存行
+ */
+struct ReclaimStats {
+    std::atomic<uint64_t> retired;
+    std::atomic<uint64_t> reclaimed;
+    ReclaimStats() : retired(0), reclaimed(0) {}
+};
+
+}
+
+//////////////////////////////////////////////////////////////////////
+// EBR
+
+namespace {
+
+enum { EBR_COLLECT_THRESHOLD = 64 };
+
+/**
+ * @brief 每个线程一个记录, 挂在全局链表上, 只增不删, 线程退出后给新线程复用
+ */
+struct EpochRecord {
+    char pad0[64];
+    std::atomic<uint64_t> state;    // (纪元 << 1) | 是否在临界区
+    char pad1[64 - sizeof(std::atomic<uint64_t>)];
+    std::atomic<bool> in_use;
+    EpochRecord* next = nullptr;
+    // 以下只由持有记录的线程访问
+    uint32_t nest = 0;
+    std::deque<Retired> limbo;      // 按退休纪元递增
+    uint64_t unflushed = 0;         // 还没有计入全局统计的退休个数
+
+    EpochRecord() : state(0), in_use(true) {}
+};
+
+static std::atomic<uint64_t> s_epoch(1);
+static std::atomic<EpochRecord*> s_records(nullptr);
+
+static OrphanList& GetEpochOrphans() {
+    static OrphanList* s_orphans = new OrphanList;
+    return *s_orphans;
+}
+
+static ReclaimStats& GetEpochStats() {
+    static ReclaimStats* s_stats = new ReclaimStats;
+    return *s_stats;
+}
+
+/**
+ * @brief 非对称屏障: 推进纪元的一方调用 membarrier 让所有运行中的线程执行一次完整屏障,
+ *  读端进入临界区只需要编译器屏障; 内核不支持时两边都退回普通的 seq_cst 屏障
+ */
+static bool UseMembarrier() {
+    static const bool s_enabled = syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0;
+    return s_enabled;
+}
+
+static thread_local EpochRecord* t_record = nullptr;
+
+struct EpochThreadHolder {
+    bool registered = false;
+    ~EpochThreadHolder() {
+        EpochManager::ThreadExit();
+    }
+};
+
+static thread_local EpochThreadHolder t_epochHolder;
+
+static EpochRecord* AcquireRecord() {
+    for(EpochRecord* r = s_records.load(std::memory_order_acquire); r; r = r->next) {
+        bool expected = false;
+        if(!r->in_use.load(std::memory_order_relaxed)
+                && r->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            return r;
+        }
+    }
+    EpochRecord* r = new EpochRecord;
+    EpochRecord* head = s_records.load(std::memory_order_relaxed);
+    do {
+        r->next = head;
+    } while(!s_records.compare_exchange_weak(head, r, std::memory_order_release, std::memory_order_relaxed));
+    return r;
+}
+
+static EpochRecord* GetRecord() {
+    if(!t_record) {
+        t_record = AcquireRecord();
+        // 线程局部变量析构时交出记录
+        t_epochHolder.registered = true;
+    }
+    return t_record;
+}
+
+/**
+ * @brief 释放退休纪元 + 2 <= epoch 的对象
+ */
+static uint64_t FreeExpired(std::deque<Retired>& limbo, uint64_t epoch) {
+    uint64_t n = 0;
+    while(!limbo.empty() && limbo.front().epoch + 2 <= epoch) {
+        Retired r = limbo.front();
+        limbo.pop_front();
+        r.deleter(r.ptr);
+        ++n;
+    }
+    return n;
+}
+
+static uint64_t FreeExpiredOrphans(uint64_t epoch, bool wait) {
+    OrphanList& orphans = GetEpochOrphans();
+    if(orphans.size.load(std::memory_order_relaxed) == 0)
+        return 0;
+    std::vector<Retired> expired;
+    if(wait) {
+        orphans.mutex.Lock();
+    } else if(!orphans.mutex.TryLock()) {
+        return 0;
+    }
+    auto it = std::partition(orphans.list.begin(), orphans.list.end(), [epoch](const Retired& r) {
+        return r.epoch + 2 > epoch;
+    });
+    expired.assign(it, orphans.list.end());
+    orphans.list.erase(it, orphans.list.end());
+    orphans.size.store(orphans.list.size(), std::memory_order_relaxed);
+    orphans.mutex.Unlock();
+
+    // 在锁外调用 deleter, deleter 里可以再退休对象
+    for(auto& r : expired) {
+        r.deleter(r.ptr);
+    }
+    return expired.size();
+}
+
+static void Collect(EpochRecord* rec, bool wait) {
+    EpochManager::TryAdvance();
+    uint64_t epoch = s_epoch.load(std::memory_order_acquire);
+    uint64_t freed = FreeExpired(rec->limbo, epoch) + FreeExpiredOrphans(epoch, wait);
+    ReclaimStats& stats = GetEpochStats();
+    if(rec->unflushed) {
+        stats.retired.fetch_add(rec->unflushed, std::memory_order_relaxed);
+        rec->unflushed = 0;
+    }
+    if(freed)
+        stats.reclaimed.fetch_add(freed, std::memory_order_relaxed);
+}
+
+}
+
+void EpochManager::Enter() {
+    EpochRecord* r = GetRecord();
+    if(r->nest++ == 0) {
+        r->state.store((s_epoch.load(std::memory_order_relaxed) << 1) | 1, std::memory_order_relaxed);
+        // 宣布进入临界区 先于 读取共享指针
+        if(UseMembarrier())
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+        else
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+}
+
+void EpochManager::Leave() {
+    EpochRecord* r = t_record;
+    SERVER_ASSERT(r && r->nest > 0);
+    if(--r->nest == 0)
+        r->state.store(0, std::memory_order_release);
+}
+
+bool EpochManager::InCritical() {
+    EpochRecord* r = t_record;
+    return r && r->nest > 0;
+}
+
+void EpochManager::Retire(void* ptr, Deleter deleter) {
+    EpochRecord* r = GetRecord();
+    Retired item = {ptr, deleter, s_epoch.load(std::memory_order_acquire)};
+    r->limbo.push_back(item);
+    ++r->unflushed;
+    if(r->limbo.size() % EBR_COLLECT_THRESHOLD == 0)
+        Collect(r, false);
+}
+
+void EpochManager::Quiescent() {
+    EpochRecord* r = t_record;
+    if(r && r->nest == 0 && !r->limbo.empty()) {
+        Collect(r, false);
+    } else if(GetEpochOrphans().size.load(std::memory_order_relaxed)) {
+        TryAdvance();
+        uint64_t freed = FreeExpiredOrphans(s_epoch.load(std::memory_order_acquire), false);
+        if(freed)
+            GetEpochStats().reclaimed.fetch_add(freed, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief 是否所有处于临界区的线程都已经看到 epoch
+ */
+static bool AllAtEpoch(uint64_t epoch) {
+    for(EpochRecord* r = s_records.load(std::memory_order_acquire); r; r = r->next) {
+        uint64_t state = r->state.load(std::memory_order_seq_cst);
+        if((state & 1) && (state >> 1) != epoch)
+            return false;
+    }
+    return true;
+}
+
+bool EpochManager::TryAdvance() {
+    uint64_t epoch = s_epoch.load(std::memory_order_seq_cst);
+    if(UseMembarrier()) {
+        // 先不带屏障检查一遍, 有线程停留在旧纪元时不必发起系统调用
+        if(!AllAtEpoch(epoch))
+            return false;
+        syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+    }
+    if(!AllAtEpoch(epoch))
+        return false;
+    // 失败说明其他线程已经推进了
+    return s_epoch.compare_exchange_strong(epoch, epoch + 1, std::memory_order_acq_rel);
+}
+
+void EpochManager::Synchronize() {
+    EpochRecord* r = GetRecord();
+    SERVER_ASSERT(r->nest == 0);
+    uint64_t target = s_epoch.load(std::memory_order_acquire) + 2;
+    while(s_epoch.load(std::memory_order_acquire) < target) {
+        if(!TryAdvance())
+            sched_yield();
+    }
+    Collect(r, true);
+}
+
+void EpochManager::ThreadExit() {
+    EpochRecord* r = t_record;
+    if(!r)
+        return;
+    t_record = nullptr;
+    r->nest = 0;
+    r->state.store(0, std::memory_order_release);
+    if(r->unflushed) {
+        GetEpochStats().retired.fetch_add(r->unflushed, std::memory_order_relaxed);
+        r->unflushed = 0;
+    }
+    std::vector<Retired> rest(r->limbo.begin(), r->limbo.end());
+    r->limbo.clear();
+    GetEpochOrphans().Add(rest);
+    r->in_use.store(false, std::memory_order_release);
+}
+
+uint64_t EpochManager::GetEpoch() {
+    return s_epoch.load(std::memory_order_acquire);
+}
+
+uint64_t EpochManager::GetRetiredCount() {
+    return GetEpochStats().retired.load(std::memory_order_relaxed);
+}
+
+uint64_t EpochManager::GetReclaimedCount() {
+    return GetEpochStats().reclaimed.load(std::memory_order_relaxed);
+}
+
+//////////////////////////////////////////////////////////////////////
+// 风险指针
+
+/**
+ * @brief 全局槽位, 挂在链表上只增不删
+ */
+struct HazardSlot {
+    char pad0[64];
+    std::atomic<const void*> ptr;
+    char pad1[64 - sizeof(std::atomic<const void*>)];
+    std::atomic<bool> in_use;
+    HazardSlot* next = nullptr;
+
+    HazardSlot() : ptr(nullptr), in_use(true) {}
+};
+
+namespace {
+
+enum { HP_SCAN_MIN = 64, HP_SLOT_CACHE = 8 };
+
+static std::atomic<HazardSlot*> s_slots(nullptr);
+static std::atomic<uint32_t> s_slotCount(0);
+
+static OrphanList& GetHazardOrphans() {
+    static OrphanList* s_orphans = new OrphanList;
+    return *s_orphans;
+}
+
+static ReclaimStats& GetHazardStats() {
+    static ReclaimStats* s_stats = new ReclaimStats;
+    return *s_stats;
+}
+
+/**
+ * @brief 线程缓存的空闲槽位和待回收对象
+ */
+struct HazardThread {
+    std::vector<HazardSlot*> cache;
+    std::vector<Retired> retired;
+    uint64_t unflushed = 0;
+    bool exited = false;
+
+    ~HazardThread() {
+        HazardPointer::ThreadExit();
+        exited = true;
+    }
+};
+
+static thread_local HazardThread t_hazard;
+
+static HazardSlot* AcquireSlot() {
+    if(!t_hazard.exited && !t_hazard.cache.empty()) {
+        HazardSlot* s = t_hazard.cache.back();
+        t_hazard.cache.pop_back();
+        return s;
+    }
+    for(HazardSlot* s = s_slots.load(std::memory_order_acquire); s; s = s->next) {
+        bool expected = false;
+        if(!s->in_use.load(std::memory_order_relaxed)
+                && s->in_use.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+            return s;
+        }
+    }
+    HazardSlot* s = new HazardSlot;
+    HazardSlot* head = s_slots.load(std::memory_order_relaxed);
+    do {
+        s->next = head;
+    } while(!s_slots.compare_exchange_weak(head, s, std::memory_order_release, std::memory_order_relaxed));
+    s_slotCount.fetch_add(1, std::memory_order_relaxed);
+    return s;
+}
+
+static void ReleaseSlot(HazardSlot* s) {
+    s->ptr.store(nullptr, std::memory_order_release);
+    if(!t_hazard.exited && t_hazard.cache.size() < HP_SLOT_CACHE) {
+        t_hazard.cache.push_back(s);
+        return;
+    }
+    s->in_use.store(false, std::memory_order_release);
+}
+
+/**
+ * @brief 释放 items 中没有被任何槽位保护的对象, 被保护的留在 items 中
+ */
+static uint64_t ScanItems(std::vector<Retired>& items) {
+    if(items.empty())
+        return 0;
+    // 摘下对象 先于 读取槽位
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    std::vector<const void*> hazards;
+    for(HazardSlot* s = s_slots.load(std::memory_order_acquire); s; s = s->next) {
+        const void* p = s->ptr.load(std::memory_order_seq_cst);
+        if(p)
+            hazards.push_back(p);
+    }
+    std::sort(hazards.begin(), hazards.end());
+
+    std::vector<Retired> keep;
+    std::vector<Retired> expired;
+    for(auto& r : items) {
+        if(std::binary_search(hazards.begin(), hazards.end(), (const void*)r.ptr))
+            keep.push_back(r);
+        else
+            expired.push_back(r);
+    }
+    items.swap(keep);
+    for(auto& r : expired) {
+        r.deleter(r.ptr);
+    }
+    return expired.size();
+}
+
+}
+
+HazardPointer::HazardPointer()
+    :m_slot(AcquireSlot()) {
+}
+
+HazardPointer::~HazardPointer() {
+    ReleaseSlot(m_slot);
+}
+
+void HazardPointer::Set(const void* ptr) {
+    m_slot->ptr.store(ptr, std::memory_order_seq_cst);
+}
+
+void HazardPointer::Reset() {
+    m_slot->ptr.store(nullptr, std::memory_order_release);
+}
+
+void HazardPointer::Retire(void* ptr, Deleter deleter) {
+    if(t_hazard.exited) {
+        // 线程局部数据已析构, 直接交给全局
+        std::vector<Retired> one(1, Retired{ptr, deleter, 0});
+        GetHazardOrphans().Add(one);
+        GetHazardStats().retired.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    t_hazard.retired.push_back(Retired{ptr, deleter, 0});
+    ++t_hazard.unflushed;
+    // 阈值与槽位数成正比, 每次扫描至少回收一半
+    size_t threshold = std::max<size_t>(HP_SCAN_MIN, 2 * s_slotCount.load(std::memory_order_relaxed));
+    if(t_hazard.retired.size() >= threshold)
+        Scan();
+}
+
+void HazardPointer::Scan() {
+    uint64_t freed = 0;
+    if(!t_hazard.exited) {
+        freed += ScanItems(t_hazard.retired);
+        if(t_hazard.unflushed) {
+            GetHazardStats().retired.fetch_add(t_hazard.unflushed, std::memory_order_relaxed);
+            t_hazard.unflushed = 0;
+        }
+    }
+
+    OrphanList& orphans = GetHazardOrphans();
+    if(orphans.size.load(std::memory_order_relaxed) && orphans.mutex.TryLock()) {
+        std::vector<Retired> items;
+        items.swap(orphans.list);
+        orphans.size.store(0, std::memory_order_relaxed);
+        orphans.mutex.Unlock();
+        freed += ScanItems(items);
+        orphans.Add(items);
+    }
+    if(freed)
+        GetHazardStats().reclaimed.fetch_add(freed, std::memory_order_relaxed);
+}
+
+void HazardPointer::ThreadExit() {
+    if(t_hazard.exited)
+        return;
+    Scan();
+    if(t_hazard.unflushed) {
+        GetHazardStats().retired.fetch_add(t_hazard.unflushed, std::memory_order_relaxed);
+        t_hazard.unflushed = 0;
+    }
+    GetHazardOrphans().Add(t_hazard.retired);
+    for(auto s : t_hazard.cache) {
+        s->in_use.store(false, std::memory_order_release);
+    }
+    t_hazard.cache.clear();
+}
+
+uint64_t HazardPointer::GetRetiredCount() {
+    return GetHazardStats().retired.load(std::memory_order_relaxed);
+}
+
+uint64_t HazardPointer::GetReclaimedCount() {
+    return GetHazardStats().reclaimed.load(std::memory_order_relaxed);
+}
+
+}
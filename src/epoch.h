@@ -0,0 +1,182 @@
+/**
+ * @file epoch.h
+ * @brief 无锁结构的内存回收: 基于纪元的回收(EBR) 和 风险指针(hazard pointer)
+ *  EBR 读端只有进入/离开临界区的开销, 适合短时间持有的引用;
+ *  风险指针逐个保护指针, 长时间持有引用时不会阻塞其他对象的回收
+ * @version 0.1
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#ifndef __SERVER_EPOCH_H__
+#define __SERVER_EPOCH_H__
+
+#include <atomic>
+#include <stdint.h>
+
+namespace dx {
+
+/**
+ * @brief 基于纪元的内存回收
+ *  读端在 EpochGuard 内访问共享指针, 写端把对象从结构中摘下后 Retire;
+ *  全局纪元只有在所有处于临界区的线程都看到当前纪元后才能前进,
+ *  在纪元 e 退休的对象, 全局纪元到达 e+2 时已经没有线程能引用它, 可以释放
+ *
+ *  {
+ *      EpochGuard g;
+ *      Node* n = head.load(std::memory_order_acquire);
+ *      ...
+ *  }
+ *  Node* old = head.exchange(new_node);
+ *  EpochManager::Retire(old);
+ *
+ *  dx::Thread 退出时交出未回收的对象, 调度器工作线程每次循环经过一次静止点
+ */
+class EpochManager {
+public:
+    typedef void (*Deleter)(void*);
+
+    /**
+     * @brief 进入临界区, 可以嵌套
+     */
+    static void Enter();
+    static void Leave();
+
+    /**
+     * @brief 调用线程是否在临界区内, 在临界区内不能调用 Synchronize
+     */
+    static bool InCritical();
+
+    /**
+     * @brief 对象已从共享结构中摘下, 等到没有线程能引用它时调用 deleter
+     */
+    static void Retire(void* ptr, Deleter deleter);
+
+    template<class T>
+    static void Retire(T* ptr) {
+        Retire(ptr, &DeleteObject<T>);
+    }
+
+    /**
+     * @brief 静止点: 调用线程不在临界区内, 尝试推进纪元并回收本线程已到期的对象
+     *  没有待回收对象时只是一次线程局部变量的检查
+     */
+    static void Quiescent();
+
+    /**
+     * @brief 尝试推进全局纪元, 有线程还停留在旧纪元时失败
+     */
+    static bool TryAdvance();
+
+    /**
+     * @brief 等待调用前退休的所有对象(包括已退出线程留下的)都被回收, 不能在临界区内调用
+     */
+    static void Synchronize();
+
+    /**
+     * @brief 线程退出: 未回收的对象交给全局链表, 由其他线程回收; 线程记录留给新线程复用
+     */
+    static void ThreadExit();
+
+    static uint64_t GetEpoch();
+
+    /**
+     * @brief 累计退休/回收的对象个数
+     */
+    static uint64_t GetRetiredCount();
+    static uint64_t GetReclaimedCount();
+
+private:
+    template<class T>
+    static void DeleteObject(void* ptr) {
+        delete static_cast<T*>(ptr);
+    }
+};
+
+/**
+ * @brief EBR 临界区守卫
+ */
+class EpochGuard {
+public:
+    EpochGuard() { EpochManager::Enter(); }
+    ~EpochGuard() { EpochManager::Leave(); }
+private:
+    EpochGuard(const EpochGuard&) = delete;
+    EpochGuard& operator=(const EpochGuard&) = delete;
+};
+
+struct HazardSlot;
+
+/**
+ * @brief 风险指针: 每个实例占用一个全局可见的槽位, 保护一个指针
+ *  HazardPointer hp;
+ *  Node* n = hp.Protect(head);
+ *  ... 任意长时间使用 n ...
+ *  hp.Reset();
+ *  回收时扫描所有槽位, 被任何槽位保护的对象推迟到下次扫描
+ */
+class HazardPointer {
+public:
+    typedef void (*Deleter)(void*);
+
+    HazardPointer();
+    ~HazardPointer();
+
+    /**
+     * @brief 读取并保护 src 当前指向的对象, 返回后在 Reset 之前对象不会被释放
+     */
+    template<class T>
+    T* Protect(const std::atomic<T*>& src) {
+        T* p = src.load(std::memory_order_relaxed);
+        while(true) {
+            Set(p);
+            // 设置槽位与重新读取之间需要 StoreLoad 顺序
+            T* q = src.load(std::memory_order_seq_cst);
+            if(p == q)
+                return p;
+            p = q;
+        }
+    }
+
+    /**
+     * @brief 直接保护一个指针, 调用方需要自己确认设置之后对象仍然可达
+     */
+    void Set(const void* ptr);
+    void Reset();
+
+    static void Retire(void* ptr, Deleter deleter);
+
+    template<class T>
+    static void Retire(T* ptr) {
+        Retire(ptr, &DeleteObject<T>);
+    }
+
+    /**
+     * @brief 立即扫描, 回收本线程以及已退出线程留下的、没有被保护的对象
+     */
+    static void Scan();
+
+    /**
+     * @brief 线程退出: 未回收的对象和缓存的槽位交回全局
+     */
+    static void ThreadExit();
+
+    static uint64_t GetRetiredCount();
+    static uint64_t GetReclaimedCount();
+
+private:
+    template<class T>
+    static void DeleteObject(void* ptr) {
+        delete static_cast<T*>(ptr);
+    }
+
+    HazardPointer(const HazardPointer&) = delete;
+    HazardPointer& operator=(const HazardPointer&) = delete;
+
+private:
+    HazardSlot* m_slot;
+};
+
+}
+
+#endif
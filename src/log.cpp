@@ -15,8 +15,24 @@
 #include <time.h>
 #include <string>
 #include <stdarg.h>
+#include <deque>
+#include <algorithm>
+#include <signal.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <zlib.h>
+#include <string.h>
 #include "config.h"
 #include "thread.h"
+#include "epoch.h"
 
 namespace dx {
 
@@ -80,6 +96,14 @@ public:
     MessageFormatItem(const std::string &fmt = ""){}
     void Format(std::ostream& os, std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) override {
         os << event->GetContent();
+        // 结构化字段以 key=value 跟在正文后
+        event->VisitFields([&os](const char* key, uint32_t key_len, LogEvent::FieldType type, 
+                                 const char* val, uint32_t val_len) {
+            os << ' ';
+            os.write(key, key_len);
+            os << '=';
+            os.write(val, val_len);
+        });
     }
 };
 
@@ -191,7 +215,8 @@ class NewLineFormatItem : public LogFormatter::FormatItem {
 public:
     NewLineFormatItem(const std::string &fmt = ""){}
     void Format(std::ostream& os, Logger::ptr logger, LogLevel::Level level, LogEvent::ptr event) override {
-        os << std::endl;
+        // os 是格式化用的 stringstream, std::endl 的flush对它没有作用, 只输出换行
+        os << '\n';
     }
 };
 
@@ -214,10 +239,9 @@ public:
     }
 };
 
-LogEventWrap::LogEventWrap(LogEvent::ptr ptr)
+LogEventWrap::LogEventWrap(LogEvent::ptr ptr, bool forced)
     :m_event(ptr) {
-
-
+    m_event->SetForced(forced);
 }
 LogEventWrap::~LogEventWrap() {
     m_event->GetLogger()->Log(m_event->GetLevel(), m_event);
@@ -265,6 +289,20 @@ void LogEvent::Format(const char* fmt, ...) {
     va_end(al);
 }
 
+void LogEvent::AddField(const char* key, uint32_t key_len, FieldType type, const char* val, uint32_t val_len) {
+    size_t pos = m_fields.size();
+    m_fields.resize(pos + sizeof(key_len) + key_len + 1 + sizeof(val_len) + val_len);
+    char* p = &m_fields[pos];
+    memcpy(p, &key_len, sizeof(key_len));
+    p += sizeof(key_len);
+    memcpy(p, key, key_len);
+    p += key_len;
+    *p++ = (char)type;
+    memcpy(p, &val_len, sizeof(val_len));
+    p += sizeof(val_len);
+    memcpy(p, val, val_len);
+}
+
 void LogEvent::Format(const char* fmt, va_list al) {
     char* buf = nullptr;
     int len = vasprintf(&buf, fmt, al);
@@ -283,30 +321,46 @@ void LogEvent::Format(const char* fmt, va_list al) {
  */
 Logger::Logger(const std::string name)
     : m_name(name),
-    m_level(LogLevel::DEBUG) {
+    m_level(LogLevel::DEBUG),
+    m_captureLevel(LogLevel::DEBUG),
+    m_appenders(new AppenderList) {
     m_formatter.reset(new LogFormatter("%d{%Y-%m-%d %H:%M:%S}%T%t%T%N%T%F%T[%p]%T[%c]%T%f:%l%T%m%n"));
 
 }
 
+Logger::~Logger() {
+    delete m_appenders.load(std::memory_order_relaxed);
+}
+
 /**
  * @brief Logger 的打印日志函数
+ *  在 EpochGuard 内读取Appender集合, 不持有Logger锁, 各Appender自行负责同步
+ *  低于logger级别但不低于捕获级别的日志只交给记录器Appender
  * 
  * @param  level
  * @param  event
  */
 void Logger::Log(LogLevel::Level level, const LogEvent::ptr event) {
-    if(level >= m_level) {
+    if(level >= m_level || event->IsForced()) {
         auto self = shared_from_this();
         
-        MutexType::MutexGuard g(m_lock);
-        if(!m_appenders.empty()) {
-            for(auto& i : m_appenders) {
+        EpochGuard g;
+        const AppenderList* appenders = GetAppenders();
+        if(!appenders->empty()) {
+            for(auto& i : *appenders) {
                 i->Log(self, level, event);
             }
 
         } else if(m_root) {
             m_root->Log(level, event);
         }
+    } else if(level >= m_captureLevel) {
+        auto self = shared_from_this();
+        EpochGuard g;
+        for(auto& i : *GetAppenders()) {
+            if(i->IsRecorder())
+                i->Log(self, level, event);
+        }
     }
 }
 
@@ -327,7 +381,7 @@ std::string Logger::ToYamlString() {
     if(m_formatter)
         node["formatter"] = m_formatter->GetPattern();
     
-    for(auto& i : m_appenders) {
+    for(auto& i : *GetAppenders()) {
         node["appenders"].push_back(YAML::Load(i->ToYamlString()));
     }
     
@@ -335,6 +389,32 @@ std::string Logger::ToYamlString() {
     return ss.str();
 }
 
+/**
+ * @brief 设置日志级别, 所有调用点缓存的判断结果失效
+ * 
+ * @param  val
+ */
+void Logger::SetLevel(LogLevel::Level val) {
+    {
+        MutexType::MutexGuard g(m_lock);
+        m_level = val;
+        UpdateCaptureLevelNoLock();
+    }
+    LogSiteMgr::GetInstance()->Invalidate();
+}
+
+bool Logger::UpdateCaptureLevelNoLock() {
+    LogLevel::Level level = m_level;
+    for(auto& i : *GetAppenders()) {
+        if(i->IsRecorder() && i->GetLevel() < level)
+            level = i->GetLevel();
+    }
+    if(level == m_captureLevel)
+        return false;
+    m_captureLevel = level;
+    return true;
+}
+
 void Logger::Debug(LogEvent::ptr event) {
     Log(LogLevel::DEBUG, event);
 } 
@@ -355,49 +435,92 @@ void Logger::Fatal(LogEvent::ptr event) {
     Log(LogLevel::FATAL, event);
 }
 
+/**
+ * @brief 添加Appender, 复制一份新的集合后整体替换
+ * 
+ * @param  appender
+ */
 void Logger::AddAppender(LogAppender::ptr appender) {
-    MutexType::MutexGuard g(m_lock);
-    
-    if(!appender->HasForamtter()) {
-        MutexType::MutexGuard apg(appender->m_lock);
-        appender->m_formatter = m_formatter;
+    bool changed = false;
+    {
+        MutexType::MutexGuard g(m_lock);
+        
+        if(!appender->HasForamtter()) {
+            MutexType::MutexGuard apg(appender->m_lock);
+            appender->m_formatter = m_formatter;
+        }
+        AppenderList* list = new AppenderList(*GetAppenders());
+        list->push_back(appender);
+        SetAppendersNoLock(list);
+        changed = UpdateCaptureLevelNoLock();
     }
-    m_appenders.push_back(appender);
+    ReclaimAppenders();
+    // 捕获级别变化后调用点缓存的判断结果失效
+    if(changed)
+        LogSiteMgr::GetInstance()->Invalidate();
 }
 
 /**
- * @brief 
+ * @brief 删除Appender, 复制一份新的集合后整体替换
  * 
  * @param  appender         
  */
 void Logger::DelAppender(LogAppender::ptr appender) {
-    MutexType::MutexGuard g(m_lock);
-    
-    for(auto it = m_appenders.begin();
-        it != m_appenders.end(); it++) {
-        if(*it == appender) {
-            m_appenders.erase(it);
-            break;
-        }
+    bool changed = false;
+    {
+        MutexType::MutexGuard g(m_lock);
+        
+        const AppenderList* cur = GetAppenders();
+        auto it = std::find(cur->begin(), cur->end(), appender);
+        if(it == cur->end())
+            return;
+        AppenderList* list = new AppenderList(*cur);
+        list->erase(list->begin() + (it - cur->begin()));
+        SetAppendersNoLock(list);
+        changed = UpdateCaptureLevelNoLock();
     }
+    ReclaimAppenders();
+    if(changed)
+        LogSiteMgr::GetInstance()->Invalidate();
 }
 
 void Logger::ClearAppenders() {
-    MutexType::MutexGuard g(m_lock);
-    m_appenders.clear();
+    bool changed = false;
+    {
+        MutexType::MutexGuard g(m_lock);
+        SetAppendersNoLock(new AppenderList);
+        changed = UpdateCaptureLevelNoLock();
+    }
+    ReclaimAppenders();
+    if(changed)
+        LogSiteMgr::GetInstance()->Invalidate();
 }
 
-void Logger::SetFormatter(LogFormatter::ptr val) {
-    MutexType::MutexGuard g(m_lock);
+void Logger::SetAppendersNoLock(AppenderList* val) {
+    const AppenderList* old = m_appenders.exchange(val, std::memory_order_acq_rel);
+    EpochManager::Retire(const_cast<AppenderList*>(old));
+}
 
+void Logger::ReclaimAppenders() {
+    // 在临界区内(例如某个Appender的Log里)修改时不能等待, 旧集合留给之后的回收
+    if(!EpochManager::InCritical())
+        EpochManager::Synchronize();
+}
+
+void Logger::SetFormatterNoLock(LogFormatter::ptr val) {
     m_formatter = val;
-    for(auto& i : m_appenders) {
+    for(auto& i : *GetAppenders()) {
         MutexType::MutexGuard pg(i->m_lock);
         if(!i->HasForamtter())
             i->m_formatter = m_formatter;
     }
 }
 
+void Logger::SetFormatter(LogFormatter::ptr val) {
+    MutexType::MutexGuard g(m_lock);
+    SetFormatterNoLock(val);
+}
+
 void Logger::SetFormatter(const std::string& val) {
     MutexType::MutexGuard g(m_lock);
 
@@ -405,7 +528,7 @@ void Logger::SetFormatter(const std::string& val) {
     if(new_val->IsError())
         std::cout << "Logger::SetFoammtter name= " << m_name << "value=" << val << "invalid formatter" << std::endl;
 
-    SetFormatter(new_val);
+    SetFormatterNoLock(new_val);
 }
 
 LogFormatter::ptr Logger::GetFormatter() {
@@ -446,8 +569,38 @@ LogFormatter::ptr LogAppender::GetFormatter() {
     return nullptr;
 }
 
-StdoutLogAppender::StdoutLogAppender(){}
-StdoutLogAppender::~StdoutLogAppender(){}
+/**
+ * @brief 获取当前实际使用的formatter(自身或继承自Logger)
+ * 
+ * @return LogFormatter::ptr 
+ */
+LogFormatter::ptr LogAppender::GetCurFormatter() {
+    MutexType::MutexGuard g(m_lock);
+    return m_formatter;
+}
+
+/**
+ * @brief 输出appender自己的formatter: JSON格式器输出 format: json, 否则输出pattern
+ */
+static void FormatterToYaml(YAML::Node& node, LogFormatter::ptr fmt) {
+    if(std::dynamic_pointer_cast<JsonLogFormatter>(fmt))
+        node["format"] = "json";
+    else
+        node["formatter"] = fmt->GetPattern();
+}
+
+StdoutLogAppender::StdoutLogAppender(bool direct)
+    : m_direct(direct),
+    m_dropped(0) {
+}
+
+/**
+ * @brief 写线程总会写空缓冲, 这里只是兜底
+ */
+StdoutLogAppender::~StdoutLogAppender() {
+    if(!m_pending.empty())
+        WriteAll(m_pending.data(), m_pending.size());
+}
 
 /**
  * @brief 打印到控制台的日志
@@ -457,10 +610,92 @@ StdoutLogAppender::~StdoutLogAppender(){}
  * @param  event            
  */
 void StdoutLogAppender::Log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) {
-    if(level >= m_level) {
+    if(level >= m_level || event->IsForced()) {
+        // 格式化在锁外进行, 锁只保护输出
+        std::string str = GetCurFormatter()->Format(logger, level, event);
+        if(m_direct) {
+            WriteDirect(str);
+            return;
+        }
+        MutexType::MutexGuard g(m_lock);
+        // 非direct模式每条记录flush一次, 输出重定向到管道或文件时也能及时看到
+        std::cout << str << std::flush;
+    }
+}
+
+/**
+ * @brief 记录先追加到待写缓冲, 没有线程在写时当前线程成为写线程,
+ *  在锁外把积累的记录一次write出去, 直到缓冲为空才交出写线程身份, 不会把记录留在缓冲里没人写
+ *  待写缓冲超过 MAX_PENDING 时丢弃新记录, write失败时丢弃这一批, 都计入丢弃条数
+ * 
+ * @param  str 格式化后的整条记录
+ */
+void StdoutLogAppender::WriteDirect(const std::string& str) {
+    {
         MutexType::MutexGuard g(m_lock);
-        std::cout << m_formatter->Format(logger, level, event);
+        if(m_pending.size() + str.size() > MAX_PENDING) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        m_pending.append(str);
+        ++m_pendingCount;
+        if(m_writing)
+            return;
+        m_writing = true;
+    }
+
+    std::string buf;
+    while(true) {
+        uint64_t count = 0;
+        {
+            MutexType::MutexGuard g(m_lock);
+            if(m_pending.empty()) {
+                m_writing = false;
+                return;
+            }
+            // 交换后 m_pending 复用 buf 的内存
+            buf.clear();
+            buf.swap(m_pending);
+            count = m_pendingCount;
+            m_pendingCount = 0;
+        }
+
+        int err = WriteAll(buf.data(), buf.size());
+        if(err) {
+            m_dropped.fetch_add(count, std::memory_order_relaxed);
+            // 同一个错误只在stderr提示一次
+            if(err != m_lastErrno) {
+                std::cerr << "StdoutLogAppender write fail errno=" << err << " " << strerror(err)
+                          << " dropped=" << GetDropped() << std::endl;
+            }
+        }
+        m_lastErrno = err;
+    }
+}
+
+/**
+ * @brief 写出全部数据, 标准输出是非阻塞的管道时等待可写
+ * 
+ * @return int 0 成功, 否则为errno
+ */
+int StdoutLogAppender::WriteAll(const char* data, size_t len) {
+    while(len) {
+        ssize_t n = write(STDOUT_FILENO, data, len);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd = {STDOUT_FILENO, POLLOUT, 0};
+                if(poll(&pfd, 1, 1000) > 0)
+                    continue;
+                return EAGAIN;
+            }
+            return errno;
+        }
+        data += n;
+        len -= n;
     }
+    return 0;
 }
 
 /**
@@ -473,11 +708,13 @@ std::string StdoutLogAppender::ToYamlString() {
     
     YAML::Node node;
     node["type"] = "StdoutLogAppender";
+    if(m_direct)
+        node["direct"] = true;
     
     if(m_level != LogLevel::UNKNOW)
         node["level"] = LogLevel::ToString(m_level);
     if(m_hasFormatter && m_formatter)
-        node["formatter"] = m_formatter->GetPattern();
+        FormatterToYaml(node, m_formatter);
     
     std::stringstream ss;
     ss << node;
@@ -485,9 +722,224 @@ std::string StdoutLogAppender::ToYamlString() {
 }
 
 
-FileLogAppender::FileLogAppender(const std::string& filename) 
-    : m_name(filename) {
+/**
+ * @brief 历史日志文件后台压缩线程, 第一次使用时才创建线程
+ * 
+ */
+class LogCompressor {
+public:
+    typedef SMutex MutexType;
+
+    static LogCompressor* GetInstance() {
+        // 不析构, 避免进程退出时线程仍阻塞在信号量上
+        static LogCompressor* s_compressor = new LogCompressor;
+        return s_compressor;
+    }
+
+    void Push(const std::string& file) {
+        {
+            MutexType::MutexGuard g(m_mutex);
+            m_files.push_back(file);
+            if(!m_thread) {
+                m_thread.reset(new Thread(std::bind(&LogCompressor::Run, this), "log_compress"));
+            }
+        }
+        m_sem.Notify();
+    }
+
+private:
+    void Run() {
+        while(true) {
+            m_sem.Wait();
+            std::string file;
+            {
+                MutexType::MutexGuard g(m_mutex);
+                file.swap(m_files.front());
+                m_files.pop_front();
+            }
+            Compress(file);
+        }
+    }
+
+    /**
+     * @brief 压缩为 file.gz, 成功后删除原文件
+     */
+    static bool Compress(const std::string& file) {
+        std::string gz_name = file + ".gz";
+        FILE* in = fopen(file.c_str(), "rb");
+        if(!in) {
+            std::cout << "LogCompressor open file=" << file << " fail" << std::endl;
+            return false;
+        }
+        gzFile out = gzopen(gz_name.c_str(), "wb");
+        if(!out) {
+            std::cout << "LogCompressor open file=" << gz_name << " fail" << std::endl;
+            fclose(in);
+            return false;
+        }
+
+        bool ok = true;
+        char buf[64 * 1024];
+        size_t n = 0;
+        while((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+            if(gzwrite(out, buf, n) != (int)n) {
+                ok = false;
+                break;
+            }
+        }
+        fclose(in);
+        if(gzclose(out) != Z_OK)
+            ok = false;
+
+        unlink(ok ? file.c_str() : gz_name.c_str());
+        return ok;
+    }
+
+private:
+    MutexType m_mutex;
+    std::deque<std::string> m_files;
+    Thread::ptr m_thread;
+    SSemaphore m_sem;
+};
+
+// SIGHUP 等外部触发的重新打开请求序号
+static std::atomic<uint64_t> s_file_reopen_gen(0);
+
+/**
+ * @brief 所有FileLogAppender的登记表和后台刷新线程, 保证低频Appender的日志最多在缓冲区停留约1秒
+ *  同一线程每秒输出限流调用点被抑制的条数; 第一次有未刷新的日志或被抑制的日志时才创建线程
+ */
+class LogFlusher {
+public:
+    typedef SMutex MutexType;
+
+    static LogFlusher* GetInstance() {
+        // 不析构, 进程退出时线程可能仍在刷新
+        static LogFlusher* s_flusher = new LogFlusher;
+        return s_flusher;
+    }
+
+    void Add(FileLogAppender* appender) {
+        MutexType::MutexGuard g(m_mutex);
+        m_appenders.insert(appender);
+    }
+
+    void Del(FileLogAppender* appender) {
+        MutexType::MutexGuard g(m_mutex);
+        m_appenders.erase(appender);
+    }
+
+    void Start() {
+        if(m_started.load(std::memory_order_relaxed))
+            return;
+        MutexType::MutexGuard g(m_mutex);
+        if(!m_thread) {
+            m_thread.reset(new Thread(std::bind(&LogFlusher::Run, this), "log_flush"));
+            m_started.store(true, std::memory_order_relaxed);
+        }
+    }
+
+    void FlushAll(bool try_lock) {
+        if(try_lock) {
+            if(!m_mutex.TryLock())
+                return;
+        } else {
+            m_mutex.Lock();
+        }
+        for(auto i : m_appenders) {
+            i->FlushIfDirty(try_lock);
+        }
+        m_mutex.Unlock();
+    }
+
+private:
+    LogFlusher() : m_started(false) {}
+
+    void Run() {
+        while(true) {
+            sleep(1);
+            FlushAll(false);
+            LogRateLimit::ReportAll();
+        }
+    }
+
+private:
+    MutexType m_mutex;
+    std::set<FileLogAppender*> m_appenders;
+    std::atomic<bool> m_started;
+    Thread::ptr m_thread;
+};
+
+static bool FileExists(const std::string& name) {
+    struct stat st;
+    return stat(name.c_str(), &st) == 0;
+}
+
+const char* FileLogAppender::RotateToString(RotateType type) {
+    switch(type) {
+        case HOURLY:
+            return "hourly";
+        case DAILY:
+            return "daily";
+        default:
+            return "none";
+    }
+}
+
+FileLogAppender::RotateType FileLogAppender::RotateFromString(const std::string& str) {
+    if(str == "hourly" || str == "HOURLY")
+        return HOURLY;
+    if(str == "daily" || str == "DAILY")
+        return DAILY;
+    return NONE;
+}
+
+void FileLogAppender::ReopenAll() {
+    s_file_reopen_gen.fetch_add(1, std::memory_order_relaxed);
+}
+
+FileLogAppender::FileLogAppender(const std::string& filename, uint64_t max_size, RotateType rotate, 
+                                uint32_t max_files, bool compress) 
+    : m_name(filename),
+    m_maxSize(max_size),
+    m_rotate(rotate),
+    m_maxFiles(max_files),
+    m_compress(compress),
+    m_reopenGen(s_file_reopen_gen.load(std::memory_order_relaxed)) {
+    // 已存在的文件按最后修改时间归属周期, 重启后跨周期的旧文件会在第一次写入时被切分
+    struct stat st;
+    m_periodBegin = stat(m_name.c_str(), &st) == 0 ? st.st_mtime : time(0);
+    m_periodEnd = CalcPeriodEnd(m_periodBegin);
     Reopen();
+    LogFlusher::GetInstance()->Add(this);
+}
+
+FileLogAppender::~FileLogAppender() {
+    LogFlusher::GetInstance()->Del(this);
+}
+
+void FileLogAppender::Flush() {
+    MutexType::MutexGuard g(m_lock);
+    m_filestream.flush();
+    m_dirty = false;
+}
+
+void FileLogAppender::FlushIfDirty(bool try_lock) {
+    if(try_lock) {
+        if(!m_lock.TryLock())
+            return;
+    } else {
+        m_lock.Lock();
+    }
+    if(m_dirty) {
+        m_filestream.flush();
+        m_dirty = false;
+    }
+    m_lock.Unlock();
+}
+
+void FileLogAppender::FlushAll(bool try_lock) {
+    LogFlusher::GetInstance()->FlushAll(try_lock);
 }
 
 /**
@@ -498,26 +950,179 @@ FileLogAppender::FileLogAppender(const std::string& filename)
  */
 bool  FileLogAppender::Reopen() {
     MutexType::MutexGuard g(m_lock);
-    
-    if(m_filestream) {
+    return ReopenNoLock();
+}
+
+bool FileLogAppender::ReopenNoLock() {
+    if(m_filestream.is_open()) {
+        m_filestream.flush();
         m_filestream.close();
     }
-    m_filestream.open(m_name);
+    m_dirty = false;
+    m_filestream.clear();
+    m_filestream.open(m_name, std::ios::app);
+
+    struct stat st;
+    m_curSize = stat(m_name.c_str(), &st) == 0 ? st.st_size : 0;
     return !!m_filestream;
 }
 
-void FileLogAppender::Log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) {
-    if(level >= m_level) {
-        uint64_t now = time(0);
-        if(now != m_lastTime) {
-            Reopen();
-            m_lastTime = now;
+/**
+ * @brief 计算当前周期的结束时间, 不按时间切分返回0
+ * 
+ * @param  now
+ * @return uint64_t 
+ */
+uint64_t FileLogAppender::CalcPeriodEnd(uint64_t now) const {
+    if(m_rotate == NONE)
+        return 0;
+
+    struct tm tm;
+    time_t t = now;
+    localtime_r(&t, &tm);
+    tm.tm_min = 0;
+    tm.tm_sec = 0;
+    if(m_rotate == HOURLY) {
+        tm.tm_hour += 1;
+    } else {
+        tm.tm_hour = 0;
+        tm.tm_mday += 1;
+    }
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+/**
+ * @brief 切分当前文件: file -> file.{周期开始时间}[.序号], 再打开新文件
+ * 
+ * @param  now
+ */
+void FileLogAppender::RotateNoLock(uint64_t now) {
+    // 改名之前把缓冲区写入旧文件
+    m_filestream.flush();
+    m_filestream.close();
+
+    const char* fmt = "%Y%m%d%H%M%S";
+    if(m_rotate == HOURLY)
+        fmt = "%Y%m%d%H";
+    else if(m_rotate == DAILY)
+        fmt = "%Y%m%d";
+
+    struct tm tm;
+    time_t t = m_periodBegin;
+    localtime_r(&t, &tm);
+    char buf[64];
+    strftime(buf, sizeof(buf), fmt, &tm);
+
+    // 同一周期内按大小多次切分时追加序号
+    std::string target = m_name + "." + buf;
+    std::string dst = target;
+    for(int i = 1; FileExists(dst) || FileExists(dst + ".gz"); i++) {
+        dst = target + "." + std::to_string(i);
+    }
+
+    if(rename(m_name.c_str(), dst.c_str()) == 0) {
+        if(m_compress)
+            LogCompressor::GetInstance()->Push(dst);
+    } else {
+        std::cout << "FileLogAppender rotate " << m_name << " to " << dst << " fail" << std::endl;
+    }
+
+    m_periodBegin = now;
+    m_periodEnd = CalcPeriodEnd(now);
+    ReopenNoLock();
+
+    if(m_maxFiles)
+        RemoveExpiredNoLock();
+}
+
+/**
+ * @brief 只保留最新的 m_maxFiles 个历史文件, file.xxx 和 file.xxx.gz 算作同一个
+ * 
+ */
+void FileLogAppender::RemoveExpiredNoLock() {
+    std::string dir = ".";
+    std::string base = m_name;
+    size_t pos = m_name.rfind('/');
+    if(pos != std::string::npos) {
+        dir = pos ? m_name.substr(0, pos) : "/";
+        base = m_name.substr(pos + 1);
+    }
+    std::string prefix = base + ".";
+
+    DIR* d = opendir(dir.c_str());
+    if(!d)
+        return;
+
+    // mtime, 去掉.gz后的完整路径
+    std::map<std::string, time_t> files;
+    struct dirent* dp = nullptr;
+    while((dp = readdir(d)) != nullptr) {
+        std::string name = dp->d_name;
+        if(name.size() <= prefix.size() || name.compare(0, prefix.size(), prefix) != 0
+                || !isdigit(name[prefix.size()])) {
+            continue;
         }
+        std::string path = dir + "/" + name;
+        struct stat st;
+        if(stat(path.c_str(), &st) != 0)
+            continue;
+        if(path.size() > 3 && path.compare(path.size() - 3, 3, ".gz") == 0)
+            path.resize(path.size() - 3);
+        time_t& mtime = files[path];
+        mtime = std::max(mtime, st.st_mtime);
+    }
+    closedir(d);
 
+    if(files.size() <= m_maxFiles)
+        return;
+
+    std::vector<std::pair<time_t, std::string> > sorted;
+    for(auto& i : files) {
+        sorted.push_back(std::make_pair(i.second, i.first));
+    }
+    std::sort(sorted.begin(), sorted.end());
+    for(size_t i = 0; i < sorted.size() - m_maxFiles; i++) {
+        unlink(sorted[i].second.c_str());
+        unlink((sorted[i].second + ".gz").c_str());
+    }
+}
+
+void FileLogAppender::Log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) {
+    if(level < m_level && !event->IsForced())
+        return;
+    std::string str = GetCurFormatter()->Format(logger, level, event);
+    bool start_flusher = false;
+    {
         MutexType::MutexGuard g(m_lock);
-        m_filestream << m_formatter->Format(logger, level, event);
+        uint64_t gen = s_file_reopen_gen.load(std::memory_order_relaxed);
+        if(gen != m_reopenGen) {
+            m_reopenGen = gen;
+            ReopenNoLock();
+        }
+
+        uint64_t now = event->GetTime();
+        if((m_periodEnd && now >= m_periodEnd)
+                || (m_maxSize && m_curSize && m_curSize + str.size() > m_maxSize)) {
+            RotateNoLock(now);
+        }
+
+        m_filestream << str;
+        m_curSize += str.size();
+
+        // 每秒第一条 和 ERROR以上 立即刷新, 其余由后台线程在1秒内刷新
+        if(level >= LogLevel::ERROR || now != m_flushSec) {
+            m_filestream.flush();
+            m_flushSec = now;
+            m_dirty = false;
+        } else if(!m_dirty) {
+            m_dirty = true;
+            start_flusher = true;
+        }
     }
-    
+    // 刷新线程先锁登记表再锁Appender, 这里不能在持有 m_lock 时启动
+    if(start_flusher)
+        LogFlusher::GetInstance()->Start();
 }
 
 std::string FileLogAppender::ToYamlString() {
@@ -528,7 +1133,249 @@ std::string FileLogAppender::ToYamlString() {
     node["file"] = m_name;
     node["level"] = LogLevel::ToString(m_level);
     if(m_hasFormatter && m_formatter)
-        node["m_formatter"] = m_formatter->GetPattern();
+        FormatterToYaml(node, m_formatter);
+    if(m_maxSize)
+        node["max_size"] = m_maxSize;
+    if(m_rotate != NONE)
+        node["rotate"] = RotateToString(m_rotate);
+    if(m_maxFiles)
+        node["max_files"] = m_maxFiles;
+    if(m_compress)
+        node["compress"] = m_compress;
+    std::stringstream ss;
+    ss << node;
+    return ss.str();
+}
+
+
+
+static dx::Logger::ptr g_logger = SERVER_LOG_NAME("system");
+
+MmapFileLogAppender::Segment::~Segment() {
+    munmap(addr, size);
+}
+
+MmapFileLogAppender::MmapFileLogAppender(const std::string& filename, uint64_t segment_size, 
+                                        uint32_t sync_interval_ms)
+    : m_name(filename),
+    m_segSize(segment_size),
+    m_syncInterval(sync_interval_ms),
+    m_dropped(0),
+    m_stopping(false) {
+    // 段大小按页对齐
+    uint64_t page = sysconf(_SC_PAGESIZE);
+    m_segSize = (std::max(m_segSize, page) + page - 1) & ~(page - 1);
+
+    m_fd = open(m_name.c_str(), O_RDWR | O_CREAT, 0644);
+    if(m_fd < 0) {
+        SERVER_LOG_ERROR(g_logger) << "MmapFileLogAppender open file=" << m_name << " fail errno=" << errno
+                                   << " " << strerror(errno);
+        return;
+    }
+    m_retrySec = time(0);
+    if(!MapNoLock(FindLogicEnd())) {
+        SERVER_LOG_ERROR(g_logger) << "MmapFileLogAppender file=" << m_name << " " << m_error
+                                   << ", fallback to write()";
+    }
+
+    if(m_syncInterval) {
+        m_syncThread.reset(new Thread(std::bind(&MmapFileLogAppender::SyncLoop, this), "log_msync"));
+    }
+}
+
+MmapFileLogAppender::~MmapFileLogAppender() {
+    m_stopping = true;
+    if(m_syncThread) {
+        m_syncThread->Join();
+    }
+    Sync(true);
+
+    // 截掉预分配但未写入的部分
+    uint64_t end = m_seg ? m_seg->offset + m_pos : m_end;
+    m_seg.reset();
+    m_retired.clear();
+    if(m_fd >= 0) {
+        if(ftruncate(m_fd, end)) {
+            SERVER_LOG_ERROR(g_logger) << "MmapFileLogAppender ftruncate file=" << m_name << " fail errno=" << errno
+                                       << " " << strerror(errno);
+        }
+        close(m_fd);
+    }
+}
+
+/**
+ * @brief 找到已有日志的结尾: 上次未正常关闭时, 文件尾部是预分配的 '\0'
+ * 
+ * @return uint64_t 
+ */
+uint64_t MmapFileLogAppender::FindLogicEnd() {
+    struct stat st;
+    if(fstat(m_fd, &st) != 0)
+        return 0;
+
+    uint64_t end = st.st_size;
+    char buf[4096];
+    while(end > 0) {
+        size_t n = std::min<uint64_t>(end, sizeof(buf));
+        if(pread(m_fd, buf, n, end - n) != (ssize_t)n)
+            break;
+        for(size_t i = n; i > 0; i--) {
+            if(buf[i - 1] != '\0')
+                return end - n + i;
+        }
+        end -= n;
+    }
+    return end;
+}
+
+/**
+ * @brief 从 pos 开始映射一个新段, 失败时 m_seg 为空, m_end = pos, 之后的日志直接write()
+ *  段内的磁盘块必须先分配成功: 稀疏文件在写入映射时才分配块, 磁盘满时会触发SIGBUS;
+ *  之后文件仍可能被外部截断, 这种情况同样会SIGBUS, 不做处理
+ * 
+ * @param  pos 写入位置(文件偏移)
+ * @return true 
+ * @return false 
+ */
+bool MmapFileLogAppender::MapNoLock(uint64_t pos) {
+    static const uint64_t s_page = sysconf(_SC_PAGESIZE);
+    uint64_t offset = pos & ~(s_page - 1);
+    m_seg.reset();
+    m_end = pos;
+
+    // 文件系统不支持fallocate时, glibc 逐块写0完成分配
+    int rt = posix_fallocate(m_fd, offset, m_segSize);
+    if(rt != 0) {
+        m_error = std::string("posix_fallocate fail: ") + strerror(rt);
+        return false;
+    }
+
+    void* addr = mmap(nullptr, m_segSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, offset);
+    if(addr == MAP_FAILED) {
+        m_error = std::string("mmap fail: ") + strerror(errno);
+        return false;
+    }
+    m_seg.reset(new Segment((char*)addr, m_segSize, offset));
+    m_pos = pos - offset;
+    return true;
+}
+
+void MmapFileLogAppender::WriteNoLock(const char* data, size_t len) {
+    while(len) {
+        ssize_t n = pwrite(m_fd, data, len, m_end);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        data += n;
+        len -= n;
+        m_end += n;
+    }
+}
+
+void MmapFileLogAppender::Log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) {
+    if(level >= m_level || event->IsForced()) {
+        std::string str = GetCurFormatter()->Format(logger, level, event);
+        bool lost = false;      // 本次映射新段失败
+        bool restored = false;  // 重试映射成功
+        std::string error;
+        uint64_t dropped = 0;
+        {
+            MutexType::MutexGuard g(m_lock);
+            // 映射失败后每秒最多重试一次, 其间直接write()
+            if(!m_seg && m_fd >= 0) {
+                time_t now = time(0);
+                if(now != m_retrySec) {
+                    m_retrySec = now;
+                    restored = MapNoLock(m_end);
+                }
+            }
+
+            const char* data = str.data();
+            size_t left = str.size();
+            while(left && m_seg) {
+                size_t n = std::min(left, m_seg->size - m_pos);
+                memcpy(m_seg->addr + m_pos, data, n);
+                m_pos += n;
+                data += n;
+                left -= n;
+
+                if(m_pos == m_seg->size) {
+                    // 写满的段交给后台线程msync后再释放
+                    if(m_syncThread)
+                        m_retired.push_back(m_seg);
+                    if(!MapNoLock(m_seg->offset + m_seg->size)) {
+                        lost = true;
+                        m_retrySec = time(0);
+                    }
+                }
+            }
+            if(left) {
+                WriteNoLock(data, left);
+            }
+            error = m_error;
+            dropped = m_dropped.load(std::memory_order_relaxed);
+        }
+
+        // 不能持有 m_lock 输出, 这条日志可能再次写到这里
+        if(lost) {
+            SERVER_LOG_ERROR(g_logger) << "MmapFileLogAppender file=" << m_name << " " << error
+                                       << ", fallback to write()";
+        } else if(restored) {
+            SERVER_LOG_INFO(g_logger) << "MmapFileLogAppender file=" << m_name << " mapped again, dropped=" << dropped;
+        }
+
+        if(level >= LogLevel::FATAL) {
+            Sync(true);
+        }
+    }
+}
+
+void MmapFileLogAppender::Sync(bool wait) {
+    std::vector<Segment::ptr> retired;
+    Segment::ptr seg;
+    size_t pos = 0;
+    {
+        MutexType::MutexGuard g(m_lock);
+        retired.swap(m_retired);
+        seg = m_seg;
+        pos = m_pos;
+    }
+
+    int flags = wait ? MS_SYNC : MS_ASYNC;
+    for(auto& i : retired) {
+        msync(i->addr, i->size, flags);
+    }
+    if(seg && pos) {
+        msync(seg->addr, pos, flags);
+    } else if(!seg && wait && m_fd >= 0) {
+        // 没有映射时日志是write()写入的
+        fdatasync(m_fd);
+    }
+}
+
+void MmapFileLogAppender::SyncLoop() {
+    while(!m_stopping) {
+        for(uint32_t i = 0; i < m_syncInterval && !m_stopping; i += 10) {
+            usleep(10 * 1000);
+        }
+        Sync(false);
+    }
+}
+
+std::string MmapFileLogAppender::ToYamlString() {
+    MutexType::MutexGuard g(m_lock);
+
+    YAML::Node node;
+    node["type"] = "MmapFileLogAppender";
+    node["file"] = m_name;
+    node["level"] = LogLevel::ToString(m_level);
+    if(m_hasFormatter && m_formatter)
+        FormatterToYaml(node, m_formatter);
+    node["segment_size"] = m_segSize;
+    node["sync_interval"] = m_syncInterval;
     std::stringstream ss;
     ss << node;
     return ss.str();
@@ -536,6 +1383,246 @@ std::string FileLogAppender::ToYamlString() {
 
 
 
+static const int s_flight_max_recorders = 8;
+static std::atomic<FlightRecorderAppender*> s_flight_recorders[s_flight_max_recorders];
+static std::atomic<uint64_t> s_flight_id(0);
+
+/**
+ * @brief 线程持有自己用过的环, 线程退出时把环标记为可复用
+ */
+struct FlightRingCache {
+    ~FlightRingCache() {
+        for(auto& i : rings) {
+            i.second->used.store(false, std::memory_order_release);
+        }
+    }
+    std::vector<std::pair<uint64_t, FlightRecorderAppender::Ring::ptr> > rings;
+};
+
+static thread_local FlightRingCache t_flight_rings;
+
+FlightRecorderAppender::Ring::Ring(size_t size)
+    :buf((char*)malloc(size))
+    ,cap(size)
+    ,pos(0)
+    ,used(true) {
+    memset(name, 0, sizeof(name));
+}
+
+FlightRecorderAppender::Ring::~Ring() {
+    free(buf);
+}
+
+void FlightRecorderAppender::Ring::Write(const char* data, size_t len) {
+    if(len > cap) {
+        data += len - cap;
+        len = cap;
+    }
+    uint64_t p = pos.load(std::memory_order_relaxed);
+    size_t off = p % cap;
+    size_t n = std::min(len, cap - off);
+    memcpy(buf + off, data, n);
+    if(n < len)
+        memcpy(buf, data + n, len - n);
+    pos.store(p + len, std::memory_order_release);
+}
+
+FlightRecorderAppender::FlightRecorderAppender(const std::string& dump_file, uint64_t ring_size) 
+    :m_id(++s_flight_id)
+    ,m_dumpFile(dump_file)
+    ,m_ringSize(ring_size ? ring_size : 1024 * 1024)
+    ,m_ringCount(0) {
+    snprintf(m_dumpPath, sizeof(m_dumpPath), "%s", dump_file.c_str());
+    for(int i = 0; i < MAX_RINGS; i++) {
+        m_rings[i].store(nullptr, std::memory_order_relaxed);
+    }
+
+    bool registered = false;
+    for(int i = 0; i < s_flight_max_recorders; i++) {
+        FlightRecorderAppender* expected = nullptr;
+        if(s_flight_recorders[i].compare_exchange_strong(expected, this)) {
+            registered = true;
+            break;
+        }
+    }
+    if(!registered)
+        std::cout << "FlightRecorderAppender too many recorders, " << dump_file << " will not be dumped" << std::endl;
+    InstallCrashHandler();
+}
+
+FlightRecorderAppender::~FlightRecorderAppender() {
+    for(int i = 0; i < s_flight_max_recorders; i++) {
+        FlightRecorderAppender* expected = this;
+        s_flight_recorders[i].compare_exchange_strong(expected, nullptr);
+    }
+}
+
+FlightRecorderAppender::Ring* FlightRecorderAppender::GetRing() {
+    auto& cache = t_flight_rings.rings;
+    for(auto& i : cache) {
+        if(i.first == m_id)
+            return i.second.get();
+    }
+
+    Ring::ptr ring;
+    {
+        MutexType::MutexGuard g(m_lock);
+        // 优先复用已退出线程的环, 不清空, 已退出线程最后的记录仍然会被dump
+        for(auto& i : m_ringOwner) {
+            bool expected = false;
+            if(i->used.compare_exchange_strong(expected, true)) {
+                ring = i;
+                break;
+            }
+        }
+        if(!ring) {
+            int idx = m_ringCount.load(std::memory_order_relaxed);
+            if(idx >= MAX_RINGS)
+                return nullptr;
+            ring.reset(new Ring(m_ringSize));
+            m_ringOwner.push_back(ring);
+            m_rings[idx].store(ring.get(), std::memory_order_release);
+            m_ringCount.store(idx + 1, std::memory_order_release);
+        }
+    }
+    ring->tid = GetThreadId();
+    snprintf(ring->name, sizeof(ring->name), "%s", Thread::GetNameS().c_str());
+
+    // 已销毁的记录器的环不再需要, 顺便释放
+    cache.erase(std::remove_if(cache.begin(), cache.end(), [](const std::pair<uint64_t, Ring::ptr>& v) {
+        return v.second.use_count() == 1;
+    }), cache.end());
+    cache.push_back(std::make_pair(m_id, ring));
+    return ring.get();
+}
+
+void FlightRecorderAppender::Log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) {
+    if(level >= m_level || event->IsForced()) {
+        Ring* ring = GetRing();
+        if(!ring)
+            return;
+        std::string str = GetCurFormatter()->Format(logger, level, event);
+        ring->Write(str.data(), str.size());
+    }
+}
+
+std::string FlightRecorderAppender::ToYamlString() {
+    MutexType::MutexGuard g(m_lock);
+
+    YAML::Node node;
+    node["type"] = "FlightRecorderAppender";
+    node["file"] = m_dumpFile;
+    node["level"] = LogLevel::ToString(m_level);
+    if(m_hasFormatter && m_formatter)
+        FormatterToYaml(node, m_formatter);
+    node["ring_size"] = m_ringSize;
+    std::stringstream ss;
+    ss << node;
+    return ss.str();
+}
+
+/**
+ * 以下函数在信号处理函数中调用, 只能使用异步信号安全的系统调用
+ */
+static void SignalSafeWrite(int fd, const char* data, size_t len) {
+    while(len > 0) {
+        ssize_t n = write(fd, data, len);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+static void SignalSafeWrite(int fd, const char* str) {
+    SignalSafeWrite(fd, str, strlen(str));
+}
+
+static void SignalSafeWrite(int fd, uint64_t v) {
+    char buf[24];
+    int i = sizeof(buf);
+    do {
+        buf[--i] = '0' + v % 10;
+        v /= 10;
+    } while(v);
+    SignalSafeWrite(fd, buf + i, sizeof(buf) - i);
+}
+
+void FlightRecorderAppender::Dump() {
+    int fd = open(m_dumpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        return;
+
+    int count = m_ringCount.load(std::memory_order_acquire);
+    for(int i = 0; i < count; i++) {
+        Ring* r = m_rings[i].load(std::memory_order_acquire);
+        if(!r)
+            continue;
+        uint64_t pos = r->pos.load(std::memory_order_acquire);
+        if(!pos)
+            continue;
+
+        SignalSafeWrite(fd, "==== flight recorder thread_id=");
+        SignalSafeWrite(fd, (uint64_t)r->tid);
+        SignalSafeWrite(fd, " thread_name=");
+        SignalSafeWrite(fd, r->name, strnlen(r->name, sizeof(r->name)));
+        SignalSafeWrite(fd, " ====\n");
+
+        if(pos <= r->cap) {
+            SignalSafeWrite(fd, r->buf, pos);
+            continue;
+        }
+        // 已回绕: 最旧的数据从 pos % cap 开始, 第一条记录可能被覆盖了一半, 跳过
+        size_t off = pos % r->cap;
+        size_t begin = off;
+        while(begin < r->cap && r->buf[begin] != '\n')
+            ++begin;
+        if(begin < r->cap)
+            SignalSafeWrite(fd, r->buf + begin + 1, r->cap - begin - 1);
+        SignalSafeWrite(fd, r->buf, off);
+    }
+    close(fd);
+}
+
+void FlightRecorderAppender::DumpAll() {
+    for(int i = 0; i < s_flight_max_recorders; i++) {
+        FlightRecorderAppender* r = s_flight_recorders[i].load(std::memory_order_acquire);
+        if(r)
+            r->Dump();
+    }
+}
+
+static void OnFatalSignal(int sig) {
+    FlightRecorderAppender::DumpAll();
+    // SA_RESETHAND 已恢复默认处理, 重新触发以产生core
+    raise(sig);
+}
+
+/**
+ * @brief 只在信号仍为默认处理时安装, 不覆盖使用者自己的处理函数
+ */
+void FlightRecorderAppender::InstallCrashHandler() {
+    static std::atomic<bool> s_installed(false);
+    if(s_installed.exchange(true))
+        return;
+
+    int sigs[] = {SIGSEGV, SIGABRT, SIGBUS, SIGFPE, SIGILL};
+    for(int sig : sigs) {
+        struct sigaction old_act;
+        if(sigaction(sig, nullptr, &old_act) != 0 || old_act.sa_handler != SIG_DFL)
+            continue;
+        struct sigaction act;
+        memset(&act, 0, sizeof(act));
+        act.sa_handler = &OnFatalSignal;
+        act.sa_flags = SA_RESETHAND | SA_NODEFER;
+        sigemptyset(&act.sa_mask);
+        sigaction(sig, &act, nullptr);
+    }
+}
+
 LogFormatter::LogFormatter(const std::string& pattern) 
     :m_pattern(pattern) {
     Init();
@@ -708,20 +1795,132 @@ std::string LogFormatter::Format(std::shared_ptr<Logger> logger, LogLevel::Level
 }
 
 
+static void AppendJsonEscapeChar(std::string& out, unsigned char c) {
+    switch(c) {
+        case '"':
+            out.append("\\\"", 2);
+            break;
+        case '\\':
+            out.append("\\\\", 2);
+            break;
+        case '\n':
+            out.append("\\n", 2);
+            break;
+        case '\r':
+            out.append("\\r", 2);
+            break;
+        case '\t':
+            out.append("\\t", 2);
+            break;
+        default: {
+            static const char s_hex[] = "0123456789abcdef";
+            char buf[6] = {'\\', 'u', '0', '0', s_hex[c >> 4], s_hex[c & 0xf]};
+            out.append(buf, sizeof(buf));
+        }
+    }
+}
+
+void JsonLogFormatter::Escape(std::string& out, const char* str, size_t len) {
+    size_t i = 0;
+    size_t begin = 0;   // 未拷贝部分的开始
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    const __m128i ctrl = _mm_set1_epi8(0x1f);
+    while(i + 16 <= len) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(str + i));
+        // 无符号 v <= 0x1f 等价于 min(v, 0x1f) == v
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)),
+                                 _mm_cmpeq_epi8(_mm_min_epu8(v, ctrl), v));
+        int mask = _mm_movemask_epi8(m);
+        if(!mask) {
+            i += 16;
+            continue;
+        }
+        i += __builtin_ctz(mask);
+        out.append(str + begin, i - begin);
+        AppendJsonEscapeChar(out, str[i]);
+        begin = ++i;
+    }
+#endif
+    for(; i < len; i++) {
+        unsigned char c = str[i];
+        if(c == '"' || c == '\\' || c < 0x20) {
+            out.append(str + begin, i - begin);
+            AppendJsonEscapeChar(out, c);
+            begin = i + 1;
+        }
+    }
+    out.append(str + begin, len - begin);
+}
+
+std::string JsonLogFormatter::Format(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) {
+    std::string content = event->GetContent();
+    std::string out;
+    out.reserve(256 + content.size());
+
+    char buf[64];
+    struct tm tm;
+    time_t time = event->GetTime();
+    localtime_r(&time, &tm);
+    size_t n = strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+    out.append("{\"time\":\"");
+    out.append(buf, n);
+    out.append("\",\"level\":\"");
+    out.append(LogLevel::ToString(level));
+    out.append("\",\"logger\":\"");
+    const std::string name = event->GetLogger()->GetName();
+    Escape(out, name.data(), name.size());
+    out.append("\",\"thread_id\":");
+    out.append(buf, snprintf(buf, sizeof(buf), "%d", event->GetThreadId()));
+    out.append(",\"thread_name\":\"");
+    std::string thread_name = event->GetThreadName();
+    Escape(out, thread_name.data(), thread_name.size());
+    out.append("\",\"fiber_id\":");
+    out.append(buf, snprintf(buf, sizeof(buf), "%llu", (unsigned long long)event->GetFiberId()));
+    out.append(",\"file\":\"");
+    Escape(out, event->GetFile(), strlen(event->GetFile()));
+    out.append("\",\"line\":");
+    out.append(buf, snprintf(buf, sizeof(buf), "%d", event->GetLine()));
+    out.append(",\"msg\":\"");
+    Escape(out, content.data(), content.size());
+    out.push_back('"');
+
+    event->VisitFields([&out](const char* key, uint32_t key_len, LogEvent::FieldType type, 
+                              const char* val, uint32_t val_len) {
+        out.append(",\"");
+        Escape(out, key, key_len);
+        out.append("\":");
+        if(type == LogEvent::FIELD_STRING) {
+            out.push_back('"');
+            Escape(out, val, val_len);
+            out.push_back('"');
+        } else {
+            out.append(val, val_len);
+        }
+    });
+    out.append("}\n");
+    return out;
+}
+
 LogManager::LogManager() {
     m_root.reset(new Logger());
     m_root->AddAppender(LogAppender::ptr(new StdoutLogAppender));
 
-    m_loggers[m_root->m_name] = m_root;
+    m_loggers.Set(m_root->m_name, m_root);
 
     Init();
 }
 
 std::string LogManager::ToYamlString() {
-    MutexType::MutexGuard g(m_lock);
+    // 按名字排序输出
+    std::map<std::string, Logger::ptr> loggers;
+    m_loggers.Visit([&loggers](const std::string& name, const Logger::ptr& logger) {
+        loggers[name] = logger;
+    });
 
     YAML::Node node;
-    for(auto& i : m_loggers) {
+    for(auto& i : loggers) {
         node.push_back(YAML::Load(i.second->ToYamlString()));
     }
     std::stringstream ss;
@@ -737,17 +1936,179 @@ std::string LogManager::ToYamlString() {
  * @return Logger::ptr 
  */
 Logger::ptr LogManager::GetLogger(const std::string& name) {
-    MutexType::MutexGuard g(m_lock);
+    // 返回值本身是 shared_ptr, 在节点上直接拷贝到返回值, 只增加一次引用计数
+    Logger::ptr logger;
+    if(m_loggers.FindVisit(name, [&logger](const Logger::ptr& v) { logger = v; })) {
+        return logger;
+    }
+
+    return m_loggers.GetOrCreate(name, [this, &name]() {
+        Logger::ptr logger(new Logger(name));
+        logger->m_root = m_root;
+        return logger;
+    }).first;
+}
+
+static_assert(alignof(Logger) > LogSite::FLAG_MASK, "LogSite packs flags into Logger* low bits");
+
+/**
+ * @brief 重新计算调用点对 logger 是否输出并缓存
+ *  计算前后检查失效序号, 计算期间发生失效则不保留结果
+ * 
+ * @param  logger
+ * @return true 
+ * @return false 
+ */
+bool LogSite::Refresh(Logger* logger) {
+    LogSiteManager* mgr = LogSiteMgr::GetInstance();
+    if(!m_registered.exchange(true)) {
+        mgr->Register(this);
+    }
+
+    uint64_t gen = mgr->GetGeneration();
+    bool forced = m_forced.load(std::memory_order_relaxed);
+    bool enabled = forced || logger->GetLevel() <= m_level;
+    bool capture = !enabled && logger->GetCaptureLevel() <= m_level;
+
+    // 发布后再检查代数: 写后读需要顺序一致, 与 Invalidate 的 代数加一 和 清零 都在同一个全序里,
+    //  要么这里看到新代数自己清零, 要么 Invalidate 的清零排在这次发布之后
+    m_state.store((uintptr_t)logger | (enabled ? ENABLED : 0) | (forced ? FORCED : 0) | (capture ? CAPTURE : 0), 
+                  std::memory_order_seq_cst);
+    if(mgr->GetGeneration() != gen) {
+        m_state.store(0, std::memory_order_relaxed);
+    }
+    return enabled || capture;
+}
+
+/**
+ * @brief 发生过抑制的限流调用点, 以及各自汇总日志输出到的logger
+ *  只记录 weak_ptr, 不延长logger的生命周期
+ */
+class LogRateLimitRegistry {
+public:
+    typedef SMutex MutexType;
+
+    static LogRateLimitRegistry* GetInstance() {
+        // 不析构, 后台线程可能仍在访问
+        static LogRateLimitRegistry* s_registry = new LogRateLimitRegistry;
+        return s_registry;
+    }
+
+    void Bind(LogRateLimit* limit, const Logger::ptr& logger) {
+        MutexType::MutexGuard g(m_mutex);
+        m_limits[limit] = logger;
+    }
+
+    void Visit(std::function<void(LogRateLimit*, const Logger::ptr&)> cb) {
+        std::vector<std::pair<LogRateLimit*, Logger::ptr> > limits;
+        {
+            MutexType::MutexGuard g(m_mutex);
+            for(auto& i : m_limits) {
+                Logger::ptr logger = i.second.lock();
+                if(logger)
+                    limits.push_back(std::make_pair(i.first, logger));
+            }
+        }
+        for(auto& i : limits) {
+            cb(i.first, i.second);
+        }
+    }
+
+private:
+    MutexType m_mutex;
+    std::map<LogRateLimit*, std::weak_ptr<Logger> > m_limits;
+};
+
+void LogRateLimit::Bind(Logger* logger) {
+    LogRateLimitRegistry::GetInstance()->Bind(this, logger->shared_from_this());
+    m_logger.store(logger, std::memory_order_relaxed);
+    LogFlusher::GetInstance()->Start();
+}
+
+void LogRateLimit::ReportAll() {
+    LogRateLimitRegistry::GetInstance()->Visit([](LogRateLimit* limit, const Logger::ptr& logger) {
+        uint64_t n = limit->TakeSuppressed();
+        if(!n)
+            return;
+        LogLevel::Level level = (LogLevel::Level)limit->m_site.GetLevel();
+        LogEvent::ptr event(new LogEvent(logger, level, limit->m_site.GetFile(), limit->m_site.GetLine(), 0,
+                    GetThreadId(), GetFiberId(), time(0), Thread::GetNameS()));
+        event->SetForced(limit->IsForced());
+        event->GetSS() << LogSuppressed(n);
+        logger->Log(level, event);
+    });
+}
+
+LogSiteManager::LogSiteManager()
+    : m_generation(0) {
+}
+
+void LogSiteManager::Register(LogSite* site) {
+    MutexType::MutexGuard g(m_mutex);
+    site->m_forced.store(MatchNoLock(site), std::memory_order_relaxed);
+    m_sites.push_back(site);
+}
 
-    auto it = m_loggers.find(name);
-    if(it != m_loggers.end()) {
-        return it->second;
+void LogSiteManager::Invalidate() {
+    MutexType::MutexGuard g(m_mutex);
+    m_generation.fetch_add(1, std::memory_order_seq_cst);
+    for(auto& i : m_sites) {
+        i->m_state.store(0, std::memory_order_seq_cst);
     }
+}
+
+void LogSiteManager::SetDebugSites(const std::set<std::string>& rules) {
+    MutexType::MutexGuard g(m_mutex);
+    m_rules = rules;
+    ApplyRulesNoLock();
+}
+
+void LogSiteManager::EnableDebug(const std::string& rule) {
+    MutexType::MutexGuard g(m_mutex);
+    m_rules.insert(rule);
+    ApplyRulesNoLock();
+}
+
+void LogSiteManager::DisableDebug(const std::string& rule) {
+    MutexType::MutexGuard g(m_mutex);
+    m_rules.erase(rule);
+    ApplyRulesNoLock();
+}
 
-    Logger::ptr logger(new Logger(name));
-    logger->m_root = m_root;
-    m_loggers[name] = logger;
-    return logger;
+void LogSiteManager::ApplyRulesNoLock() {
+    m_generation.fetch_add(1, std::memory_order_acq_rel);
+    for(auto& i : m_sites) {
+        i->m_forced.store(MatchNoLock(i), std::memory_order_relaxed);
+        i->m_state.store(0, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * @brief 调用点是否匹配某条规则: "文件" 或 "文件:行号", 文件按路径后缀匹配
+ */
+bool LogSiteManager::MatchNoLock(const LogSite* site) const {
+    if(m_rules.empty())
+        return false;
+
+    std::string file = site->GetFile();
+    for(auto& rule : m_rules) {
+        std::string path = rule;
+        int32_t line = 0;
+        size_t pos = rule.rfind(':');
+        if(pos != std::string::npos && pos + 1 < rule.size()
+                && rule.find_first_not_of("0123456789", pos + 1) == std::string::npos) {
+            path = rule.substr(0, pos);
+            line = atoi(rule.c_str() + pos + 1);
+        }
+        if(line && line != site->GetLine())
+            continue;
+        if(file.size() >= path.size() 
+                && file.compare(file.size() - path.size(), path.size(), path) == 0
+                && (file.size() == path.size() || file[file.size() - path.size() - 1] == '/')) {
+            return true;
+        }
+    }
+    return false;
 }
 
 /**
@@ -755,19 +2116,58 @@ Logger::ptr LogManager::GetLogger(const std::string& name) {
  * 
  */
 struct LogAppenderDefine {
-    int type = 0;   // 1 file 2 stdout
+    int type = 0;   // 1 file 2 stdout 3 mmap file 4 flight recorder
     LogLevel::Level level = LogLevel::UNKNOW;
     std::string formatter;
     std::string file;
+    uint64_t max_size = 0;      // 按大小切分, 支持K/M/G后缀
+    FileLogAppender::RotateType rotate = FileLogAppender::NONE; // 按时间切分 hourly/daily
+    uint32_t max_files = 0;     // 保留历史文件数
+    bool compress = false;      // 历史文件后台压缩
+    uint64_t segment_size = 0;  // mmap 段大小, 0 使用默认值
+    uint32_t sync_interval = 1000;  // mmap 后台msync周期(毫秒)
+    bool direct = false;        // stdout 直接write, 不经过iostream
+    bool json = false;          // format: json 使用JsonLogFormatter
+    uint64_t ring_size = 0;     // 飞行记录器每个线程的环大小, 0 使用默认值
 
     bool operator==(const LogAppenderDefine& oth) const {
         return type == oth.type
             && level == oth.level
             && formatter == oth.formatter
-            && file == oth.file;
+            && file == oth.file
+            && max_size == oth.max_size
+            && rotate == oth.rotate
+            && max_files == oth.max_files
+            && compress == oth.compress
+            && segment_size == oth.segment_size
+            && sync_interval == oth.sync_interval
+            && direct == oth.direct
+            && json == oth.json
+            && ring_size == oth.ring_size;
     }
 }; 
 
+/**
+ * @brief 解析文件大小, 如 1024, 64K, 100M, 1G
+ * 
+ * @param  str
+ * @return uint64_t 
+ */
+static uint64_t ParseFileSize(const std::string& str) {
+    char* end = nullptr;
+    uint64_t v = strtoull(str.c_str(), &end, 10);
+    switch(end ? toupper(*end) : 0) {
+        case 'K':
+            return v << 10;
+        case 'M':
+            return v << 20;
+        case 'G':
+            return v << 30;
+        default:
+            return v;
+    }
+}
+
 /**
  * @brief Log 在yaml文件中的定义
  * 
@@ -782,7 +2182,7 @@ struct LogDefine {
         return name == oth.name
             && level == oth.level
             && formatter == oth.formatter
-            && appenders == appenders;
+            && appenders == oth.appenders;
     }
 
     bool operator<(const LogDefine& oth) const {
@@ -791,16 +2191,14 @@ struct LogDefine {
 };
 
 /**
- * @brief 从string 转成 LogDefine
+ * @brief 从yaml节点直接构造 LogDefine
  * 
  * @tparam T 
  */
 template<>
-class LexicalCast<std::string, LogDefine> {
+class YamlCast<LogDefine> {
 public:
-    LogDefine operator() (const std::string& v) {
-        YAML::Node node = YAML::Load(v);
-        
+    LogDefine operator() (const YAML::Node& node) {
         LogDefine logdef;
         if(!node["name"].IsDefined()) {
             std::cout << "log config error: name is null" << std::endl;
@@ -829,19 +2227,52 @@ public:
                         continue;
                     }
                     lad.file = a["file"].as<std::string>();
+                    if(a["max_size"].IsDefined())
+                        lad.max_size = ParseFileSize(a["max_size"].as<std::string>());
+                    if(a["rotate"].IsDefined())
+                        lad.rotate = FileLogAppender::RotateFromString(a["rotate"].as<std::string>());
+                    if(a["max_files"].IsDefined())
+                        lad.max_files = a["max_files"].as<uint32_t>();
+                    if(a["compress"].IsDefined())
+                        lad.compress = a["compress"].as<bool>();
                 
                 } else if (type == "StdoutLogAppender") {
                     lad.type = 2;
+                    if(a["direct"].IsDefined())
+                        lad.direct = a["direct"].as<bool>();
+                } else if (type == "MmapFileLogAppender") {
+                    lad.type = 3;
+                    if(!a["file"].IsDefined()) {
+                        std::cout << "log config error: mmapfileappender file is null " << i << std::endl;
+                        continue;
+                    }
+                    lad.file = a["file"].as<std::string>();
+                    if(a["segment_size"].IsDefined())
+                        lad.segment_size = ParseFileSize(a["segment_size"].as<std::string>());
+                    if(a["sync_interval"].IsDefined())
+                        lad.sync_interval = a["sync_interval"].as<uint32_t>();
+                } else if (type == "FlightRecorderAppender") {
+                    lad.type = 4;
+                    if(!a["file"].IsDefined()) {
+                        std::cout << "log config error: flightrecorderappender file is null " << i << std::endl;
+                        continue;
+                    }
+                    lad.file = a["file"].as<std::string>();
+                    if(a["ring_size"].IsDefined())
+                        lad.ring_size = ParseFileSize(a["ring_size"].as<std::string>());
                 } else {
                     std::cout << "log config error: appender type is inValid " << i << std::endl;
                     continue;
                 }
                 
-                    lad.level = LogLevel::FromString(a["level"].IsDefined() ? node["level"].as<std::string>() : "");
+                lad.level = LogLevel::FromString(a["level"].IsDefined() ? a["level"].as<std::string>() : "");
 
                 if(a["formatter"].IsDefined()) {
                     lad.formatter = a["formatter"].as<std::string>();
                 }
+                if(a["format"].IsDefined()) {
+                    lad.json = a["format"].as<std::string>() == "json";
+                }
 
                 logdef.appenders.push_back(lad);
             }
@@ -851,6 +2282,19 @@ public:
     }
 };
 
+/**
+ * @brief 从string 转成 LogDefine
+ * 
+ * @tparam T 
+ */
+template<>
+class LexicalCast<std::string, LogDefine> {
+public:
+    LogDefine operator() (const std::string& v) {
+        return YamlCast<LogDefine>()(YAML::Load(v));
+    }
+};
+
 
 /**
  * @brief 
@@ -872,17 +2316,43 @@ public:
         
         for(auto& i : v.appenders) {
             YAML::Node ap;
-            if(i.type == 0) {
+            if(i.type == 1) {
                 ap["type"] = "FileLogAppender";
                 ap["file"] = i.file;
+                if(i.max_size)
+                    ap["max_size"] = i.max_size;
+                if(i.rotate != FileLogAppender::NONE)
+                    ap["rotate"] = FileLogAppender::RotateToString(i.rotate);
+                if(i.max_files)
+                    ap["max_files"] = i.max_files;
+                if(i.compress)
+                    ap["compress"] = i.compress;
             }
-            else if(i.type == 1)
+            else if(i.type == 2) {
                 ap["type"] = "StdoutLogAppender";
+                if(i.direct)
+                    ap["direct"] = true;
+            }
+            else if(i.type == 3) {
+                ap["type"] = "MmapFileLogAppender";
+                ap["file"] = i.file;
+                if(i.segment_size)
+                    ap["segment_size"] = i.segment_size;
+                ap["sync_interval"] = i.sync_interval;
+            }
+            else if(i.type == 4) {
+                ap["type"] = "FlightRecorderAppender";
+                ap["file"] = i.file;
+                if(i.ring_size)
+                    ap["ring_size"] = i.ring_size;
+            }
             if(i.level != LogLevel::UNKNOW)
                 ap["level"] = LogLevel::ToString(i.level);
             
             if(!i.formatter.empty())
                 ap["formatter"] = i.formatter;
+            if(i.json)
+                ap["format"] = "json";
             
             node["appenders"].push_back(ap);
         }
@@ -893,8 +2363,15 @@ public:
 
 dx::ConfigVar<std::set<LogDefine> >::ptr g_log_defines = dx::Config::Lookup("logs", std::set<LogDefine>(), "log config");
 
+// 运行期打开调试输出的调用点, 如 [src/fiber.cpp, scheduler.cpp:120]
+static dx::ConfigVar<std::set<std::string> >::ptr g_log_debug_sites = 
+    dx::Config::Lookup("log.debug_sites", std::set<std::string>(), "log debug sites");
+
 struct LogIniter {
     LogIniter() {
+        g_log_debug_sites->AddListener([](const std::set<std::string>& old_val, const std::set<std::string>& new_val) {
+            LogSiteMgr::GetInstance()->SetDebugSites(new_val);
+        });
         
         g_log_defines->AddListener([](const std::set<LogDefine>& old_val, const std::set<LogDefine>& new_val) {
             // 1 新增 & 修改
@@ -910,11 +2387,18 @@ struct LogIniter {
                 for(auto& a : i.appenders) {
                     dx::LogAppender::ptr ap;
                     if(a.type == 1) 
-                        ap.reset(new FileLogAppender(a.file));
+                        ap.reset(new FileLogAppender(a.file, a.max_size, a.rotate, a.max_files, a.compress));
                     else if(a.type == 2) 
-                        ap.reset(new StdoutLogAppender);
+                        ap.reset(new StdoutLogAppender(a.direct));
+                    else if(a.type == 3)
+                        ap.reset(new MmapFileLogAppender(a.file, a.segment_size ? a.segment_size : 16 * 1024 * 1024, 
+                                                        a.sync_interval));
+                    else if(a.type == 4)
+                        ap.reset(new FlightRecorderAppender(a.file, a.ring_size));
                     ap->SetLevel(a.level);
-                    if(!a.formatter.empty()) {
+                    if(a.json) {
+                        ap->SetFormatter(LogFormatter::ptr(new JsonLogFormatter));
+                    } else if(!a.formatter.empty()) {
                         LogFormatter::ptr fmt(new LogFormatter(a.formatter));
                         if(!fmt->IsError())
                             ap->SetFormatter(fmt);
@@ -943,8 +2427,24 @@ struct LogIniter {
 static LogIniter __log_init;
 
 
-void LogManager::Init() {
+static void OnReopenSignal(int sig) {
+    FileLogAppender::ReopenAll();
+}
 
+/**
+ * @brief SIGHUP 触发所有FileLogAppender重新打开文件, 配合外部logrotate使用
+ *  只在SIGHUP仍为默认处理时安装, 不覆盖使用者自己的处理函数
+ */
+void LogManager::Init() {
+    struct sigaction old_act;
+    if(sigaction(SIGHUP, nullptr, &old_act) == 0 && old_act.sa_handler == SIG_DFL) {
+        struct sigaction act;
+        memset(&act, 0, sizeof(act));
+        act.sa_handler = &OnReopenSignal;
+        act.sa_flags = SA_RESTART;
+        sigemptyset(&act.sa_mask);
+        sigaction(SIGHUP, &act, nullptr);
+    }
 }
 
 
@@ -11,14 +11,43 @@
 #include <iostream>
 #include "util.h"
 #include <map>
+#include <set>
+#include <atomic>
+#include <time.h>
+#include <string.h>
+#include <cmath>
+#include <type_traits>
 #include "singleton.h"
 #include "thread.h"
 #include "mutex.h"
+#include "concurrent_hash_map.h"
+
+/**
+ * 编译期最低日志级别, 取值同 LogLevel::Level (0 不限制, 1 DEBUG ... 5 FATAL),
+ * 由 CMake 选项 SERVER_LOG_MIN_LEVEL 指定. 低于该级别的日志语句条件恒为假,
+ * 连同参数求值一起被编译器删除
+ */
+#ifndef SERVER_LOG_MIN_LEVEL
+#define SERVER_LOG_MIN_LEVEL 0
+#endif
+
+#define SERVER_LOG_COMPILE_ENABLED(level) ((int)(level) >= SERVER_LOG_MIN_LEVEL)
+
+#define SERVER_LOG_EVENT_WRAP(logger, level, forced) \
+    dx::LogEventWrap(dx::LogEvent::ptr(new dx::LogEvent(logger, level, __FILE__, __LINE__, 0, dx::GetThreadId(), \
+        dx::GetFiberId(), time(0), dx::Thread::GetNameS())), forced)
+
+/**
+ * 调用点: 每条日志语句有一个常量初始化的静态 LogSite, 缓存该语句对当前logger是否输出,
+ * 只在logger级别或调试调用点规则变化时失效重算. level 必须是常量
+ */
+#define SERVER_LOG_SITE(level) \
+    ([]() -> dx::LogSite& { static dx::LogSite s_site(__FILE__, __LINE__, level); return s_site; }())
 
 #define SERVER_LOG_LEVEL(logger, level) \
-    if(logger->GetLevel() <= level) \
-        dx::LogEventWrap(dx::LogEvent::ptr(new dx::LogEvent(logger, level, __FILE__, __LINE__, 0, dx::GetThreadId(), \
-        dx::GetFiberId(), time(0), dx::Thread::GetNameS()))).GetSS()
+    if(dx::LogSite* _server_log_site = SERVER_LOG_COMPILE_ENABLED(level) \
+            ? SERVER_LOG_SITE(level).Check(&*(logger)) : nullptr) \
+        SERVER_LOG_EVENT_WRAP(logger, level, _server_log_site->IsForced()).GetSS()
 
 #define SERVER_LOG_DEBUG(logger) SERVER_LOG_LEVEL(logger, dx::LogLevel::DEBUG)
 #define SERVER_LOG_INFO(logger) SERVER_LOG_LEVEL(logger, dx::LogLevel::INFO)
@@ -27,9 +56,17 @@
 #define SERVER_LOG_FATAL(logger) SERVER_LOG_LEVEL(logger, dx::LogLevel::FATAL)
 
 #define SERVER_LOG_FMT_LEVEL(logger, level, fmt, ...) \
-    if(logger->GetLevel() <= level) \
-        dx::LogEventWrap(dx::LogEvent::ptr(new dx::LogEvent(logger, level, __FILE__, __LINE__, 0, dx::GetThreadId(), \
-        dx::GetFiberId(), time(0), dx::Thread::GetNameS()))).GetEvent()->Format(fmt, __VA_ARGS__)
+    if(dx::LogSite* _server_log_site = SERVER_LOG_COMPILE_ENABLED(level) \
+            ? SERVER_LOG_SITE(level).Check(&*(logger)) : nullptr) \
+        SERVER_LOG_EVENT_WRAP(logger, level, _server_log_site->IsForced()).GetEvent()->Format(fmt, __VA_ARGS__)
+
+/**
+ * 结构化日志: SERVER_LOG_KV(logger, level).kv("conn", id).kv("lat_us", t).msg("done")
+ */
+#define SERVER_LOG_KV(logger, level) \
+    if(dx::LogSite* _server_log_site = SERVER_LOG_COMPILE_ENABLED(level) \
+            ? SERVER_LOG_SITE(level).Check(&*(logger)) : nullptr) \
+        SERVER_LOG_EVENT_WRAP(logger, level, _server_log_site->IsForced()).KV()
 
 #define SERVER_LOG_FMT_DEBUG(logger, fmt, ...) SERVER_LOG_FMT_LEVEL(logger, dx::LogLevel::DEBUG, fmt,  __VA_ARGS__)
 #define SERVER_LOG_FMT_INFO(logger, fmt, ...) SERVER_LOG_FMT_LEVEL(logger, dx::LogLevel::INFO, fmt, __VA_ARGS__)
@@ -37,6 +74,25 @@
 #define SERVER_LOG_FMT_ERROR(logger, fmt, ...) SERVER_LOG_FMT_LEVEL(logger, dx::LogLevel::ERROR, fmt, __VA_ARGS__)
 #define SERVER_LOG_FMT_FATAL(logger, fmt, ...) SERVER_LOG_FMT_LEVEL(logger, dx::LogLevel::FATAL, fmt, __VA_ARGS__)
 
+/**
+ * 调用点限流: 每个调用点有自己的静态 LogRateLimit, 被抑制时不会创建LogEvent,
+ * 被抑制的条数会在该调用点下一条输出的日志前以 "[suppressed N messages]" 给出,
+ * 一直没有日志通过时由后台线程每秒单独输出一条
+ */
+#define SERVER_LOG_LIMITED(logger, level, check, arg) \
+    if(dx::LogRateLimit* _server_log_limit = SERVER_LOG_COMPILE_ENABLED(level) \
+            ? ([]() -> dx::LogRateLimit& { static dx::LogRateLimit s_limit(__FILE__, __LINE__, level); return s_limit; }()) \
+                .check(&*(logger), arg) : nullptr) \
+        SERVER_LOG_EVENT_WRAP(logger, level, _server_log_limit->IsForced()).GetSS() \
+            << dx::LogSuppressed(_server_log_limit->TakeSuppressed())
+
+// 每 n 次输出一次
+#define SERVER_LOG_EVERY_N(logger, level, n) SERVER_LOG_LIMITED(logger, level, EveryN, n)
+// 只输出前 n 次
+#define SERVER_LOG_FIRST_N(logger, level, n) SERVER_LOG_LIMITED(logger, level, FirstN, n)
+// 每秒最多输出 per_sec 次
+#define SERVER_LOG_RATE(logger, level, per_sec) SERVER_LOG_LIMITED(logger, level, Rate, per_sec)
+
 #define SERVER_LOG_ROOT() dx::LoggerMgr::GetInstance()->GetRoot()
 
 #define SERVER_LOG_NAME(name) dx::LoggerMgr::GetInstance()->GetLogger(name);
@@ -103,9 +159,50 @@ public:
     std::string GetThreadName() const { return m_threadName; }
 
     std::stringstream& GetSS() { return m_ss;}
+    /**
+     * @brief 是否来自被强制打开调试输出的调用点, 是则忽略logger和appender的级别
+     */
+    bool IsForced() const { return m_forced; }
+    void SetForced(bool v) { m_forced = v; }
     void Format(const char* fmt, ...);
     void Format(const char* fmt, va_list al);
 
+    /**
+     * @brief 结构化字段的值类型
+     */
+    enum FieldType {
+        FIELD_STRING = 's',     // 字符串, 输出JSON时加引号并转义
+        FIELD_RAW = 'r'         // 数字/布尔, 原样输出
+    };
+
+    /**
+     * @brief 追加一个结构化字段, 字段按 [key长度][key][类型][value长度][value] 连续编码,
+     *  不为每个字段单独分配内存
+     */
+    void AddField(const char* key, uint32_t key_len, FieldType type, const char* val, uint32_t val_len);
+    bool HasFields() const { return !m_fields.empty(); }
+
+    /**
+     * @brief 按添加顺序遍历字段
+     * 
+     * @param  cb void(const char* key, uint32_t key_len, FieldType type, const char* val, uint32_t val_len)
+     */
+    template<class CallBack>
+    void VisitFields(CallBack cb) const {
+        const char* p = m_fields.data();
+        const char* end = p + m_fields.size();
+        while(p < end) {
+            uint32_t key_len, val_len;
+            memcpy(&key_len, p, sizeof(key_len));
+            const char* key = p + sizeof(key_len);
+            FieldType type = (FieldType)key[key_len];
+            memcpy(&val_len, key + key_len + 1, sizeof(val_len));
+            const char* val = key + key_len + 1 + sizeof(val_len);
+            cb(key, key_len, type, val, val_len);
+            p = val + val_len;
+        }
+    }
+
 private:
     const char* m_file = nullptr; // 文件名
     int32_t     m_line = 0;           // 行号
@@ -114,24 +211,268 @@ private:
     uint64_t    m_fiberId = 0;       // 协程id
     uint64_t    m_time = 0;          // 时间戳
     std::string m_threadName;     // 线程名称
+    bool        m_forced = false; // 调用点被强制打开
 
     LogLevel::Level     m_level; 
     std::stringstream   m_ss;         // 日志信息
+    std::string         m_fields;     // 结构化字段
     std::shared_ptr<Logger> m_logger; // 日志生成器
 };
 
+/**
+ * @brief 结构化日志字段构造器, SERVER_LOG_KV(logger, level).kv("conn", id).kv("lat_us", t)
+ * 
+ */
+class LogKV {
+public:
+    explicit LogKV(LogEvent* event) : m_event(event) {}
+
+    LogKV& kv(const char* key, const std::string& val) {
+        return Add(key, LogEvent::FIELD_STRING, val.data(), val.size());
+    }
+
+    LogKV& kv(const char* key, const char* val) {
+        return Add(key, LogEvent::FIELD_STRING, val, strlen(val));
+    }
+
+    LogKV& kv(const char* key, bool val) {
+        return val ? Add(key, LogEvent::FIELD_RAW, "true", 4) : Add(key, LogEvent::FIELD_RAW, "false", 5);
+    }
+
+    LogKV& kv(const char* key, char val) {
+        return Add(key, LogEvent::FIELD_STRING, &val, 1);
+    }
+
+    template<class T>
+    typename std::enable_if<std::is_integral<T>::value, LogKV&>::type kv(const char* key, T val) {
+        char buf[32];
+        int len = std::is_signed<T>::value ? snprintf(buf, sizeof(buf), "%lld", (long long)val)
+                                           : snprintf(buf, sizeof(buf), "%llu", (unsigned long long)val);
+        return Add(key, LogEvent::FIELD_RAW, buf, len);
+    }
+
+    template<class T>
+    typename std::enable_if<std::is_floating_point<T>::value, LogKV&>::type kv(const char* key, T val) {
+        // nan/inf 不是合法的JSON数字, 按字符串输出
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "%.15g", (double)val);
+        return Add(key, std::isfinite(val) ? LogEvent::FIELD_RAW : LogEvent::FIELD_STRING, buf, len);
+    }
+
+    template<class T>
+    typename std::enable_if<!std::is_arithmetic<T>::value, LogKV&>::type kv(const char* key, const T& val) {
+        std::stringstream ss;
+        ss << val;
+        return kv(key, ss.str());
+    }
+
+    /**
+     * @brief 日志正文
+     */
+    template<class T>
+    LogKV& msg(const T& val) {
+        m_event->GetSS() << val;
+        return *this;
+    }
+
+private:
+    LogKV& Add(const char* key, LogEvent::FieldType type, const char* val, size_t len) {
+        m_event->AddField(key, strlen(key), type, val, len);
+        return *this;
+    }
+
+private:
+    LogEvent* m_event;
+};
+
 class LogEventWrap {
 public:
-    LogEventWrap(LogEvent::ptr ptr);
+    LogEventWrap(LogEvent::ptr ptr, bool forced = false);
     ~LogEventWrap();
 
     std::stringstream& GetSS();
     LogEvent::ptr GetEvent() {return m_event;}
+    LogKV KV() { return LogKV(m_event.get()); }
 private:
     LogEvent::ptr m_event;
 
 };
 
+/**
+ * @brief 日志调用点, 由 SERVER_LOG_SITE 在每条日志语句处生成常量初始化的静态实例
+ *  m_state 缓存 logger指针 | 标志位, 快速路径只有一次relaxed load和比较;
+ *  logger级别或调试规则变化时由 LogSiteManager 清零, 下次执行时重新计算
+ */
+class LogSite {
+public:
+    enum {
+        ENABLED = 1,    // 输出
+        FORCED = 2,     // 被调试规则强制打开
+        CAPTURE = 4,    // 低于logger级别, 只输出到记录器
+        FLAG_MASK = 7   // Logger 至少8字节对齐, 低3位可以用作标志
+    };
+
+    constexpr LogSite(const char* file, int32_t line, int level)
+        : m_file(file), m_line(line), m_level(level), m_state(0), m_forced(false), m_registered(false) {}
+
+    /**
+     * @brief 判断对 logger 是否输出(包括只输出到记录器), 输出返回this, 否则nullptr
+     */
+    LogSite* Check(Logger* logger) {
+        uintptr_t v = m_state.load(std::memory_order_relaxed);
+        if((v & ~(uintptr_t)FLAG_MASK) == (uintptr_t)logger) {
+            return (v & (ENABLED | CAPTURE)) ? this : nullptr;
+        }
+        return Refresh(logger) ? this : nullptr;
+    }
+
+    bool IsForced() const { return m_forced.load(std::memory_order_relaxed); }
+    const char* GetFile() const { return m_file; }
+    int32_t GetLine() const { return m_line; }
+    int GetLevel() const { return m_level; }
+
+private:
+    friend class LogSiteManager;
+    bool Refresh(Logger* logger);
+
+private:
+    const char* m_file;
+    int32_t m_line;
+    int m_level;
+    std::atomic<uintptr_t> m_state;
+    std::atomic<bool> m_forced;
+    std::atomic<bool> m_registered;
+};
+
+/**
+ * @brief 单个日志调用点的限流状态, 由 SERVER_LOG_EVERY_N 等宏在调用点生成常量初始化的静态实例,
+ *  内含该调用点的 LogSite. 检查通过返回 this, 被抑制返回 nullptr 并计数;
+ *  被抑制的条数跟随下一条通过的日志输出, 一直没有日志通过时由后台线程每秒单独输出一条
+ */
+class LogRateLimit {
+public:
+    constexpr LogRateLimit(const char* file, int32_t line, int level)
+        : m_site(file, line, level), m_count(0), m_suppressed(0), m_window(0), m_logger(nullptr) {}
+
+    LogRateLimit* EveryN(Logger* logger, uint64_t n) {
+        if(!m_site.Check(logger))
+            return nullptr;
+        uint64_t c = m_count.fetch_add(1, std::memory_order_relaxed);
+        return (n <= 1 || c % n == 0) ? this : Suppress(logger);
+    }
+
+    LogRateLimit* FirstN(Logger* logger, uint64_t n) {
+        if(!m_site.Check(logger))
+            return nullptr;
+        // 先读再加, 避免超过n之后计数一直增长
+        if(m_count.load(std::memory_order_relaxed) >= n)
+            return Suppress(logger);
+        return m_count.fetch_add(1, std::memory_order_relaxed) < n ? this : Suppress(logger);
+    }
+
+    LogRateLimit* Rate(Logger* logger, uint64_t per_sec) {
+        if(!m_site.Check(logger))
+            return nullptr;
+        uint64_t now = GetCoarseSecond();
+        uint64_t window = m_window.load(std::memory_order_relaxed);
+        if(window != now && m_window.compare_exchange_strong(window, now, std::memory_order_relaxed)) {
+            m_count.store(0, std::memory_order_relaxed);
+        }
+        return m_count.fetch_add(1, std::memory_order_relaxed) < per_sec ? this : Suppress(logger);
+    }
+
+    /**
+     * @brief 取出并清零被抑制的条数
+     */
+    uint64_t TakeSuppressed() {
+        return m_suppressed.load(std::memory_order_relaxed) 
+                ? m_suppressed.exchange(0, std::memory_order_relaxed) : 0;
+    }
+
+    bool IsForced() const { return m_site.IsForced(); }
+
+    /**
+     * @brief 把所有调用点尚未输出的被抑制条数各输出一条日志, 由后台线程每秒调用
+     */
+    static void ReportAll();
+
+private:
+    LogRateLimit* Suppress(Logger* logger) {
+        m_suppressed.fetch_add(1, std::memory_order_relaxed);
+        if(m_logger.load(std::memory_order_relaxed) != logger)
+            Bind(logger);
+        return nullptr;
+    }
+
+    /**
+     * @brief 登记到后台汇总, 记录汇总日志输出到的logger
+     */
+    void Bind(Logger* logger);
+
+    static uint64_t GetCoarseSecond() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return ts.tv_sec;
+    }
+
+private:
+    LogSite m_site;
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_suppressed;
+    std::atomic<uint64_t> m_window;   // Rate 当前所在的秒
+    std::atomic<Logger*>  m_logger;   // 最近一次被抑制时的logger
+};
+
+/**
+ * @brief 所有已执行过的日志调用点, 以及运行期打开调试输出的规则
+ *  规则为 "文件" 或 "文件:行号", 文件按路径后缀匹配, 如 "fiber.cpp", "src/fiber.cpp:45"
+ */
+class LogSiteManager {
+public:
+    typedef SMutex MutexType;
+
+    LogSiteManager();
+
+    void Register(LogSite* site);
+
+    /**
+     * @brief 所有调用点的缓存失效, logger级别变化后调用
+     */
+    void Invalidate();
+
+    void SetDebugSites(const std::set<std::string>& rules);
+    void EnableDebug(const std::string& rule);
+    void DisableDebug(const std::string& rule);
+
+    // 顺序一致, LogSite::Refresh 发布后的再检查依赖它
+    uint64_t GetGeneration() const { return m_generation.load(std::memory_order_seq_cst); }
+private:
+    bool MatchNoLock(const LogSite* site) const;
+    void ApplyRulesNoLock();
+
+private:
+    MutexType m_mutex;
+    std::vector<LogSite*> m_sites;
+    std::set<std::string> m_rules;
+    std::atomic<uint64_t> m_generation;
+};
+
+typedef dx::Singleton<LogSiteManager> LogSiteMgr;
+
+/**
+ * @brief 输出被抑制的条数, 为0时不输出
+ */
+struct LogSuppressed {
+    explicit LogSuppressed(uint64_t n) : count(n) {}
+    uint64_t count;
+};
+
+inline std::ostream& operator<<(std::ostream& os, const LogSuppressed& v) {
+    if(v.count)
+        os << "[suppressed " << v.count << " messages] ";
+    return os;
+}
+
 /**
  * @brief 日志格式器
  * 
@@ -141,8 +482,9 @@ class LogFormatter
 public:
     typedef std::shared_ptr<LogFormatter> ptr;
     LogFormatter(const std::string& pattern);
+    virtual ~LogFormatter() {}
 
-    std::string Format(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event);
+    virtual std::string Format(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event);
 public:
     class FormatItem 
     {
@@ -156,12 +498,36 @@ public:
     void Init();
     bool IsError() const { return m_err; }
     const std::string GetPattern() const { return m_pattern; }
+protected:
+    /**
+     * @brief 子类使用, 不解析pattern
+     */
+    LogFormatter() {}
+
 private:
     bool m_err = false;
     std::string m_pattern;
     std::vector<FormatItem::ptr> m_items;
 };
 
+/**
+ * @brief JSON格式器, 每条日志输出一行JSON对象, 结构化字段直接编码到输出缓冲
+ *  {"time":"...","level":"INFO","logger":"root","thread_id":1,"thread_name":"main",
+ *   "fiber_id":0,"file":"a.cpp","line":1,"msg":"...","k":v}
+ */
+class JsonLogFormatter : public LogFormatter {
+public:
+    typedef std::shared_ptr<JsonLogFormatter> ptr;
+    JsonLogFormatter() {}
+
+    std::string Format(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) override;
+
+    /**
+     * @brief 把 str 按JSON字符串规则转义后追加到 out (不含两侧引号), 有SSE2时每次检查16字节
+     */
+    static void Escape(std::string& out, const char* str, size_t len);
+};
+
 /**
  * @brief 日志输出地
  * 
@@ -171,7 +537,7 @@ class LogAppender
 friend class Logger;
 public:
     typedef std::shared_ptr<LogAppender> ptr;
-    typedef SpinLock MutexType;
+    typedef FastMutex MutexType;
 
     LogAppender();
     virtual ~LogAppender(){};
@@ -186,7 +552,15 @@ public:
     
     bool HasForamtter() const { return m_hasFormatter; }
 
+    /**
+     * @brief 是否只在内存中记录(飞行记录器), 低于logger级别但不低于捕获级别的日志只交给这类Appender
+     */
+    virtual bool IsRecorder() const { return false; }
+
     virtual std::string ToYamlString() = 0;
+protected:
+    LogFormatter::ptr GetCurFormatter();
+
 protected:
     MutexType m_lock;
     bool m_hasFormatter = false;
@@ -203,10 +577,11 @@ class Logger : public std::enable_shared_from_this<Logger> {
 friend class LoggerManager;
 public:
     typedef std::shared_ptr<Logger> ptr;
-    typedef SpinLock MutexType;
+    typedef FastMutex MutexType;
 
     void Log(LogLevel::Level level, const LogEvent::ptr event);
     Logger(const std::string name = "root");
+    ~Logger();
     
     void Debug(LogEvent::ptr event);
     void Info(LogEvent::ptr event);
@@ -221,7 +596,12 @@ public:
     LogFormatter::ptr GetFormatter();
 
     LogLevel::Level GetLevel() const { return m_level; }
-    void SetLevel(LogLevel::Level val) { m_level = val; }
+    void SetLevel(LogLevel::Level val);
+    /**
+     * @brief 捕获级别: logger级别 和 所有记录器Appender级别 中的最小值,
+     *  介于捕获级别和logger级别之间的日志只输出到记录器
+     */
+    LogLevel::Level GetCaptureLevel() const { return m_captureLevel; }
     const std::string GetName() { return m_name; }
 
     std::string ToYamlString();
@@ -230,10 +610,33 @@ public:
     Logger::ptr m_root;
 
 private:
-    MutexType m_lock;
+    typedef std::vector<LogAppender::ptr> AppenderList;
+
+    /**
+     * @brief 当前Appender集合, 只能在 EpochGuard 内或持有 m_lock 时使用
+     */
+    const AppenderList* GetAppenders() const { return m_appenders.load(std::memory_order_acquire); }
+    /**
+     * @brief 持有 m_lock 时替换Appender集合, 旧集合交给 EBR 回收
+     */
+    void SetAppendersNoLock(AppenderList* val);
+    /**
+     * @brief 释锁后等待正在读取旧集合的 Log() 结束并回收, 被删除的Appender随之析构
+     */
+    void ReclaimAppenders();
+    void SetFormatterNoLock(LogFormatter::ptr val);
+    /**
+     * @brief 重新计算捕获级别, 有变化返回true
+     */
+    bool UpdateCaptureLevelNoLock();
+
+private:
+    MutexType m_lock;   // 只保护写操作(增删Appender, 设置formatter)
     LogLevel::Level m_level; // 日志级别
+    LogLevel::Level m_captureLevel; // 捕获级别
     LogFormatter::ptr m_formatter;
-    std::list<LogAppender::ptr> m_appenders;        // Appender 集合
+    // Appender 集合, 写时复制, Log() 在 EpochGuard 内读取, 不加锁也不修改引用计数
+    std::atomic<const AppenderList*> m_appenders;
 };
 
 
@@ -244,13 +647,39 @@ private:
 class StdoutLogAppender : public LogAppender
 {
 public:
-    StdoutLogAppender();
+    /**
+     * @brief Construct a new Stdout Log Appender object
+     * 
+     * @param  direct true 不经过iostream, 整条记录直接write()到标准输出,
+     *                多个线程同时写时合并成一次write, 从不按行flush
+     */
+    StdoutLogAppender(bool direct = false);
     ~StdoutLogAppender();
     typedef std::shared_ptr<StdoutLogAppender> ptr;
     void Log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) override;
 
     std::string ToYamlString() override;
+    bool IsDirect() const { return m_direct; }
+
+    /**
+     * @brief direct 模式下因待写缓冲已满或write失败丢弃的记录条数
+     */
+    uint64_t GetDropped() const { return m_dropped.load(std::memory_order_relaxed); }
+private:
+    enum {
+        MAX_PENDING = 4 * 1024 * 1024       // 待写缓冲上限, 写线程跟不上时限制内存
+    };
+
+    void WriteDirect(const std::string& str);
+    int WriteAll(const char* data, size_t len);
+
 private:
+    bool        m_direct = false;
+    bool        m_writing = false;  // 是否已有线程在执行write
+    std::string m_pending;          // 等待写线程写出的记录
+    uint64_t    m_pendingCount = 0; // m_pending 中的记录条数
+    int         m_lastErrno = 0;    // 上一次write的错误, 只由写线程访问
+    std::atomic<uint64_t> m_dropped;
 };
 
 /**
@@ -261,36 +690,239 @@ class FileLogAppender : public LogAppender
 {
 public:
     typedef std::shared_ptr<FileLogAppender> ptr;
-    FileLogAppender(const std::string& filename);
-    ~FileLogAppender(){}
+
+    /**
+     * @brief 按时间切分日志的周期
+     */
+    enum RotateType {
+        NONE = 0,
+        HOURLY,
+        DAILY
+    };
+
+    static const char* RotateToString(RotateType type);
+    static RotateType RotateFromString(const std::string& str);
+
+    /**
+     * @brief Construct a new File Log Appender object
+     * 
+     * @param  filename 文件名
+     * @param  max_size 单个文件最大字节数, 0 不按大小切分
+     * @param  rotate 按时间切分的周期
+     * @param  max_files 保留的历史文件数, 0 不清理
+     * @param  compress 切分出的历史文件是否后台gzip压缩
+     */
+    FileLogAppender(const std::string& filename, uint64_t max_size = 0, RotateType rotate = NONE, 
+                    uint32_t max_files = 0, bool compress = false);
+    ~FileLogAppender();
 
     void Log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) override;
     bool Reopen();
 
+    /**
+     * @brief 把缓冲区中的日志写入文件
+     *  写日志时每秒第一条和ERROR以上立即刷新, 后台线程每秒刷新一次安静的Appender
+     */
+    void Flush();
+
+    /**
+     * @brief 刷新所有FileLogAppender, 崩溃时调用
+     * @param  try_lock true 只刷新能立即加锁的, 信号处理函数中使用
+     */
+    static void FlushAll(bool try_lock = false);
+
     std::string ToYamlString() override;
 
+    /**
+     * @brief 通知所有FileLogAppender在下一次写日志时重新打开文件(logrotate外部切分后使用)
+     *  只修改一个原子计数, 可以在信号处理函数中调用
+     */
+    static void ReopenAll();
+
+private:
+    friend class LogFlusher;
+
+    bool ReopenNoLock();
+    void FlushIfDirty(bool try_lock);
+    void RotateNoLock(uint64_t now);
+    void RemoveExpiredNoLock();
+    uint64_t CalcPeriodEnd(uint64_t now) const;
+
 private:
 
     std::string     m_name; // 文件名
     std::ofstream   m_filestream; // 
-    uint64_t        m_lastTime;
+    uint64_t        m_maxSize = 0;      // 单个文件最大字节数
+    RotateType      m_rotate = NONE;    // 时间切分周期
+    uint32_t        m_maxFiles = 0;     // 保留的历史文件数
+    bool            m_compress = false; // 历史文件是否压缩
+    uint64_t        m_curSize = 0;      // 当前文件大小
+    uint64_t        m_periodBegin = 0;  // 当前文件所属周期的开始时间
+    uint64_t        m_periodEnd = 0;    // 当前文件所属周期的结束时间
+    uint64_t        m_reopenGen = 0;    // 已处理的重新打开请求序号
+    uint64_t        m_flushSec = 0;     // 上次刷新时的秒数
+    bool            m_dirty = false;    // 缓冲区中是否有未刷新的日志
 };
 
-class LogManager {
+/**
+ * @brief 基于mmap的文件Appender
+ *  文件按段预分配(fallocate)并映射, 日志直接拷贝进映射内存, 热路径没有系统调用;
+ *  数据在页缓存中, 进程崩溃不丢失. 只在后台线程按周期或FATAL日志时msync.
+ */
+class MmapFileLogAppender : public LogAppender 
+{
+public:
+    typedef std::shared_ptr<MmapFileLogAppender> ptr;
+
+    /**
+     * @brief Construct a new Mmap File Log Appender object
+     * 
+     * @param  filename 文件名
+     * @param  segment_size 每次预分配并映射的段大小
+     * @param  sync_interval_ms 后台msync周期(毫秒)
+     */
+    MmapFileLogAppender(const std::string& filename, uint64_t segment_size = 16 * 1024 * 1024, 
+                        uint32_t sync_interval_ms = 1000);
+    ~MmapFileLogAppender();
+
+    void Log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) override;
+    std::string ToYamlString() override;
+
+    /**
+     * @brief 把已写入的数据刷到磁盘
+     * 
+     * @param  wait true MS_SYNC 等待完成, false MS_ASYNC
+     */
+    void Sync(bool wait);
+
+    /**
+     * @brief 映射和write()都失败而丢弃的日志条数
+     */
+    uint64_t GetDropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+private:
+    /**
+     * @brief 一段映射, 最后一个引用释放时munmap
+     */
+    struct Segment {
+        typedef std::shared_ptr<Segment> ptr;
+        Segment(char* a, size_t s, uint64_t o) : addr(a), size(s), offset(o) {}
+        ~Segment();
+
+        char*       addr;
+        size_t      size;
+        uint64_t    offset; // 在文件中的偏移
+    };
+
+    bool MapNoLock(uint64_t offset);
+    /**
+     * @brief 没有可用映射时直接pwrite到 m_end, 失败计入丢弃条数
+     */
+    void WriteNoLock(const char* data, size_t len);
+    uint64_t FindLogicEnd();
+    void SyncLoop();
+
+private:
+    std::string     m_name;             // 文件名
+    int             m_fd = -1;
+    uint64_t        m_segSize;          // 段大小
+    uint32_t        m_syncInterval;     // msync周期(毫秒)
+    Segment::ptr    m_seg;              // 当前段
+    size_t          m_pos = 0;          // 当前段已写入位置
+    uint64_t        m_end = 0;          // 没有映射时的写入位置(文件偏移)
+    time_t          m_retrySec = 0;     // 上次重试映射的时间(秒)
+    std::string     m_error;            // 最近一次映射失败的原因
+    std::atomic<uint64_t> m_dropped;    // 丢弃的日志条数
+    std::vector<Segment::ptr> m_retired;// 写满待后台msync的段
+    Thread::ptr     m_syncThread;       // 后台msync线程
+    std::atomic<bool> m_stopping;
+};
+
+/**
+ * @brief 飞行记录器: 在内存环形缓冲里保留最近的格式化日志(通常是DEBUG), 从不写盘,
+ *  进程崩溃(致命信号)或 SERVER_ASSERT 失败时把内容dump到文件, 用于事后分析
+ *  每个线程一个单写者环, 写入无锁; dump只使用异步信号安全的调用
+ */
+class FlightRecorderAppender : public LogAppender
+{
 public:
-    typedef SpinLock MutexType;
+    typedef std::shared_ptr<FlightRecorderAppender> ptr;
+
+    /**
+     * @brief 单个线程的环形缓冲, 只有所属线程写入
+     */
+    struct Ring {
+        typedef std::shared_ptr<Ring> ptr;
+        Ring(size_t size);
+        ~Ring();
+
+        void Write(const char* data, size_t len);
+
+        char*       buf;
+        size_t      cap;
+        std::atomic<uint64_t> pos;  // 累计写入字节数
+        std::atomic<bool> used;     // 是否有线程正在使用, 线程退出后可以被新线程复用
+        pid_t       tid = 0;
+        char        name[16];
+    };
+
+    /**
+     * @brief Construct a new Flight Recorder Appender object
+     * 
+     * @param  dump_file 崩溃时dump的文件
+     * @param  ring_size 每个线程的环形缓冲大小
+     */
+    FlightRecorderAppender(const std::string& dump_file, uint64_t ring_size = 1024 * 1024);
+    ~FlightRecorderAppender();
+
+    void Log(std::shared_ptr<Logger> logger, LogLevel::Level level, LogEvent::ptr event) override;
+    std::string ToYamlString() override;
+    bool IsRecorder() const override { return true; }
+
+    /**
+     * @brief 把所有线程的环dump到文件, 异步信号安全
+     */
+    void Dump();
+
+    /**
+     * @brief dump所有飞行记录器, 异步信号安全, 供致命信号处理和 SERVER_ASSERT 使用
+     *  只write环的内容, 文件日志的缓冲区由 SERVER_ASSERT 在调用前自己flush
+     */
+    static void DumpAll();
+
+    /**
+     * @brief 安装 SIGSEGV/SIGABRT/SIGBUS/SIGFPE/SIGILL 处理函数, dump后恢复默认处理并重新触发信号
+     */
+    static void InstallCrashHandler();
+private:
+    Ring* GetRing();
+
+private:
+    enum { MAX_RINGS = 256 };
+
+    uint64_t    m_id;
+    std::string m_dumpFile;
+    char        m_dumpPath[256];    // 信号处理函数里使用, 避免访问std::string
+    uint64_t    m_ringSize;
+    std::vector<Ring::ptr> m_ringOwner;     // 持有所有环, 由 m_lock 保护
+    std::atomic<Ring*> m_rings[MAX_RINGS];  // dump时无锁遍历
+    std::atomic<int>   m_ringCount;
+};
 
+class LogManager {
+public:
     LogManager();
     Logger::ptr GetLogger(const std::string& name);
 
     void Init();
-    Logger::ptr GetRoot() const { return m_root; }
+    // 返回引用, SERVER_LOG_ROOT() 每次使用不增减引用计数
+    const Logger::ptr& GetRoot() const { return m_root; }
 
     std::string ToYamlString();
 private:
-    MutexType m_lock;
     Logger::ptr m_root;    
-    std::map<std::string, Logger::ptr> m_loggers;
+    // 每个日志调用点首次解析都会按名字查找, 查找不加锁
+    ConcurrentHashMap<std::string, Logger::ptr> m_loggers;
 };
 
 typedef dx::Singleton<LogManager> LoggerMgr;
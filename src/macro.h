@@ -15,6 +15,7 @@
 #include <string.h>
 #include <assert.h>
 #include "util.h"
+#include "log.h"
 
 
 #define SERVER_ASSERT(x) \
@@ -22,6 +23,8 @@
         SERVER_LOG_ERROR(SERVER_LOG_ROOT()) << "ASSERTIONG: "  #x \
             << "\nbacktrace:\n" \
             << dx::BacktraceToString(100, 2, "    "); \
+        dx::FileLogAppender::FlushAll(true); \
+        dx::FlightRecorderAppender::DumpAll(); \
         assert(x); \
     }
 
@@ -31,6 +34,8 @@
             << "\n" << #w \
             << "\nbacktrace:\n" \
             << dx::BacktraceToString(100, 2, "    "); \
+        dx::FileLogAppender::FlushAll(true); \
+        dx::FlightRecorderAppender::DumpAll(); \
         assert(x); \
     }
 
@@ -0,0 +1,315 @@
+/**
+ * @file mutex.cpp
+ * @brief 锁竞争分析的计数与报告
+ * @version 0.1
+ *
+ * @copyright Copyright (c) 2024
+ *
+ */
+#include "mutex.h"
+#include <cxxabi.h>
+#include <unordered_map>
+#include <map>
+#include <set>
+#include <vector>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+
+namespace dx {
+
+namespace {
+
+/**
+ * @brief 加锁位置, 同一个位置可能加不同类型的锁(模板代码)
+ */
+struct LockSiteKey {
+    const char* type;
+    const char* file;
+    int line;
+
+    bool operator==(const LockSiteKey& o) const {
+        return type == o.type && file == o.file && line == o.line;
+    }
+};
+
+struct LockSiteKeyHash {
+    size_t operator()(const LockSiteKey& k) const {
+        uint64_t h = (uint64_t)(uintptr_t)k.file * 0x9E3779B97F4A7C15ull;
+        h ^= (uint64_t)k.line + 0x9E3779B97F4A7C15ull + (h << 6) + (h >> 2);
+        h ^= (uint64_t)(uintptr_t)k.type + 0x9E3779B97F4A7C15ull + (h << 6) + (h >> 2);
+        return h;
+    }
+};
+
+struct LockStat {
+    uint64_t acquires = 0;
+    uint64_t contended = 0;
+    uint64_t wait_ns = 0;
+    uint64_t max_wait_ns = 0;
+    uint64_t hold_ns = 0;
+    uint64_t max_hold_ns = 0;
+
+    void Merge(const LockStat& o) {
+        acquires += o.acquires;
+        contended += o.contended;
+        wait_ns += o.wait_ns;
+        max_wait_ns = std::max(max_wait_ns, o.max_wait_ns);
+        hold_ns += o.hold_ns;
+        max_hold_ns = std::max(max_hold_ns, o.max_hold_ns);
+    }
+};
+
+typedef std::unordered_map<LockSiteKey, LockStat, LockSiteKeyHash> SiteStatMap;
+/**
+ * @brief 锁实例 -> 加锁位置 -> 计数; 锁析构后它的计数并入 nullptr 项, 只保留按位置的统计
+ */
+typedef std::unordered_map<const void*, SiteStatMap> LockStatMap;
+
+static void MergeSites(SiteStatMap& dst, const SiteStatMap& src) {
+    for(auto& i : src) {
+        dst[i.first].Merge(i.second);
+    }
+}
+
+static void MergeLocks(LockStatMap& dst, const LockStatMap& src) {
+    for(auto& i : src) {
+        MergeSites(dst[i.first], i.second);
+    }
+}
+
+/**
+ * @brief 把已析构的锁的计数并入 nullptr 项并删除
+ */
+static void FoldLock(LockStatMap& m, const void* lock) {
+    if(!m.count(lock))
+        return;
+    SiteStatMap& dst = m[nullptr];
+    MergeSites(dst, m[lock]);
+    m.erase(lock);
+}
+
+/**
+ * @brief 一个线程的计数, 本线程写入, 生成报告时由其他线程读取, 用一把几乎无竞争的锁保护
+ *  这里的锁都直接调用 Lock/Unlock, 不经过守卫, 不会递归记录
+ */
+struct ThreadLockStats {
+    CASLock lock;
+    LockStatMap stats;
+};
+
+/**
+ * @brief 所有线程的计数, 线程退出时把计数并入 retired; 不析构, 进程退出时其他线程可能仍在记录
+ */
+struct LockRegistry {
+    SMutex mutex;
+    std::set<ThreadLockStats*> live;
+    LockStatMap retired;
+    std::map<const void*, std::string> names;
+
+    static LockRegistry* Get() {
+        static LockRegistry* s_registry = new LockRegistry;
+        return s_registry;
+    }
+};
+
+static thread_local ThreadLockStats* t_stats = nullptr;
+static thread_local bool t_exited = false;
+
+struct ThreadLockStatsHolder {
+    ThreadLockStats* stats = nullptr;
+
+    ~ThreadLockStatsHolder() {
+        t_stats = nullptr;
+        t_exited = true;
+        if(!stats)
+            return;
+        LockRegistry* reg = LockRegistry::Get();
+        reg->mutex.Lock();
+        reg->live.erase(stats);
+        MergeLocks(reg->retired, stats->stats);
+        reg->mutex.Unlock();
+        delete stats;
+    }
+};
+
+static thread_local ThreadLockStatsHolder t_holder;
+
+/**
+ * @brief 线程的计数, 线程局部变量析构以后返回nullptr, 之后的加锁不再记录
+ */
+static ThreadLockStats* GetThreadStats() {
+    if(t_stats || t_exited)
+        return t_stats;
+    t_stats = new ThreadLockStats;
+    // 通过 t_holder 保存, 线程退出时并入 retired
+    t_holder.stats = t_stats;
+    LockRegistry* reg = LockRegistry::Get();
+    reg->mutex.Lock();
+    reg->live.insert(t_stats);
+    reg->mutex.Unlock();
+    return t_stats;
+}
+
+static std::string Demangle(const char* name) {
+    int status = 0;
+    char* buf = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+    std::string rt = (status == 0 && buf) ? buf : name;
+    free(buf);
+    if(rt.compare(0, 4, "dx::") == 0)
+        rt = rt.substr(4);
+    return rt;
+}
+
+/**
+ * @brief __builtin_FILE 给出的是编译时的完整路径, 去掉工程目录前缀
+ */
+static std::string ShortFile(const char* file) {
+    static const std::string s_self = __builtin_FILE();
+    static const std::string s_root = s_self.size() > 13 && s_self.compare(s_self.size() - 13, 13, "src/mutex.cpp") == 0
+                                    ? s_self.substr(0, s_self.size() - 13) : "";
+    std::string f = file;
+    if(!s_root.empty() && f.compare(0, s_root.size(), s_root) == 0)
+        return f.substr(s_root.size());
+    return f;
+}
+
+static void FormatStat(std::ostream& os, const LockStat& s) {
+    os << " acquires=" << s.acquires
+       << " contended=" << s.contended
+       << " contended_pct=" << std::fixed << std::setprecision(2)
+       << (s.acquires ? s.contended * 100.0 / s.acquires : 0)
+       << " wait_total_us=" << s.wait_ns / 1000
+       << " wait_max_us=" << s.max_wait_ns / 1000
+       << " hold_total_us=" << s.hold_ns / 1000
+       << " hold_avg_ns=" << (s.acquires ? s.hold_ns / s.acquires : 0)
+       << " hold_max_us=" << s.max_hold_ns / 1000;
+}
+
+template<class K>
+static std::vector<std::pair<K, LockStat> > SortByWait(const std::map<K, LockStat>& m) {
+    std::vector<std::pair<K, LockStat> > v(m.begin(), m.end());
+    std::sort(v.begin(), v.end(), [](const std::pair<K, LockStat>& a, const std::pair<K, LockStat>& b) {
+        if(a.second.wait_ns != b.second.wait_ns)
+            return a.second.wait_ns > b.second.wait_ns;
+        return a.second.contended > b.second.contended;
+    });
+    return v;
+}
+
+}
+
+void LockProfiler::Record(const void* lock, const char* type, const char* file, int line,
+                          bool contended, uint64_t wait_ns, uint64_t hold_ns) {
+    ThreadLockStats* ts = GetThreadStats();
+    if(!ts)
+        return;
+    LockSiteKey key = {type, file, line};
+    ts->lock.Lock();
+    LockStat& s = ts->stats[lock][key];
+    ++s.acquires;
+    if(contended)
+        ++s.contended;
+    s.wait_ns += wait_ns;
+    s.hold_ns += hold_ns;
+    if(wait_ns > s.max_wait_ns)
+        s.max_wait_ns = wait_ns;
+    if(hold_ns > s.max_hold_ns)
+        s.max_hold_ns = hold_ns;
+    ts->lock.Unlock();
+}
+
+void LockProfiler::SetName(const void* lock, const std::string& name) {
+    LockRegistry* reg = LockRegistry::Get();
+    reg->mutex.Lock();
+    reg->names[lock] = name;
+    reg->mutex.Unlock();
+}
+
+void LockProfiler::Forget(const void* lock) {
+    LockRegistry* reg = LockRegistry::Get();
+    reg->mutex.Lock();
+    reg->names.erase(lock);
+    FoldLock(reg->retired, lock);
+    for(auto i : reg->live) {
+        i->lock.Lock();
+        FoldLock(i->stats, lock);
+        i->lock.Unlock();
+    }
+    reg->mutex.Unlock();
+}
+
+void LockProfiler::Reset() {
+    LockRegistry* reg = LockRegistry::Get();
+    reg->mutex.Lock();
+    reg->retired.clear();
+    for(auto i : reg->live) {
+        i->lock.Lock();
+        i->stats.clear();
+        i->lock.Unlock();
+    }
+    reg->mutex.Unlock();
+}
+
+std::string LockProfiler::Report(size_t top) {
+    LockStatMap all;
+    std::map<const void*, std::string> names;
+    LockRegistry* reg = LockRegistry::Get();
+    reg->mutex.Lock();
+    all = reg->retired;
+    for(auto i : reg->live) {
+        i->lock.Lock();
+        MergeLocks(all, i->stats);
+        i->lock.Unlock();
+    }
+    names = reg->names;
+    reg->mutex.Unlock();
+
+    // 按锁实例 和 按加锁位置 两个维度汇总
+    std::map<std::pair<const void*, const char*>, LockStat> by_lock;
+    std::map<std::pair<std::string, int>, LockStat> by_site;
+    std::map<std::pair<std::string, int>, const char*> site_type;
+    LockStat total;
+    for(auto& l : all) {
+        for(auto& i : l.second) {
+            // 已析构的锁只计入按位置的统计
+            if(l.first)
+                by_lock[std::make_pair(l.first, i.first.type)].Merge(i.second);
+            auto site = std::make_pair(ShortFile(i.first.file), i.first.line);
+            by_site[site].Merge(i.second);
+            site_type[site] = i.first.type;
+            total.Merge(i.second);
+        }
+    }
+
+    std::stringstream ss;
+#if !SERVER_LOCK_PROFILE
+    ss << "lock profile disabled, rebuild with -DSERVER_LOCK_PROFILE=ON" << std::endl;
+#endif
+    ss << "lock profile locks=" << by_lock.size() << " sites=" << by_site.size();
+    FormatStat(ss, total);
+    ss << std::endl;
+
+    ss << "by lock (sorted by wait time):" << std::endl;
+    auto locks = SortByWait(by_lock);
+    for(size_t i = 0; i < locks.size() && i < top; i++) {
+        auto it = names.find(locks[i].first.first);
+        ss << "  " << Demangle(locks[i].first.second) << " " << locks[i].first.first;
+        if(it != names.end())
+            ss << " name=" << it->second;
+        FormatStat(ss, locks[i].second);
+        ss << std::endl;
+    }
+
+    ss << "by site (sorted by wait time):" << std::endl;
+    auto sites = SortByWait(by_site);
+    for(size_t i = 0; i < sites.size() && i < top; i++) {
+        ss << "  " << sites[i].first.first << ":" << sites[i].first.second
+           << " " << Demangle(site_type[sites[i].first]);
+        FormatStat(ss, sites[i].second);
+        ss << std::endl;
+    }
+    return ss.str();
+}
+
+}
@@ -3,38 +3,161 @@
 
 #include <mutex>
 #include <atomic>
+#include <algorithm>
+#include <new>
+#include <type_traits>
+#include <string.h>
+#include <string>
+#include <time.h>
+#include <typeinfo>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 namespace dx {
 
-    
+/**
+ * @brief 锁竞争分析, 由 CMake 选项 SERVER_LOCK_PROFILE 打开
+ *  打开后各个锁守卫先 TryLock 判断是否有竞争, 记录 等待时间/持有时间, 按锁实例和加锁位置
+ *  累计在线程局部计数中, LockProfiler::Report 汇总所有线程后输出排序的报告
+ *  关闭时守卫与原来完全相同, 没有额外开销
+ */
+#ifndef SERVER_LOCK_PROFILE
+#define SERVER_LOCK_PROFILE 0
+#endif
+
+class LockProfiler {
+public:
+    /**
+     * @brief 一次加锁的统计, 在守卫解锁时提交
+     */
+    static void Record(const void* lock, const char* type, const char* file, int line,
+                       bool contended, uint64_t wait_ns, uint64_t hold_ns);
+
+    /**
+     * @brief 给锁实例起名字, 报告中代替地址显示
+     */
+    static void SetName(const void* lock, const std::string& name);
+
+    /**
+     * @brief 锁析构时调用: 它的计数只保留在按位置的统计里, 名字删除,
+     *  按实例的表不会无限增长, 新锁复用同一地址时也不会和旧锁合并
+     */
+    static void Forget(const void* lock);
+
+    /**
+     * @brief 汇总所有线程的计数, 按锁实例和加锁位置分别以总等待时间降序输出
+     *
+     * @param  top 每部分最多输出的行数
+     */
+    static std::string Report(size_t top = 20);
+    static void Reset();
+
+    static uint64_t Now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000 * 1000 * 1000ul + ts.tv_nsec;
+    }
+};
+
+#if SERVER_LOCK_PROFILE
+#define SERVER_LOCK_FORGET(lock) dx::LockProfiler::Forget(lock)
+#else
+#define SERVER_LOCK_FORGET(lock)
+#endif
+
+#if SERVER_LOCK_PROFILE
+/**
+ * @brief 守卫中记录一次加锁的位置和时间
+ */
+class LockProbe {
+public:
+    LockProbe(const void* lock, const char* type, const char* file, int line)
+        :m_lock(lock)
+        ,m_type(type)
+        ,m_file(file)
+        ,m_line(line) {}
+
+    /**
+     * @brief 先尝试加锁, 失败说明有竞争, 再阻塞加锁
+     */
+    template<class TryFn, class LockFn>
+    void Acquire(TryFn try_lock, LockFn lock) {
+        m_begin = LockProfiler::Now();
+        m_contended = !try_lock();
+        if(m_contended)
+            lock();
+        m_acquired = LockProfiler::Now();
+    }
+
+    template<class UnlockFn>
+    void Release(UnlockFn unlock) {
+        uint64_t now = LockProfiler::Now();
+        unlock();
+        LockProfiler::Record(m_lock, m_type, m_file, m_line, m_contended,
+                             m_acquired - m_begin, now - m_acquired);
+    }
+private:
+    const void* m_lock;
+    const char* m_type;
+    const char* m_file;
+    int         m_line;
+    bool        m_contended = false;
+    uint64_t    m_begin = 0;
+    uint64_t    m_acquired = 0;
+};
+#endif
+
 template<class T>
 class ScopeLockImpl {
 public:
+#if SERVER_LOCK_PROFILE
+    ScopeLockImpl(T& mutex, const char* file = __builtin_FILE(), int line = __builtin_LINE())
+        : m_mutex(mutex), m_probe(&mutex, typeid(T).name(), file, line) {
+        m_probe.Acquire([this]() { return m_mutex.TryLock(); }, [this]() { m_mutex.Lock(); });
+        m_locked = true;
+    }
+#else
     ScopeLockImpl(T& mutex) : m_mutex(mutex) {
         m_mutex.Lock();
         m_locked = true;
     }
+#endif
 
     ~ScopeLockImpl() {
-        m_mutex.Unlock(); 
+        Unlock();
     }
 
     void Lock() {
         if(!m_locked) {
+#if SERVER_LOCK_PROFILE
+            m_probe.Acquire([this]() { return m_mutex.TryLock(); }, [this]() { m_mutex.Lock(); });
+#else
             m_mutex.Lock();
+#endif
             m_locked = true;
         }
     }
 
     void Unlock() {
         if(m_locked) {
+#if SERVER_LOCK_PROFILE
+            m_probe.Release([this]() { m_mutex.Unlock(); });
+#else
             m_mutex.Unlock();
+#endif
             m_locked = false;
         }
     }   
 
 private:
     T& m_mutex;
+#if SERVER_LOCK_PROFILE
+    LockProbe m_probe;
+#endif
     bool m_locked;
 };
 
@@ -42,62 +165,100 @@ private:
 template<class T>
 class ReadScopeLockImpl {
 public:
+#if SERVER_LOCK_PROFILE
+    ReadScopeLockImpl(T& mutex, const char* file = __builtin_FILE(), int line = __builtin_LINE())
+        : m_mutex(mutex), m_probe(&mutex, typeid(T).name(), file, line) {
+        m_probe.Acquire([this]() { return m_mutex.TryRdLock(); }, [this]() { m_mutex.RdLock(); });
+        m_locked = true;
+    }
+#else
     ReadScopeLockImpl(T& mutex) : m_mutex(mutex) {
         m_mutex.RdLock();
         m_locked = true;
     }
+#endif
 
     ~ReadScopeLockImpl() {
-        m_mutex.Unlock(); 
+        Unlock();
     }
 
     void Lock() {
         if(!m_locked) {
+#if SERVER_LOCK_PROFILE
+            m_probe.Acquire([this]() { return m_mutex.TryRdLock(); }, [this]() { m_mutex.RdLock(); });
+#else
             m_mutex.RdLock();
+#endif
             m_locked = true;
         }
     }
 
     void Unlock() {
         if(m_locked) {
+#if SERVER_LOCK_PROFILE
+            m_probe.Release([this]() { m_mutex.Unlock(); });
+#else
             m_mutex.Unlock();
+#endif
             m_locked = false;
         }
     }   
 
 private:
     T& m_mutex;
+#if SERVER_LOCK_PROFILE
+    LockProbe m_probe;
+#endif
     bool m_locked;
 };
 
 template<class T>
 class WriteScopeLockImpl {
 public:
+#if SERVER_LOCK_PROFILE
+    WriteScopeLockImpl(T& mutex, const char* file = __builtin_FILE(), int line = __builtin_LINE())
+        : m_mutex(mutex), m_probe(&mutex, typeid(T).name(), file, line) {
+        m_probe.Acquire([this]() { return m_mutex.TryWrLock(); }, [this]() { m_mutex.WrLock(); });
+        m_locked = true;
+    }
+#else
     WriteScopeLockImpl(T& mutex) : m_mutex(mutex) {
         m_mutex.WrLock();
         m_locked = true;
     }
+#endif
 
     ~WriteScopeLockImpl() {
-        m_mutex.Unlock(); 
+        Unlock();
     }
 
     void Lock() {
         if(!m_locked) {
+#if SERVER_LOCK_PROFILE
+            m_probe.Acquire([this]() { return m_mutex.TryWrLock(); }, [this]() { m_mutex.WrLock(); });
+#else
             m_mutex.WrLock();
+#endif
             m_locked = true;
         }
     }
 
     void Unlock() {
         if(m_locked) {
+#if SERVER_LOCK_PROFILE
+            m_probe.Release([this]() { m_mutex.Unlock(); });
+#else
             m_mutex.Unlock();
+#endif
             m_locked = false;
         }
     }   
 
 private:
     T& m_mutex;
+#if SERVER_LOCK_PROFILE
+    LockProbe m_probe;
+#endif
     bool m_locked;
 };
 
@@ -110,6 +271,7 @@ public:
     }
 
     ~SMutex() {
+        SERVER_LOCK_FORGET(this);
         pthread_mutex_destroy(&m_mutex);
     }
 
@@ -117,6 +279,10 @@ public:
         pthread_mutex_lock(&m_mutex);
     }
 
+    bool TryLock() {
+        return pthread_mutex_trylock(&m_mutex) == 0;
+    }
+
     void Unlock() {
         pthread_mutex_unlock(&m_mutex);
     }   
@@ -129,9 +295,12 @@ class NullMutex {
 public:
     typedef ScopeLockImpl<NullMutex> MutexGuard;
     NullMutex() {}
-    ~NullMutex() {}
+    ~NullMutex() {
+        SERVER_LOCK_FORGET(this);
+    }
 
     void Lock() {}
+    bool TryLock() { return true; }
     void Unlock(){}
 };
 
@@ -145,6 +314,7 @@ public:
     }
 
     ~RWMutex() {
+        SERVER_LOCK_FORGET(this);
         pthread_rwlock_destroy(&m_lock);
     }
 
@@ -156,6 +326,14 @@ public:
         pthread_rwlock_wrlock(&m_lock);
     }
 
+    bool TryRdLock() {
+        return pthread_rwlock_tryrdlock(&m_lock) == 0;
+    }
+
+    bool TryWrLock() {
+        return pthread_rwlock_trywrlock(&m_lock) == 0;
+    }
+
     void Unlock() {
         pthread_rwlock_unlock(&m_lock);
     }
@@ -171,10 +349,14 @@ public:
     typedef WriteScopeLockImpl<NullRWMutex> WriteLock;
 
     NullRWMutex() {}
-    ~NullRWMutex() {}
+    ~NullRWMutex() {
+        SERVER_LOCK_FORGET(this);
+    }
 
     void RdLock() {}
     void WrLock() {}
+    bool TryRdLock() { return true; }
+    bool TryWrLock() { return true; }
     void Unlock() {}
 };
 
@@ -187,6 +369,7 @@ public:
     }
 
     ~SpinLock() {
+        SERVER_LOCK_FORGET(this);
         pthread_spin_destroy(&m_mutex);
     }
 
@@ -194,6 +377,10 @@ public:
         pthread_spin_lock(&m_mutex);
     }
 
+    bool TryLock() {
+        return pthread_spin_trylock(&m_mutex) == 0;
+    }
+
     void Unlock() {
         pthread_spin_unlock(&m_mutex);
     }
@@ -208,12 +395,18 @@ public:
     typedef ScopeLockImpl<CASLock> MutexGuard;
     CASLock() : m_mutex(ATOMIC_FLAG_INIT) {}
 
-    ~CASLock() {}
+    ~CASLock() {
+        SERVER_LOCK_FORGET(this);
+    }
 
     void Lock() {
         while(std::atomic_flag_test_and_set_explicit(&m_mutex, std::memory_order_acquire));
     }
 
+    bool TryLock() {
+        return !std::atomic_flag_test_and_set_explicit(&m_mutex, std::memory_order_acquire);
+    }
+
     void Unlock(){
         m_mutex.clear(std::memory_order_release);
     }
@@ -221,6 +414,599 @@ private:
     volatile std::atomic_flag m_mutex;
 };
 
+/**
+ * @brief 自旋等待时让出流水线, 降低功耗和对另一个超线程的影响
+ */
+inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#else
+    asm volatile("" ::: "memory");
+#endif
+}
+
+/**
+ * @brief 单核上自旋等待没有意义, 持锁线程要等自己让出CPU才能运行
+ */
+inline bool IsMultiCore() {
+    static const bool s_multi = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+    return s_multi;
+}
+
+inline long FutexWait(std::atomic<int>* addr, int val) {
+    return syscall(SYS_futex, (int*)addr, FUTEX_WAIT_PRIVATE, val, nullptr, nullptr, 0);
+}
+
+inline long FutexWake(std::atomic<int>* addr, int cnt) {
+    return syscall(SYS_futex, (int*)addr, FUTEX_WAKE_PRIVATE, cnt, nullptr, nullptr, 0);
+}
+
+/**
+ * @brief 基于futex的自适应互斥量
+ *  无竞争时一次CAS; 有竞争时先有限次自旋(pause + 指数退避), 自旋次数按最近
+ *  成功拿到锁所用的次数自适应调整, 仍拿不到再futex睡眠
+ *  状态: 0 未加锁, 1 加锁无等待者, 2 加锁且可能有等待者(解锁时需要唤醒)
+ */
+class FastMutex {
+public:
+    typedef ScopeLockImpl<FastMutex> MutexGuard;
+
+    FastMutex() : m_state(0), m_spin(SPIN_INIT) {}
+
+    ~FastMutex() {
+        SERVER_LOCK_FORGET(this);
+    }
+
+    void Lock() {
+        int c = 0;
+        if(m_state.compare_exchange_strong(c, 1, std::memory_order_acquire, std::memory_order_relaxed))
+            return;
+        LockSlow();
+    }
+
+    bool TryLock() {
+        int c = 0;
+        return m_state.compare_exchange_strong(c, 1, std::memory_order_acquire, std::memory_order_relaxed);
+    }
+
+    void Unlock() {
+        if(m_state.exchange(0, std::memory_order_release) == 2)
+            FutexWake(&m_state, 1);
+    }
+
+private:
+    enum {
+        SPIN_INIT = 16,     // 自旋次数的初始估计
+        SPIN_MAX = 256,     // 自旋次数上限
+        BACKOFF_MAX = 64    // 每次自旋最多pause次数
+    };
+
+    void LockSlow() {
+        // 单核上持锁线程不可能在自旋期间释放锁, 直接睡眠
+        if(IsMultiCore()) {
+            int limit = std::min<int>(m_spin.load(std::memory_order_relaxed) * 2 + 10, SPIN_MAX);
+            int backoff = 1;
+            for(int i = 0; i < limit; i++) {
+                for(int k = 0; k < backoff; k++) {
+                    CpuRelax();
+                }
+                if(backoff < BACKOFF_MAX)
+                    backoff <<= 1;
+                // 先读再CAS, 避免自旋时反复独占缓存行
+                int c = 0;
+                if(m_state.load(std::memory_order_relaxed) == 0
+                        && m_state.compare_exchange_strong(c, 1, std::memory_order_acquire, std::memory_order_relaxed)) {
+                    int spin = m_spin.load(std::memory_order_relaxed);
+                    m_spin.store(spin + (i - spin) / 8, std::memory_order_relaxed);
+                    return;
+                }
+            }
+            int spin = m_spin.load(std::memory_order_relaxed);
+            m_spin.store(spin + (limit - spin) / 8, std::memory_order_relaxed);
+        }
+
+        // 标记有等待者后睡眠, 被唤醒后仍以2占有锁, 解锁时继续唤醒下一个
+        int c = m_state.exchange(2, std::memory_order_acquire);
+        while(c != 0) {
+            FutexWait(&m_state, 2);
+            c = m_state.exchange(2, std::memory_order_acquire);
+        }
+    }
+
+private:
+    std::atomic<int> m_state;
+    // 最近拿到锁所需自旋次数的滑动平均, 只是估计值, 不需要精确同步
+    std::atomic<int> m_spin;
+};
+
+/**
+ * @brief test-and-test-and-set 自旋锁
+ *  等待时只读锁字, 锁被释放时才尝试交换, 避免 CASLock 那样每次自旋都独占缓存行;
+ *  失败后指数退避, 退避到上限后让出CPU
+ */
+class TTASLock {
+public:
+    typedef ScopeLockImpl<TTASLock> MutexGuard;
+
+    TTASLock() : m_locked(false) {}
+
+    ~TTASLock() {
+        SERVER_LOCK_FORGET(this);
+    }
+
+    void Lock() {
+        if(!m_locked.exchange(true, std::memory_order_acquire))
+            return;
+        int backoff = 1;
+        while(true) {
+            while(m_locked.load(std::memory_order_relaxed)) {
+                if(backoff >= BACKOFF_MAX || !IsMultiCore()) {
+                    sched_yield();
+                } else {
+                    for(int i = 0; i < backoff; i++) {
+                        CpuRelax();
+                    }
+                    backoff <<= 1;
+                }
+            }
+            if(!m_locked.exchange(true, std::memory_order_acquire))
+                return;
+        }
+    }
+
+    bool TryLock() {
+        return !m_locked.load(std::memory_order_relaxed)
+            && !m_locked.exchange(true, std::memory_order_acquire);
+    }
+
+    void Unlock() {
+        m_locked.store(false, std::memory_order_release);
+    }
+
+private:
+    enum { BACKOFF_MAX = 1024 };
+    std::atomic<bool> m_locked;
+};
+
+/**
+ * @brief MCS 队列锁
+ *  等待者按到达顺序排队, 每个等待者只在自己的节点上自旋, 解锁时直接交给下一个;
+ *  自旋一段时间仍未轮到则在自己节点上futex睡眠, 线程数超过核数时不空转
+ *  节点取自线程局部的空闲链表, 同一线程可以同时持有多把MCS锁
+ */
+class MCSLock {
+public:
+    typedef ScopeLockImpl<MCSLock> MutexGuard;
+
+    MCSLock() : m_tail(nullptr), m_owner(nullptr) {}
+
+    ~MCSLock() {
+        SERVER_LOCK_FORGET(this);
+    }
+
+    MCSLock(const MCSLock&) = delete;
+    MCSLock& operator=(const MCSLock&) = delete;
+
+    void Lock() {
+        Node* node = NodePool::Alloc();
+        Node* pred = m_tail.exchange(node, std::memory_order_acq_rel);
+        if(pred) {
+            pred->next.store(node, std::memory_order_release);
+            Wait(node);
+        }
+        m_owner = node;
+    }
+
+    bool TryLock() {
+        Node* node = NodePool::Alloc();
+        Node* expected = nullptr;
+        if(!m_tail.compare_exchange_strong(expected, node, std::memory_order_acq_rel)) {
+            NodePool::Free(node);
+            return false;
+        }
+        m_owner = node;
+        return true;
+    }
+
+    void Unlock() {
+        Node* node = m_owner;
+        Node* succ = node->next.load(std::memory_order_acquire);
+        if(!succ) {
+            Node* expected = node;
+            if(m_tail.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel)) {
+                NodePool::Free(node);
+                return;
+            }
+            // 后继已经交换了tail, 还没来得及链到我们后面
+            while(!(succ = node->next.load(std::memory_order_acquire))) {
+                CpuRelax();
+            }
+        }
+        if(succ->state.exchange(GRANTED, std::memory_order_release) == SLEEPING)
+            FutexWake(&succ->state, 1);
+        NodePool::Free(node);
+    }
+
+private:
+    enum { GRANTED = 0, WAITING = 1, SLEEPING = 2, SPIN_MAX = 512 };
+
+    struct Node {
+        std::atomic<Node*> next;
+        std::atomic<int> state;
+        Node* free_next;    // 空闲链表, 只由所属线程访问
+        char pad[64 - sizeof(std::atomic<Node*>) - sizeof(std::atomic<int>) - sizeof(Node*)];
+    };
+
+    /**
+     * @brief 线程局部的节点空闲链表
+     *  解锁线程把 GRANTED 写入后继节点后还要 FutexWake 它, 此时后继可能已经拿到锁、解锁并退出线程,
+     *  所以节点从不释放: 线程退出时把空闲链表交给全局链表, 由其他线程复用, 内存一直有效
+     *  复用后的节点收到迟到的唤醒只是一次虚假唤醒, Wait 会重新检查状态
+     */
+    class NodePool {
+    public:
+        static Node* Alloc() {
+            NodePool& pool = Get();
+            if(!pool.m_free)
+                pool.m_free = TakeGlobal();
+            Node* node = pool.m_free;
+            if(node) {
+                pool.m_free = node->free_next;
+            } else {
+                node = new Node;
+            }
+            node->next.store(nullptr, std::memory_order_relaxed);
+            node->state.store(WAITING, std::memory_order_relaxed);
+            return node;
+        }
+
+        static void Free(Node* node) {
+            NodePool& pool = Get();
+            node->free_next = pool.m_free;
+            pool.m_free = node;
+        }
+
+        ~NodePool() {
+            if(!m_free)
+                return;
+            Node* last = m_free;
+            while(last->free_next) {
+                last = last->free_next;
+            }
+            GlobalFree& g = GetGlobal();
+            SpinLock::MutexGuard lock(g.mutex);
+            last->free_next = g.head;
+            g.head = m_free;
+            m_free = nullptr;
+        }
+    private:
+        struct GlobalFree {
+            SpinLock mutex;
+            Node* head = nullptr;
+        };
+
+        static GlobalFree& GetGlobal() {
+            // 不析构, 其他线程可能在静态析构之后退出
+            static GlobalFree* s_global = new GlobalFree;
+            return *s_global;
+        }
+
+        /**
+         * @brief 取走全局链表上的所有节点, 只在本线程空闲链表为空时调用
+         */
+        static Node* TakeGlobal() {
+            GlobalFree& g = GetGlobal();
+            SpinLock::MutexGuard lock(g.mutex);
+            Node* head = g.head;
+            g.head = nullptr;
+            return head;
+        }
+
+        static NodePool& Get() {
+            static thread_local NodePool t_pool;
+            return t_pool;
+        }
+        Node* m_free = nullptr;
+    };
+
+    static void Wait(Node* node) {
+        if(IsMultiCore()) {
+            for(int i = 0; i < SPIN_MAX; i++) {
+                if(node->state.load(std::memory_order_acquire) == GRANTED)
+                    return;
+                CpuRelax();
+            }
+        }
+        int c = WAITING;
+        if(!node->state.compare_exchange_strong(c, SLEEPING, std::memory_order_acquire))
+            return;
+        while(node->state.load(std::memory_order_acquire) != GRANTED) {
+            FutexWait(&node->state, SLEEPING);
+        }
+    }
+
+private:
+    std::atomic<Node*> m_tail;
+    Node* m_owner;  // 只由持锁线程读写
+};
+
+/**
+ * @brief 顺序锁, 保存可平凡复制的小值
+ *  写者把序号改为奇数, 写入数据, 再改回偶数; 读者无锁拷贝数据, 前后序号一致且为偶数才有效,
+ *  否则重试. 读者只读共享内存, 不会让缓存行在读线程之间来回传递
+ *  数据按8字节拆成原子字读写, 读写并发时没有数据竞争
+ */
+template<class T>
+class SeqLock {
+public:
+    static_assert(std::is_trivially_copyable<T>::value, "SeqLock requires trivially copyable T");
+
+    SeqLock(const T& val = T()) : m_seq(0) {
+        uint64_t buf[WORDS] = {0};
+        memcpy(buf, &val, sizeof(T));
+        for(int i = 0; i < WORDS; i++) {
+            m_words[i].store(buf[i], std::memory_order_relaxed);
+        }
+    }
+
+    SeqLock(const SeqLock&) = delete;
+    SeqLock& operator=(const SeqLock&) = delete;
+
+    T Load() const {
+        uint64_t buf[WORDS];
+        while(true) {
+            uint32_t seq = m_seq.load(std::memory_order_acquire);
+            if(seq & 1) {
+                CpuRelax();
+                continue;
+            }
+            for(int i = 0; i < WORDS; i++) {
+                buf[i] = m_words[i].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if(m_seq.load(std::memory_order_relaxed) == seq)
+                break;
+        }
+        T val;
+        memcpy(&val, buf, sizeof(T));
+        return val;
+    }
+
+    /**
+     * @brief 多个写者之间用序号的奇偶互斥, 写者应当很少
+     */
+    void Store(const T& val) {
+        uint64_t buf[WORDS] = {0};
+        memcpy(buf, &val, sizeof(T));
+
+        uint32_t seq = m_seq.load(std::memory_order_relaxed);
+        while((seq & 1) || !m_seq.compare_exchange_weak(seq, seq + 1, std::memory_order_relaxed)) {
+            CpuRelax();
+            seq = m_seq.load(std::memory_order_relaxed);
+        }
+        // 奇数序号先于数据可见
+        std::atomic_thread_fence(std::memory_order_release);
+        for(int i = 0; i < WORDS; i++) {
+            m_words[i].store(buf[i], std::memory_order_relaxed);
+        }
+        m_seq.store(seq + 2, std::memory_order_release);
+    }
+
+    /**
+     * @brief 每次写入加2
+     */
+    uint32_t GetSequence() const { return m_seq.load(std::memory_order_acquire); }
+
+private:
+    enum { WORDS = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t) };
+
+    std::atomic<uint32_t> m_seq;
+    std::atomic<uint64_t> m_words[WORDS];
+};
+
+/**
+ * @brief 分布式读写锁, 用于读远多于写的数据
+ *  每个线程固定使用一个独占缓存行的读计数槽, 读锁只修改自己的槽, 不与其他读线程争用;
+ *  写锁先置写标志, 再等待所有槽归零
+ *  每把锁占 SLOT_COUNT 个缓存行(4KB), 只用在数量很少的热点结构上
+ *  读锁可以递归: 线程已经持有这把锁的读锁时, 嵌套的 RdLock 不等待挂起的写者(写者在等它退出),
+ *  每个线程最多同时记录 MAX_HELD 把不同锁的读锁深度, 超出的部分不支持递归
+ */
+class DistRWMutex {
+public:
+    typedef ReadScopeLockImpl<DistRWMutex> ReadLock;
+    typedef WriteScopeLockImpl<DistRWMutex> WriteLock;
+
+    DistRWMutex() : m_writer(false), m_owner(nullptr) {
+        // C++11 的 new 不保证超过16字节的对齐, 槽数组单独按缓存行对齐分配
+        void* p = nullptr;
+        if(posix_memalign(&p, CACHE_LINE, sizeof(Slot) * SLOT_COUNT) != 0)
+            throw std::bad_alloc();
+        m_slots = static_cast<Slot*>(p);
+        for(int i = 0; i < SLOT_COUNT; i++) {
+            new (&m_slots[i]) Slot();
+        }
+    }
+
+    ~DistRWMutex() {
+        SERVER_LOCK_FORGET(this);
+        free(m_slots);
+    }
+
+    DistRWMutex(const DistRWMutex&) = delete;
+    DistRWMutex& operator=(const DistRWMutex&) = delete;
+
+    void RdLock() {
+        Slot& slot = m_slots[GetSlot()];
+        if(EnterNested()) {
+            // 本线程已持有读锁, 写者拿不到锁, 直接加计数
+            slot.readers.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        while(true) {
+            // 与 WrLock 构成 Dekker 式握手: 先加计数再看写标志, 两边都是顺序一致的
+            slot.readers.fetch_add(1, std::memory_order_seq_cst);
+            if(!m_writer.load(std::memory_order_seq_cst)) {
+                EnterFirst();
+                return;
+            }
+            slot.readers.fetch_sub(1, std::memory_order_release);
+            // 在写者的互斥量上睡眠等待写完成
+            m_wmutex.Lock();
+            m_wmutex.Unlock();
+        }
+    }
+
+    void WrLock() {
+        m_wmutex.Lock();
+        m_writer.store(true, std::memory_order_seq_cst);
+        for(int i = 0; i < SLOT_COUNT; i++) {
+            for(int n = 0; m_slots[i].readers.load(std::memory_order_acquire) != 0; n++) {
+                if(n < 64)
+                    CpuRelax();
+                else
+                    sched_yield();
+            }
+        }
+        m_owner.store(GetSelf(), std::memory_order_relaxed);
+    }
+
+    bool TryRdLock() {
+        Slot& slot = m_slots[GetSlot()];
+        if(EnterNested()) {
+            slot.readers.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+        slot.readers.fetch_add(1, std::memory_order_seq_cst);
+        if(!m_writer.load(std::memory_order_seq_cst)) {
+            EnterFirst();
+            return true;
+        }
+        slot.readers.fetch_sub(1, std::memory_order_release);
+        return false;
+    }
+
+    /**
+     * @brief 有读者时立即放弃, 不等待读者退出
+     */
+    bool TryWrLock() {
+        if(!m_wmutex.TryLock())
+            return false;
+        m_writer.store(true, std::memory_order_seq_cst);
+        for(int i = 0; i < SLOT_COUNT; i++) {
+            if(m_slots[i].readers.load(std::memory_order_acquire) != 0) {
+                m_writer.store(false, std::memory_order_release);
+                m_wmutex.Unlock();
+                return false;
+            }
+        }
+        m_owner.store(GetSelf(), std::memory_order_relaxed);
+        return true;
+    }
+
+    /**
+     * @brief 读写共用一个解锁接口, 按持有写锁的线程区分
+     */
+    void Unlock() {
+        if(m_owner.load(std::memory_order_relaxed) == GetSelf()) {
+            m_owner.store(nullptr, std::memory_order_relaxed);
+            m_writer.store(false, std::memory_order_release);
+            m_wmutex.Unlock();
+        } else {
+            Leave();
+            m_slots[GetSlot()].readers.fetch_sub(1, std::memory_order_release);
+        }
+    }
+
+private:
+    enum { CACHE_LINE = 64, SLOT_COUNT = 64, MAX_HELD = 8 };
+
+    /**
+     * @brief 线程当前持有读锁的锁和深度, 所有 DistRWMutex 共用
+     */
+    struct HeldLocks {
+        int count = 0;      // 持有读锁的总次数, 为0时不用查表
+        const DistRWMutex* locks[MAX_HELD] = {};
+        int depth[MAX_HELD] = {};
+    };
+
+    static HeldLocks& GetHeld() {
+        static thread_local HeldLocks t_held;
+        return t_held;
+    }
+
+    /**
+     * @brief 本线程已持有读锁时深度加一并返回true
+     */
+    bool EnterNested() {
+        HeldLocks& h = GetHeld();
+        if(!h.count)
+            return false;
+        for(int i = 0; i < MAX_HELD; i++) {
+            if(h.locks[i] == this) {
+                ++h.depth[i];
+                ++h.count;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void EnterFirst() {
+        HeldLocks& h = GetHeld();
+        ++h.count;
+        for(int i = 0; i < MAX_HELD; i++) {
+            if(!h.locks[i]) {
+                h.locks[i] = this;
+                h.depth[i] = 1;
+                return;
+            }
+        }
+    }
+
+    void Leave() {
+        HeldLocks& h = GetHeld();
+        --h.count;
+        for(int i = 0; i < MAX_HELD; i++) {
+            if(h.locks[i] == this) {
+                if(--h.depth[i] == 0)
+                    h.locks[i] = nullptr;
+                return;
+            }
+        }
+    }
+
+    struct Slot {
+        std::atomic<int> readers;
+        char pad[CACHE_LINE - sizeof(std::atomic<int>)];
+        Slot() : readers(0) {}
+    };
+
+    /**
+     * @brief 线程第一次加读锁时轮流分配槽, 之后固定不变, 所有锁共用
+     */
+    static int GetSlot() {
+        static std::atomic<int> s_next(0);
+        static thread_local int t_slot = -1;
+        if(t_slot < 0)
+            t_slot = s_next.fetch_add(1, std::memory_order_relaxed) % SLOT_COUNT;
+        return t_slot;
+    }
+
+    static const void* GetSelf() {
+        static thread_local char t_self;
+        return &t_self;
+    }
+
+private:
+    Slot* m_slots;
+    std::atomic<bool> m_writer;
+    std::atomic<const void*> m_owner;   // 持有写锁的线程
+    FastMutex m_wmutex;                 // 写者互斥, 读者也在上面等待写完成
+};
+
 
 
 }
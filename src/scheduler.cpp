@@ -11,6 +11,7 @@
  */
 #include "scheduler.h"
 #include "log.h"
+#include "epoch.h"
 
 
 namespace dx {
@@ -79,7 +80,7 @@ void Scheduler::Start() {
     m_threads.resize(m_thCnt);
     for(size_t i = 0; i < m_thCnt; i++) {
         m_threads[i].reset(new Thread(std::bind(&Scheduler::Run, this), 
-            m_name + "-" + std::to_string(i)));
+            m_name + "-" + std::to_string(i), m_thOpts));
         m_thIds.push_back(m_threads[i]->GetId());
     }
 
@@ -149,6 +150,8 @@ void Scheduler::Run() {
 
     FiberAndThread ft;
     while(true) {
+        // 每轮调度是一个静止点, 驱动 EBR 回收
+        EpochManager::Quiescent();
         ft.Reset();
         bool tickle_me = false;
         {
@@ -14,7 +14,7 @@ namespace dx {
 class Scheduler {
 public:
     typedef std::shared_ptr<Scheduler> ptr;
-    typedef SMutex MutexType;
+    typedef MCSLock MutexType;
 
     Scheduler(size_t threads = 1, bool use_caller = true, const std::string& name = "");
     virtual ~Scheduler();
@@ -23,6 +23,12 @@ public:
     static Scheduler* GetThis();
     static Fiber* GetMainFiber();
 
+    /**
+     * @brief 工作线程的创建参数, 在 Start 之前设置
+     *  如把处理请求的调度器绑定到独立的CPU, 与后台线程隔离
+     */
+    void SetThreadOptions(const ThreadOptions& opts) { m_thOpts = opts; }
+
     void Start();
     void Stop();
 
@@ -103,6 +109,7 @@ private:
     std::string m_name;
     std::list<FiberAndThread> m_fibers;
     std::vector<Thread::ptr> m_threads;
+    ThreadOptions m_thOpts;
     Fiber::ptr m_rootFiber;
 
 protected:
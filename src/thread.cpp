@@ -12,6 +12,15 @@
 #include "thread.h"
 #include "log.h"
 #include "util.h"
+#include "epoch.h"
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/sysinfo.h>
+#include <time.h>
+#include <errno.h>
+#include <string.h>
+#include <set>
+#include <algorithm>
 
 namespace dx {
 
@@ -19,6 +28,114 @@ static thread_local Thread* t_thread = nullptr;
 static thread_local std::string t_thread_name = "UNKNOW";
 static dx::Logger::ptr g_logger = SERVER_LOG_NAME("system");
 
+namespace {
+
+/**
+ * @brief 所有存活的 Thread 对象; 不析构, 进程退出时其他线程可能仍在注销
+ */
+struct ThreadRegistry {
+    SMutex mutex;
+    std::set<Thread*> threads;
+
+    static ThreadRegistry* Get() {
+        static ThreadRegistry* s_registry = new ThreadRegistry;
+        return s_registry;
+    }
+};
+
+static uint64_t GetClockNs(clockid_t id) {
+    struct timespec ts;
+    if(clock_gettime(id, &ts))
+        return 0;
+    return ts.tv_sec * 1000 * 1000 * 1000ul + ts.tv_nsec;
+}
+
+static const char* PolicyToString(int policy) {
+    switch(policy) {
+#define XX(name) \
+        case name: return #name;
+        XX(SCHED_OTHER);
+        XX(SCHED_BATCH);
+        XX(SCHED_IDLE);
+        XX(SCHED_FIFO);
+        XX(SCHED_RR);
+#undef XX
+        default: return "UNKNOW";
+    }
+}
+
+static bool DoSetAffinity(pthread_t th, const std::vector<int>& cpus, const std::string& name) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if(cpus.empty()) {
+        // 恢复为不限制
+        int n = std::min(get_nprocs_conf(), CPU_SETSIZE);
+        for(int i = 0; i < n; i++) {
+            CPU_SET(i, &set);
+        }
+    }
+    for(int cpu : cpus) {
+        if(cpu < 0 || cpu >= CPU_SETSIZE) {
+            SERVER_LOG_ERROR(g_logger) << "thread name=" << name << " invalid cpu=" << cpu;
+            return false;
+        }
+        CPU_SET(cpu, &set);
+    }
+    int rt = pthread_setaffinity_np(th, sizeof(set), &set);
+    if(rt) {
+        SERVER_LOG_ERROR(g_logger) << "pthread_setaffinity_np fail, rt=" << rt
+            << " (" << strerror(rt) << ") name=" << name;
+        return false;
+    }
+    return true;
+}
+
+static bool DoSetScheduling(pthread_t th, int policy, int priority, const std::string& name) {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+    int rt = pthread_setschedparam(th, policy, &param);
+    if(rt) {
+        SERVER_LOG_ERROR(g_logger) << "pthread_setschedparam fail, rt=" << rt
+            << " (" << strerror(rt) << ") name=" << name
+            << " policy=" << PolicyToString(policy) << " priority=" << priority;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Linux 上 nice 值属于线程, 用线程id设置
+ */
+static bool DoSetNice(pid_t tid, int nice, const std::string& name) {
+    if(setpriority(PRIO_PROCESS, tid, nice)) {
+        SERVER_LOG_ERROR(g_logger) << "setpriority fail, errno=" << errno
+            << " (" << strerror(errno) << ") name=" << name << " nice=" << nice;
+        return false;
+    }
+    return true;
+}
+
+}
+
+std::string ThreadStats::ToString() const {
+    std::stringstream ss;
+    ss << "name=" << name
+       << " id=" << id
+       << " running=" << running
+       << " cpu_ms=" << cpu_ns / 1000000
+       << " wall_ms=" << wall_ns / 1000000
+       << " cpu_pct=" << (wall_ns ? cpu_ns * 100.0 / wall_ns : 0)
+       << " policy=" << PolicyToString(policy)
+       << " priority=" << priority
+       << " nice=" << nice
+       << " cpus=";
+    for(size_t i = 0; i < cpus.size(); i++) {
+        ss << (i ? "," : "") << cpus[i];
+    }
+    return ss.str();
+}
+
 
 Thread* Thread::GetThis() {
     return t_thread;
@@ -37,7 +154,11 @@ void Thread::SetNameS(const std::string& name) {
 
 
 Thread::Thread(std::function<void()> cb, const std::string& name) 
-    :m_cb(cb), m_name(name) {
+    :Thread(cb, name, ThreadOptions()) {
+}
+
+Thread::Thread(std::function<void()> cb, const std::string& name, const ThreadOptions& opts)
+    :m_cb(cb), m_name(name), m_opts(opts), m_state(new State) {
 
     if(name.empty()) {
         m_name = "UNKNOW";
@@ -50,14 +171,148 @@ Thread::Thread(std::function<void()> cb, const std::string& name)
     }
 
     m_sem.Wait();
+
+    ThreadRegistry* reg = ThreadRegistry::Get();
+    SMutex::MutexGuard g(reg->mutex);
+    reg->threads.insert(this);
 }
 
 Thread::~Thread() {
+    {
+        ThreadRegistry* reg = ThreadRegistry::Get();
+        SMutex::MutexGuard g(reg->mutex);
+        reg->threads.erase(this);
+    }
     if(m_thread) {
         pthread_detach(m_thread);
     }
 }
 
+bool Thread::SetAffinity(const std::vector<int>& cpus) {
+    SMutex::MutexGuard g(m_state->mutex);
+    if(!m_state->running)
+        return false;
+    if(!DoSetAffinity(m_thread, cpus, m_name))
+        return false;
+    m_opts.cpus = cpus;
+    return true;
+}
+
+bool Thread::SetScheduling(int policy, int priority) {
+    SMutex::MutexGuard g(m_state->mutex);
+    if(!m_state->running)
+        return false;
+    if(!DoSetScheduling(m_thread, policy, priority, m_name))
+        return false;
+    m_opts.policy = policy;
+    m_opts.priority = priority;
+    return true;
+}
+
+bool Thread::SetNice(int nice) {
+    SMutex::MutexGuard g(m_state->mutex);
+    if(!m_state->running)
+        return false;
+    if(!DoSetNice(m_id, nice, m_name))
+        return false;
+    m_opts.nice = nice;
+    return true;
+}
+
+uint64_t Thread::GetCpuTime() const {
+    SMutex::MutexGuard g(m_state->mutex);
+    return GetCpuTimeNoLock();
+}
+
+/**
+ * @brief 持有 m_state->mutex 调用, 线程退出后返回退出时记录的值
+ */
+uint64_t Thread::GetCpuTimeNoLock() const {
+    if(m_state->running) {
+        clockid_t cid;
+        if(pthread_getcpuclockid(m_thread, &cid) == 0)
+            return GetClockNs(cid);
+    }
+    return m_state->end_cpu_ns;
+}
+
+ThreadStats Thread::GetStats() const {
+    ThreadStats st;
+    st.name = m_name;
+    st.id = m_id;
+
+    SMutex::MutexGuard g(m_state->mutex);
+    st.running = m_state->running;
+    st.cpu_ns = GetCpuTimeNoLock();
+    uint64_t end = st.running ? GetClockNs(CLOCK_MONOTONIC) : m_state->end_ns.load();
+    st.wall_ns = end > m_state->start_ns ? end - m_state->start_ns : 0;
+    st.policy = m_opts.policy;
+    st.priority = m_opts.priority;
+    st.nice = m_opts.nice;
+    st.cpus = m_opts.cpus;
+    if(!st.running)
+        return st;
+
+    // 运行中读取实际值, 可能被其他途径(如 taskset / chrt)修改过
+    int policy = 0;
+    struct sched_param param;
+    if(pthread_getschedparam(m_thread, &policy, &param) == 0) {
+        st.policy = policy;
+        st.priority = param.sched_priority;
+    }
+    errno = 0;
+    int nice = getpriority(PRIO_PROCESS, m_id);
+    if(errno == 0)
+        st.nice = nice;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if(pthread_getaffinity_np(m_thread, sizeof(set), &set) == 0) {
+        st.cpus.clear();
+        for(int i = 0; i < CPU_SETSIZE; i++) {
+            if(CPU_ISSET(i, &set))
+                st.cpus.push_back(i);
+        }
+    }
+    return st;
+}
+
+void Thread::Visit(std::function<void(Thread*)> cb) {
+    ThreadRegistry* reg = ThreadRegistry::Get();
+    SMutex::MutexGuard g(reg->mutex);
+    for(auto i : reg->threads) {
+        cb(i);
+    }
+}
+
+std::vector<ThreadStats> Thread::GetAllStats() {
+    std::vector<ThreadStats> all;
+    Visit([&all](Thread* thr) {
+        all.push_back(thr->GetStats());
+    });
+    std::sort(all.begin(), all.end(), [](const ThreadStats& a, const ThreadStats& b) {
+        return a.id < b.id;
+    });
+    return all;
+}
+
+size_t Thread::GetCount() {
+    ThreadRegistry* reg = ThreadRegistry::Get();
+    SMutex::MutexGuard g(reg->mutex);
+    return reg->threads.size();
+}
+
+/**
+ * @brief 在新线程中执行, 此时 m_thread 可能还没有被 pthread_create 写入
+ */
+void Thread::ApplyOptions() {
+    if(!m_opts.cpus.empty())
+        DoSetAffinity(pthread_self(), m_opts.cpus, m_name);
+    if(m_opts.policy != SCHED_OTHER || m_opts.priority != 0)
+        DoSetScheduling(pthread_self(), m_opts.policy, m_opts.priority, m_name);
+    if(m_opts.nice != 0)
+        DoSetNice(m_id, m_opts.nice, m_name);
+}
+
 void Thread::Join() {
     if(m_thread) {
         int rt = pthread_join(m_thread, nullptr);
@@ -77,12 +332,28 @@ void* Thread::Run(void* arg) {
     thread->m_id = dx::GetThreadId();
     pthread_setname_np(pthread_self(), thread->m_name.substr(0, 15).c_str());
 
+    thread->ApplyOptions();
+
     std::function<void()>  cb;
     cb.swap(thread->m_cb);
+    // Notify 之后 thread 可能被析构, 之后只访问共享的状态
+    std::shared_ptr<State> state = thread->m_state;
+    state->start_ns = GetClockNs(CLOCK_MONOTONIC);
+    state->running = true;
 
     thread->m_sem.Notify();
 
     cb();
+    // 未回收的对象交给其他线程
+    EpochManager::ThreadExit();
+    HazardPointer::ThreadExit();
+
+    // 正在查询或调整本线程的调用返回之前不退出, 之后不再使用线程句柄和线程id
+    uint64_t cpu_ns = GetClockNs(CLOCK_THREAD_CPUTIME_ID);
+    SMutex::MutexGuard g(state->mutex);
+    state->end_cpu_ns = cpu_ns;
+    state->end_ns = GetClockNs(CLOCK_MONOTONIC);
+    state->running = false;
     return 0;
 } 
 
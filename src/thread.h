@@ -21,7 +21,10 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <stdint.h>
+#include <sched.h>
 #include <atomic>
+#include <vector>
+#include <string>
 #include "mutex.h"
 
 namespace dx {
@@ -43,16 +46,58 @@ private:
     sem_t m_sem;
 };
 
+/**
+ * @brief 线程创建参数, 在新线程开始执行回调之前设置
+ *  设置失败(如没有 CAP_SYS_NICE 时使用 SCHED_FIFO)只记录错误日志, 线程照常运行
+ */
+struct ThreadOptions {
+    std::vector<int> cpus;          // 绑定的CPU编号, 空表示不限制
+    int policy = SCHED_OTHER;       // SCHED_OTHER / SCHED_BATCH / SCHED_IDLE / SCHED_FIFO / SCHED_RR
+    int priority = 0;               // 实时策略(FIFO/RR)的优先级 1..99, 其他策略必须为0
+    int nice = 0;                   // 0 表示沿用创建者的nice值
+};
+
+/**
+ * @brief 线程运行统计
+ */
+struct ThreadStats {
+    std::string name;
+    pid_t id = 0;
+    bool running = false;
+    uint64_t cpu_ns = 0;            // 线程消耗的CPU时间
+    uint64_t wall_ns = 0;           // 线程启动到现在(或退出)的时间
+    int policy = SCHED_OTHER;
+    int priority = 0;
+    int nice = 0;
+    std::vector<int> cpus;          // 当前允许运行的CPU
+
+    std::string ToString() const;
+};
+
 class Thread {
 public:
     typedef std::shared_ptr<Thread> ptr;
 
     Thread(std::function<void()> cb, const std::string& name);
+    Thread(std::function<void()> cb, const std::string& name, const ThreadOptions& opts);
     ~Thread();
 
     const std::string& GetName() const { return m_name; }
     pid_t GetId() const { return m_id; }
 
+    /**
+     * @brief 线程运行期间可以从任意线程调整, 失败返回false并记录日志
+     */
+    bool SetAffinity(const std::vector<int>& cpus);
+    bool SetScheduling(int policy, int priority = 0);
+    bool SetNice(int nice);
+
+    /**
+     * @brief 线程消耗的CPU时间(纳秒), 线程退出后返回退出时的值
+     */
+    uint64_t GetCpuTime() const;
+    ThreadStats GetStats() const;
+
     /**
      * @brief 线程中止
      * 
@@ -63,6 +108,14 @@ public:
     static const std::string& GetNameS();
     static void SetNameS(const std::string& name);
 
+    /**
+     * @brief 遍历所有存活(已构造未析构)的 Thread 对象
+     *  回调在注册表锁内执行, 不能在回调中创建或析构 Thread
+     */
+    static void Visit(std::function<void(Thread*)> cb);
+    static std::vector<ThreadStats> GetAllStats();
+    static size_t GetCount();
+
 
 private:
     Thread(const Thread&) = delete;
@@ -76,11 +129,28 @@ private:
      * @return void*
      */
     static void* Run(void *arg);
+
+    void ApplyOptions();
+    uint64_t GetCpuTimeNoLock() const;
+
+    /**
+     * @brief 线程结束时写入, Thread 析构后线程可能仍在运行, 由双方共享
+     *  mutex 内看到 running 为true时线程不会退出, m_thread 和 m_id 仍然有效
+     */
+    struct State {
+        SMutex mutex;
+        std::atomic<bool> running{false};
+        uint64_t start_ns = 0;
+        std::atomic<uint64_t> end_ns{0};
+        std::atomic<uint64_t> end_cpu_ns{0};    // 退出时的CPU时间
+    };
 private:
     pid_t m_id;
     pthread_t m_thread;
     std::function<void()> m_cb;
     std::string m_name;
+    ThreadOptions m_opts;               // 线程启动后由 m_state->mutex 保护
+    std::shared_ptr<State> m_state;
 
     SSemaphore m_sem;
 };
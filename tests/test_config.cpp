@@ -144,6 +144,19 @@ public:
     }
 };
 
+// 可选: 直接从yaml节点构造, 不实现时回退到上面的字符串转换
+template<>
+class YamlCast<Person> {
+public:
+    Person operator() (const YAML::Node& node) {
+        Person p;
+        p.m_name = node["name"].as<std::string>();
+        p.m_age = node["age"].as<int>();
+        p.m_sex = node["sex"].as<bool>();
+        return p;
+    }
+};
+
 template<>
 class LexicalCast<Person, std::string> {
 public:
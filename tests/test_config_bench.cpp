@@ -0,0 +1,163 @@
+#include "src/server.h"
+#include <sys/time.h>
+#include <atomic>
+
+/**
+ * 配置读取扩展性测试: 1..N 个读线程并发读取一个容器类型的配置, 另有一个线程周期性修改
+ *  rwlock_copy  读写锁 + 拷贝(旧的 GetValue 实现, 作为基准)
+ *  get_value    GetValue 从线程局部快照拷贝
+ *  snapshot     GetSnapshot 共享不可变快照
+ *  cached       GetCached 线程局部缓存
+ *  lookup       Config::Lookup<T>(name) 按名字查找(分片读锁, 名字编译期散列)
+ * 用法: test_config_bench [最大线程数] [每个线程读取次数]
+ */
+
+static uint64_t GetCurrentUS() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000 * 1000ul + tv.tv_usec;
+}
+
+typedef std::map<std::string, int> ValueType;
+
+static dx::ConfigVar<ValueType>::ptr g_bench_var =
+    dx::Config::Lookup("bench.map", ValueType(), "config read bench");
+
+static dx::RWMutex s_baseline_mutex;
+static ValueType s_baseline_val;
+
+static int g_count = 1000000;
+static std::atomic<bool> s_stop(false);
+static std::atomic<uint64_t> s_sum(0);
+
+void read_rwlock_copy() {
+    uint64_t sum = 0;
+    for(int i = 0; i < g_count; i++) {
+        ValueType v;
+        {
+            dx::RWMutex::ReadLock lock(s_baseline_mutex);
+            v = s_baseline_val;
+        }
+        sum += v.size();
+    }
+    s_sum += sum;
+}
+
+void read_get_value() {
+    uint64_t sum = 0;
+    for(int i = 0; i < g_count; i++) {
+        sum += g_bench_var->GetValue().size();
+    }
+    s_sum += sum;
+}
+
+void read_snapshot() {
+    uint64_t sum = 0;
+    for(int i = 0; i < g_count; i++) {
+        sum += g_bench_var->GetSnapshot()->size();
+    }
+    s_sum += sum;
+}
+
+void read_cached() {
+    uint64_t sum = 0;
+    for(int i = 0; i < g_count; i++) {
+        sum += g_bench_var->GetCached()->size();
+        asm volatile("" ::: "memory");
+    }
+    s_sum += sum;
+}
+
+static constexpr dx::ConfigKey s_bench_key("bench.map");
+static_assert(s_bench_key.GetHash() == dx::ConfigKey::Hash("bench.map", 9), "ConfigKey must hash at compile time");
+static_assert(s_bench_key.GetLen() == 9, "ConfigKey literal length");
+
+/**
+ * @brief 字符数组按 '\0' 结尾取长度, const char* 变量也能转换成 ConfigKey
+ */
+bool check_keys() {
+    char buf[64] = "bench.map";
+    const char* ptr = "bench.map";
+    dx::ConfigKey from_buf(buf);
+    dx::ConfigKey from_ptr = ptr;
+    bool ok = from_buf.GetLen() == 9 && from_buf.GetHash() == s_bench_key.GetHash()
+                && from_ptr.GetLen() == 9 && from_ptr.GetHash() == s_bench_key.GetHash()
+                && dx::Config::Lookup<ValueType>(buf) && dx::Config::Lookup<ValueType>(ptr);
+    std::cout << "config_key ok=" << ok << std::endl;
+    return ok;
+}
+
+void read_lookup() {
+    uint64_t sum = 0;
+    for(int i = 0; i < g_count; i++) {
+        sum += dx::Config::Lookup<ValueType>(s_bench_key)->GetCached()->size();
+    }
+    s_sum += sum;
+}
+
+/**
+ * @brief 每毫秒修改一次, 让读端的快照和缓存真的会失效
+ */
+void writer() {
+    int n = 0;
+    while(!s_stop) {
+        ValueType v = s_baseline_val;
+        v["k0"] = ++n;
+        g_bench_var->SetValue(v);
+        {
+            dx::RWMutex::WriteLock lock(s_baseline_mutex);
+            s_baseline_val = v;
+        }
+        usleep(1000);
+    }
+}
+
+void run(const std::string& name, void(*cb)(), int thread_cnt) {
+    s_stop = false;
+    dx::Thread::ptr w(new dx::Thread(&writer, "writer"));
+
+    std::vector<dx::Thread::ptr> thrs;
+    uint64_t begin = GetCurrentUS();
+    for(int i = 0; i < thread_cnt; i++) {
+        thrs.push_back(dx::Thread::ptr(new dx::Thread(cb, name + "_" + std::to_string(i))));
+    }
+    for(auto& i : thrs) {
+        i->Join();
+    }
+    uint64_t used = GetCurrentUS() - begin;
+    s_stop = true;
+    w->Join();
+
+    uint64_t total = (uint64_t)thread_cnt * g_count;
+    std::cout << "mode=" << name
+              << " threads=" << thread_cnt
+              << " reads=" << total
+              << " used_us=" << used
+              << " reads_per_sec=" << (used ? total * 1000000 / used : 0)
+              << " ns_per_read=" << (total ? used * 1000.0 * thread_cnt / total : 0)
+              << std::endl;
+}
+
+int main(int argc, char** argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 64;
+    g_count = argc > 2 ? atoi(argv[2]) : 1000000;
+
+    ValueType v;
+    for(int i = 0; i < 16; i++) {
+        v["k" + std::to_string(i)] = i;
+    }
+    g_bench_var->SetValue(v);
+    s_baseline_val = v;
+    if(!check_keys())
+        return 1;
+
+    for(int i = 1; i <= max_threads; i *= 2) {
+        run("rwlock_copy", &read_rwlock_copy, i);
+        run("get_value", &read_get_value, i);
+        run("snapshot", &read_snapshot, i);
+        run("cached", &read_cached, i);
+        run("lookup", &read_lookup, i);
+    }
+    std::cout << "checksum=" << s_sum << std::endl;
+    return 0;
+}
@@ -0,0 +1,120 @@
+#include "src/server.h"
+#include "src/config_cache.h"
+#include <sys/time.h>
+#include <fstream>
+
+/**
+ * 预编译配置缓存测试: 生成大量配置项的yaml, 对比 yaml解析 和 加载镜像 的耗时,
+ * 检查两种方式得到的值一致, 源文件修改或镜像损坏时退回yaml
+ * 用法: test_config_cache [配置项个数]
+ */
+
+static uint64_t GetCurrentUS() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000 * 1000ul + tv.tv_usec;
+}
+
+static const std::string s_file = "/tmp/test_config_cache.yaml";
+static const std::string s_cache = "/tmp/test_config_cache.bin";
+
+static std::vector<dx::ConfigVar<int>::ptr> s_ints;
+static std::vector<dx::ConfigVar<std::string>::ptr> s_strs;
+static std::vector<dx::ConfigVar<std::vector<int> >::ptr> s_vecs;
+static std::vector<dx::ConfigVar<std::map<std::string, int> >::ptr> s_maps;
+
+/**
+ * @brief 每组4个配置: 整数/字符串/数组/map, 值由 base 决定
+ */
+void write_config(int groups, int base) {
+    std::ofstream ofs(s_file);
+    ofs << "cache:\n";
+    for(int i = 0; i < groups; i++) {
+        ofs << "  g" << i << ":\n"
+            << "    num: " << base + i << "\n"
+            << "    str: \"s" << base + i << " x\"\n"
+            << "    vec: [" << base << ", " << i << ", " << base + i << "]\n"
+            << "    map:\n"
+            << "      a: " << base << "\n"
+            << "      b: " << i << "\n";
+    }
+    // 未注册的配置项和非法名字, 与 LoarFromYaml 一样忽略
+    ofs << "unknown:\n  key: 1\nBad.Name: 2\n";
+}
+
+bool check(int groups, int base) {
+    for(int i = 0; i < groups; i++) {
+        std::map<std::string, int> m;
+        m["a"] = base;
+        m["b"] = i;
+        if(s_ints[i]->GetValue() != base + i
+                || s_strs[i]->GetValue() != "s" + std::to_string(base + i) + " x"
+                || s_vecs[i]->GetValue() != std::vector<int>{base, i, base + i}
+                || s_maps[i]->GetValue() != m) {
+            std::cout << "check group=" << i << " base=" << base << " failed" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    int keys = argc > 1 ? atoi(argv[1]) : 20000;
+    int groups = keys / 4;
+
+    dx::LoggerMgr::GetInstance()->GetLogger("system")->SetLevel(dx::LogLevel::WARN);
+    SERVER_LOG_ROOT()->SetLevel(dx::LogLevel::WARN);
+
+    for(int i = 0; i < groups; i++) {
+        std::string prefix = "cache.g" + std::to_string(i);
+        s_ints.push_back(dx::Config::Lookup(prefix + ".num", 0, "int"));
+        s_strs.push_back(dx::Config::Lookup(prefix + ".str", std::string(), "string"));
+        s_vecs.push_back(dx::Config::Lookup(prefix + ".vec", std::vector<int>(), "vector"));
+        s_maps.push_back(dx::Config::Lookup(prefix + ".map", std::map<std::string, int>(), "map"));
+    }
+    std::vector<std::string> files{s_file};
+
+    write_config(groups, 1000);
+    uint64_t begin = GetCurrentUS();
+    if(!dx::ConfigCache::Compile(files, s_cache))
+        return 1;
+    std::cout << "compile keys=" << groups * 4 << " used_us=" << GetCurrentUS() - begin << std::endl;
+
+    begin = GetCurrentUS();
+    int rt = dx::ConfigCache::Load(files, s_cache);
+    std::cout << "load_from_cache rt=" << rt << " used_us=" << GetCurrentUS() - begin << std::endl;
+    if(rt != dx::ConfigCache::FROM_CACHE || !check(groups, 1000))
+        return 1;
+
+    // 对比: yaml解析 + LoarFromYaml, 同样的配置个数发生变化
+    write_config(groups, 2000);
+    begin = GetCurrentUS();
+    dx::Config::LoarFromYaml(YAML::LoadFile(s_file));
+    std::cout << "load_from_yaml used_us=" << GetCurrentUS() - begin << std::endl;
+    if(!check(groups, 2000))
+        return 1;
+
+    // 源文件已经变化, 镜像过期
+    write_config(groups, 3000);
+    begin = GetCurrentUS();
+    rt = dx::ConfigCache::Load(files, s_cache);
+    std::cout << "stale_cache rt=" << rt << " used_us=" << GetCurrentUS() - begin << std::endl;
+    if(rt != dx::ConfigCache::FROM_YAML || !check(groups, 3000))
+        return 1;
+
+    // 上一次退回yaml时已经重新生成镜像
+    rt = dx::ConfigCache::Load(files, s_cache);
+    if(rt != dx::ConfigCache::FROM_CACHE || !check(groups, 3000))
+        return 1;
+
+    // 截断的镜像
+    if(truncate(s_cache.c_str(), 100) != 0)
+        return 1;
+    write_config(groups, 4000);
+    rt = dx::ConfigCache::Load(files, s_cache, false);
+    std::cout << "truncated_cache rt=" << rt << std::endl;
+    if(rt != dx::ConfigCache::FROM_YAML || !check(groups, 4000))
+        return 1;
+    std::cout << "ok" << std::endl;
+    return 0;
+}
@@ -0,0 +1,222 @@
+#include "src/server.h"
+#include <atomic>
+#include <sys/time.h>
+#include <unistd.h>
+
+/**
+ * 配置事务与快照一致性测试
+ * 写线程每次在一个事务里同时修改 pool.size 和 pool.timeout(timeout == size * 10),
+ * 读线程分别用 两次GetValue 和 Pin快照 读取, 统计看到不一致状态的次数, 快照方式必须为0
+ * 异步监听: 慢监听者不阻塞修改配置的线程, 连续的变化被合并, 同一配置的回调保持顺序
+ * GetCached: 返回的快照在值被修改, 线程缓存被替换之后仍然有效
+ * 快照共享: 多个配置逐个修改, 每个旧快照仍然只看到它之前提交的值
+ * 同步通知顺序: 多个线程并发提交, 同步监听收到的旧值总是上一次通知的新值;
+ *  监听回调里再次提交不会死锁
+ * 用法: test_config_snapshot [读线程数] [提交次数]
+ */
+
+static dx::ConfigVar<int>::ptr g_pool_size =
+    dx::Config::Lookup("pool.size", 1, "pool size");
+static dx::ConfigVar<int>::ptr g_pool_timeout =
+    dx::Config::Lookup("pool.timeout", 10, "pool timeout");
+
+static std::atomic<bool> s_stop(false);
+static std::atomic<uint64_t> s_torn_get(0);
+static std::atomic<uint64_t> s_torn_pin(0);
+static std::atomic<uint64_t> s_reads(0);
+
+void reader() {
+    uint64_t reads = 0;
+    while(!s_stop) {
+        int size = g_pool_size->GetValue();
+        int timeout = g_pool_timeout->GetValue();
+        if(timeout != size * 10)
+            ++s_torn_get;
+
+        dx::ConfigSnapshot::ptr snap = dx::Config::Pin();
+        int snap_size = *snap->Get(g_pool_size);
+        int snap_timeout = *snap->Get(g_pool_timeout);
+        if(snap_timeout != snap_size * 10)
+            ++s_torn_pin;
+        ++reads;
+    }
+    s_reads += reads;
+}
+
+static uint64_t GetCurrentUS() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000 * 1000ul + tv.tv_usec;
+}
+
+static dx::ConfigVar<int>::ptr g_slow =
+    dx::Config::Lookup("async.slow", 0, "value with slow listener");
+
+bool test_async(int changes) {
+    std::vector<int> seen;      // 只在派发线程上写
+    bool ordered = true;
+    uint64_t key = g_slow->AddListener([&seen, &ordered](const int& old_val, const int& new_val) {
+        if(!seen.empty() && (old_val != seen.back() || new_val <= old_val))
+            ordered = false;
+        seen.push_back(new_val);
+        usleep(10 * 1000);      // 模拟重建appender之类的慢操作
+    }, true);
+
+    std::vector<uint64_t> batch_versions;
+    uint64_t batch_key = dx::Config::AddBatchListener([&batch_versions](const dx::ConfigChangeSet& cs) {
+        batch_versions.push_back(cs.version);
+    }, true);
+
+    uint64_t begin = GetCurrentUS();
+    for(int i = 1; i <= changes; i++) {
+        g_slow->SetValue(i);
+    }
+    uint64_t used = GetCurrentUS() - begin;
+
+    dx::Config::FlushListeners();
+    uint64_t flushed = GetCurrentUS() - begin;
+    g_slow->DelListener(key);
+    dx::Config::DelBatchListener(batch_key);
+
+    std::cout << "async changes=" << changes
+              << " set_used_us=" << used
+              << " set_us_per_change=" << (changes ? (double)used / changes : 0)
+              << " flush_used_us=" << flushed
+              << " listener_calls=" << seen.size()
+              << " batch_calls=" << batch_versions.size()
+              << " last_seen=" << (seen.empty() ? -1 : seen.back())
+              << " ordered=" << ordered
+              << std::endl;
+    return ordered && !seen.empty() && seen.back() == changes 
+        && !batch_versions.empty() && batch_versions.back() == dx::Config::Pin()->GetVersion();
+}
+
+/**
+ * @brief GetCached 返回的快照在值被修改, 缓存槽被其他配置替换之后仍然有效
+ */
+bool test_cached_pin() {
+    std::vector<dx::ConfigVar<std::string>::ptr> vars;
+    for(int i = 0; i < 64; i++) {
+        vars.push_back(dx::Config::Lookup("cached.v" + std::to_string(i), std::string(100, 'a' + i % 26), "cached pin"));
+    }
+    dx::ConfigVar<std::string>::ValuePtr pinned = vars[0]->GetCached();
+    std::string expect = *pinned;
+    vars[0]->SetValue(std::string(200, 'z'));
+    // 配置数多于缓存槽, 一定有槽被替换
+    for(auto& i : vars) {
+        i->GetCached();
+    }
+    bool ok = *pinned == expect && *vars[0]->GetCached() == std::string(200, 'z');
+    std::cout << "cached_pin ok=" << ok << std::endl;
+    return ok;
+}
+
+/**
+ * @brief 快照之间共享未修改的部分, 旧快照不受之后提交的影响
+ */
+bool test_snapshot_share() {
+    std::vector<dx::ConfigVar<int>::ptr> vars;
+    for(int i = 0; i < 500; i++) {
+        vars.push_back(dx::Config::Lookup("share.v" + std::to_string(i), -1, "snapshot share"));
+    }
+    std::vector<dx::ConfigSnapshot::ptr> snaps;
+    for(size_t i = 0; i < vars.size(); i++) {
+        snaps.push_back(dx::Config::Pin());
+        vars[i]->SetValue(i);
+    }
+    snaps.push_back(dx::Config::Pin());
+    uint64_t bad = 0;
+    for(size_t s = 0; s < snaps.size(); s++) {
+        for(size_t i = 0; i < vars.size(); i++) {
+            int expect = i < s ? (int)i : -1;
+            if(*snaps[s]->Get(vars[i]) != expect)
+                ++bad;
+        }
+    }
+    std::cout << "snapshot_share bad=" << bad << std::endl;
+    return bad == 0;
+}
+
+static dx::ConfigVar<int>::ptr g_order =
+    dx::Config::Lookup("order.value", 0, "sync notify order");
+static dx::ConfigVar<int>::ptr g_order_nested =
+    dx::Config::Lookup("order.nested", 0, "sync notify nested");
+
+bool test_sync_order(int thread_cnt, int commits) {
+    int last = g_order->GetValue();
+    uint64_t broken = 0;
+    uint64_t notified = 0;
+    uint64_t key = g_order->AddListener([&last, &broken, &notified](const int& old_val, const int& new_val) {
+        if(old_val != last)
+            ++broken;
+        last = new_val;
+        ++notified;
+        // 回调里再次提交
+        if(new_val % 100 == 0)
+            g_order_nested->SetValue(new_val);
+    });
+    std::atomic<int> next(1);
+    std::vector<dx::Thread::ptr> thrs;
+    for(int i = 0; i < thread_cnt; i++) {
+        thrs.push_back(dx::Thread::ptr(new dx::Thread([&next, commits]() {
+            for(int n = 0; n < commits; n++) {
+                g_order->SetValue(next++);
+            }
+        }, "order_" + std::to_string(i))));
+    }
+    for(auto& i : thrs) {
+        i->Join();
+    }
+    g_order->DelListener(key);
+    bool ok = !broken && notified == (uint64_t)thread_cnt * commits
+                && g_order_nested->GetValue() != 0;
+    std::cout << "sync_order notified=" << notified << " broken=" << broken << " ok=" << ok << std::endl;
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    int thread_cnt = argc > 1 ? atoi(argv[1]) : 4;
+    int commits = argc > 2 ? atoi(argv[2]) : 100000;
+
+    std::atomic<uint64_t> batches(0);
+    std::atomic<uint64_t> partial(0);
+    dx::Config::AddBatchListener([&batches, &partial](const dx::ConfigChangeSet& cs) {
+        ++batches;
+        // 两个配置总是在同一个事务里修改
+        if(!cs.Contains(g_pool_size.get()) || !cs.Contains(g_pool_timeout.get()))
+            ++partial;
+    });
+
+    std::vector<dx::Thread::ptr> thrs;
+    for(int i = 0; i < thread_cnt; i++) {
+        thrs.push_back(dx::Thread::ptr(new dx::Thread(&reader, "reader_" + std::to_string(i))));
+    }
+
+    uint64_t version = dx::Config::Pin()->GetVersion();
+    for(int i = 2; i < commits + 2; i++) {
+        dx::ConfigTransaction trans;
+        trans.Set(g_pool_size, i);
+        trans.Set(g_pool_timeout, i * 10);
+        trans.Commit();
+    }
+    s_stop = true;
+    for(auto& i : thrs) {
+        i->Join();
+    }
+
+    std::cout << "commits=" << commits
+              << " versions=" << dx::Config::Pin()->GetVersion() - version
+              << " batches=" << batches
+              << " partial_batches=" << partial
+              << " reads=" << s_reads
+              << " torn_get_value=" << s_torn_get
+              << " torn_pinned=" << s_torn_pin
+              << std::endl;
+    if(s_torn_pin || partial || batches != (uint64_t)commits)
+        return 1;
+    bool ok = test_async(1000);
+    ok = test_cached_pin() && ok;
+    ok = test_snapshot_share() && ok;
+    ok = test_sync_order(thread_cnt, 2000) && ok;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,127 @@
+#include "src/server.h"
+#include "src/config_watcher.h"
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <atomic>
+
+/**
+ * 配置热加载延迟测试: 注册大量配置项, 每轮只修改一个, 测量从文件rename到监听回调触发的时间
+ * 之后检查解析失败和非法的键不会被当作已应用
+ * 用法: test_config_watcher [配置项个数] [轮数] [防抖ms]
+ */
+
+static uint64_t GetCurrentUS() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000 * 1000ul + tv.tv_usec;
+}
+
+static std::vector<dx::ConfigVar<int>::ptr> s_vars;
+static std::atomic<uint64_t> s_cb_time(0);
+static std::atomic<int> s_cb_cnt(0);
+
+static const std::string s_dir = "/tmp/test_config_watcher";
+static const std::string s_file = s_dir + "/app.yaml";
+
+static std::vector<int> s_values;
+
+void write_config() {
+    std::string tmp = s_dir + "/.app.yaml.tmp";
+    {
+        std::ofstream ofs(tmp);
+        ofs << "watch:\n";
+        for(size_t i = 0; i < s_values.size(); i++) {
+            ofs << "  k" << i << ": " << s_values[i] << "\n";
+        }
+    }
+    // 与编辑器一样, 写临时文件再rename
+    rename(tmp.c_str(), s_file.c_str());
+}
+
+/**
+ * @brief 解析失败的配置项不算作已应用; 含大写字母的键与 LoarFromYaml 一样被拒绝
+ */
+bool test_failed_keys(dx::ConfigWatcher::ptr watcher) {
+    // 不是yaml扩展名, 不会被目录监视加载
+    std::string path = s_dir + "/retry.txt";
+    auto write = [&path](const std::string& text) {
+        std::ofstream ofs(path);
+        ofs << text;
+    };
+    int k0 = s_vars[0]->GetValue();
+    int k1 = s_vars[1]->GetValue();
+
+    write("watch:\n  k0: abc\n  K1: 7\n");
+    int bad = watcher->ReloadFile(path);
+    bool ok = bad == 0 && s_vars[0]->GetValue() == k0 && s_vars[1]->GetValue() == k1;
+
+    write("watch:\n  k0: 42\n  K1: 7\n");
+    int good = watcher->ReloadFile(path);
+    ok = ok && good == 1 && s_vars[0]->GetValue() == 42 && s_vars[1]->GetValue() == k1;
+    unlink(path.c_str());
+    std::cout << "failed_keys bad=" << bad << " good=" << good << " ok=" << ok << std::endl;
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    int keys = argc > 1 ? atoi(argv[1]) : 10000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 10;
+    int debounce = argc > 3 ? atoi(argv[3]) : 50;
+
+    // 热加载日志太多, 只看结果
+    dx::LoggerMgr::GetInstance()->GetLogger("system")->SetLevel(dx::LogLevel::WARN);
+    SERVER_LOG_ROOT()->SetLevel(dx::LogLevel::WARN);
+
+    for(int i = 0; i < keys; i++) {
+        auto var = dx::Config::Lookup("watch.k" + std::to_string(i), -1, "watch bench");
+        var->AddListener([](const int& old_val, const int& new_val) {
+            s_cb_time = GetCurrentUS();
+            ++s_cb_cnt;
+        });
+        s_vars.push_back(var);
+    }
+
+    mkdir(s_dir.c_str(), 0755);
+    for(int i = 0; i < keys; i++) {
+        s_values.push_back(i);
+    }
+    write_config();
+
+    dx::ConfigWatcher::ptr watcher(new dx::ConfigWatcher(debounce));
+    uint64_t begin = GetCurrentUS();
+    watcher->AddDir(s_dir);
+    std::cout << "initial_load keys=" << keys << " used_us=" << GetCurrentUS() - begin
+              << " listeners=" << s_cb_cnt << std::endl;
+
+    // 对比: 全量 LoarFromYaml (值都没变, 不触发回调, 只有解析和比较的开销)
+    begin = GetCurrentUS();
+    dx::Config::LoarFromYaml(YAML::LoadFile(s_file));
+    std::cout << "full_load_from_yaml used_us=" << GetCurrentUS() - begin << std::endl;
+
+    watcher->Start();
+    uint64_t total = 0;
+    for(int r = 0; r < rounds; r++) {
+        int key = r % keys;
+        int cnt = s_cb_cnt;
+        uint64_t t0 = GetCurrentUS();
+        s_values[key] = 100000 + r;
+        write_config();
+        while(s_cb_cnt == cnt && GetCurrentUS() - t0 < 5 * 1000 * 1000) {
+            usleep(100);
+        }
+        if(s_cb_cnt != cnt + 1 || s_vars[key]->GetValue() != 100000 + r) {
+            std::cout << "round=" << r << " failed listeners=" << s_cb_cnt - cnt
+                      << " value=" << s_vars[key]->GetValue() << std::endl;
+            return 1;
+        }
+        uint64_t latency = s_cb_time - t0;
+        total += latency;
+        std::cout << "round=" << r << " key=watch.k" << key
+                  << " reload_latency_us=" << latency
+                  << " without_debounce_us=" << (int64_t)latency - debounce * 1000 << std::endl;
+    }
+    std::cout << "avg_reload_latency_us=" << (rounds ? total / rounds : 0) << std::endl;
+    watcher->Stop();
+    return test_failed_keys(watcher) ? 0 : 1;
+}
@@ -0,0 +1,187 @@
+#include "src/server.h"
+#include "src/epoch.h"
+#include <sys/time.h>
+#include <atomic>
+
+/**
+ * 内存回收测试
+ * 压力测试: 写线程不停替换共享指针并退休旧节点, 读线程在 EpochGuard / HazardPointer 保护下读取节点,
+ *  节点释放时会被写上毒值, 读到毒值说明被提前释放; 结束后所有节点都应当被回收
+ * 性能测试: 每次 退休+回收 的耗时, 进入/离开临界区 和 Protect 的耗时
+ * 用法: test_epoch [读线程数] [每个写线程替换次数]
+ */
+
+static uint64_t GetCurrentNS() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 * 1000 * 1000ul + ts.tv_nsec;
+}
+
+static const uint64_t MAGIC = 0x5AFE5AFE5AFE5AFEull;
+static const uint64_t POISON = 0xDEADDEADDEADDEADull;
+
+static std::atomic<uint64_t> s_created(0);
+static std::atomic<uint64_t> s_destroyed(0);
+
+struct Node {
+    uint64_t magic = MAGIC;
+    uint64_t value;
+
+    Node(uint64_t v) : value(v) { ++s_created; }
+    ~Node() {
+        magic = POISON;
+        ++s_destroyed;
+    }
+};
+
+static std::atomic<Node*> s_head(nullptr);
+static std::atomic<bool> s_stop(false);
+static std::atomic<uint64_t> s_bad(0);
+static volatile uint64_t s_sink = 0;
+
+struct EpochPolicy {
+    static const char* Name() { return "epoch"; }
+
+    static bool Read() {
+        dx::EpochGuard g;
+        Node* n = s_head.load(std::memory_order_acquire);
+        return n->magic == MAGIC;
+    }
+    static void Retire(Node* n) { dx::EpochManager::Retire(n); }
+    static void Drain() { dx::EpochManager::Synchronize(); }
+    static uint64_t Retired() { return dx::EpochManager::GetRetiredCount(); }
+    static uint64_t Reclaimed() { return dx::EpochManager::GetReclaimedCount(); }
+};
+
+struct HazardPolicy {
+    static const char* Name() { return "hazard"; }
+
+    static bool Read() {
+        dx::HazardPointer hp;
+        Node* n = hp.Protect(s_head);
+        return n->magic == MAGIC;
+    }
+    static void Retire(Node* n) { dx::HazardPointer::Retire(n); }
+    static void Drain() { dx::HazardPointer::Scan(); }
+    static uint64_t Retired() { return dx::HazardPointer::GetRetiredCount(); }
+    static uint64_t Reclaimed() { return dx::HazardPointer::GetReclaimedCount(); }
+};
+
+template<class Policy>
+bool stress(int readers, int count) {
+    uint64_t created = s_created;
+    uint64_t destroyed = s_destroyed;
+    s_head = new Node(0);
+    s_stop = false;
+    s_bad = 0;
+
+    std::vector<dx::Thread::ptr> thrs;
+    std::atomic<uint64_t> reads(0);
+    for(int i = 0; i < readers; i++) {
+        thrs.push_back(dx::Thread::ptr(new dx::Thread([&reads]() {
+            uint64_t n = 0;
+            uint64_t bad = 0;
+            while(!s_stop) {
+                if(!Policy::Read())
+                    ++bad;
+                ++n;
+            }
+            reads += n;
+            s_bad += bad;
+        }, std::string(Policy::Name()) + "_r" + std::to_string(i))));
+    }
+
+    // 两个写线程, 一个先退出, 留下的对象由其他线程回收
+    std::vector<dx::Thread::ptr> writers;
+    for(int i = 0; i < 2; i++) {
+        int cnt = i == 0 ? count / 4 : count;
+        writers.push_back(dx::Thread::ptr(new dx::Thread([cnt]() {
+            for(int k = 0; k < cnt; k++) {
+                Node* old = s_head.exchange(new Node(k), std::memory_order_acq_rel);
+                Policy::Retire(old);
+                if(k % 256 == 0)
+                    sched_yield();
+            }
+        }, std::string(Policy::Name()) + "_w" + std::to_string(i))));
+    }
+    for(auto& i : writers) {
+        i->Join();
+    }
+    s_stop = true;
+    for(auto& i : thrs) {
+        i->Join();
+    }
+
+    Policy::Retire(s_head.exchange(nullptr));
+    Policy::Drain();
+    uint64_t c = s_created - created;
+    uint64_t d = s_destroyed - destroyed;
+    bool ok = s_bad == 0 && c == d;
+    std::cout << "stress=" << Policy::Name()
+              << " readers=" << readers
+              << " reads=" << reads
+              << " created=" << c
+              << " reclaimed=" << d
+              << " retired_total=" << Policy::Retired()
+              << " reclaimed_total=" << Policy::Reclaimed()
+              << " bad=" << s_bad
+              << " ok=" << ok
+              << std::endl;
+    return ok;
+}
+
+template<class Policy>
+void bench_retire(int count) {
+    uint64_t begin = GetCurrentNS();
+    for(int i = 0; i < count; i++) {
+        Policy::Retire(new Node(i));
+    }
+    Policy::Drain();
+    uint64_t used = GetCurrentNS() - begin;
+
+    // 只分配和释放, 扣除后得到回收机制本身的开销
+    begin = GetCurrentNS();
+    for(int i = 0; i < count; i++) {
+        delete new Node(i);
+    }
+    uint64_t base = GetCurrentNS() - begin;
+    std::cout << "bench=retire_reclaim policy=" << Policy::Name()
+              << " count=" << count
+              << " ns_per_op=" << used * 1.0 / count
+              << " ns_new_delete=" << base * 1.0 / count
+              << std::endl;
+}
+
+template<class Policy>
+void bench_read(int count) {
+    s_head = new Node(1);
+    uint64_t begin = GetCurrentNS();
+    uint64_t ok = 0;
+    for(int i = 0; i < count; i++) {
+        ok += Policy::Read();
+    }
+    uint64_t used = GetCurrentNS() - begin;
+    s_sink = ok;
+    Policy::Retire(s_head.exchange(nullptr));
+    Policy::Drain();
+    std::cout << "bench=read policy=" << Policy::Name()
+              << " count=" << count
+              << " ns_per_read=" << used * 1.0 / count
+              << std::endl;
+}
+
+int main(int argc, char** argv) {
+    int readers = argc > 1 ? atoi(argv[1]) : 4;
+    int count = argc > 2 ? atoi(argv[2]) : 200000;
+
+    bool ok = stress<EpochPolicy>(readers, count);
+    ok = stress<HazardPolicy>(readers, count) && ok;
+
+    bench_retire<EpochPolicy>(count * 5);
+    bench_retire<HazardPolicy>(count * 5);
+    bench_read<EpochPolicy>(count * 5);
+    bench_read<HazardPolicy>(count * 5);
+
+    std::cout << "epoch=" << dx::EpochManager::GetEpoch() << " ok=" << ok << std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,201 @@
+#include "src/server.h"
+#include "src/concurrent_hash_map.h"
+#include <sys/time.h>
+#include <atomic>
+#include <unordered_map>
+
+/**
+ * 并发散列表对比测试: std::map + RWMutex / std::unordered_map + RWMutex / ConcurrentHashMap
+ * 只读: 多线程按名字查找, 与日志器/配置的注册表用法相同
+ * 读多写少: 每个线程 1/10 的操作是替换或删除再插入
+ * 正确性: 多线程并发插入/删除不相交的键, 结束后检查每个键的状态和个数
+ * 用法: test_hashmap_bench [最大线程数] [每个线程操作次数] [键个数]
+ */
+
+static uint64_t GetCurrentUS() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000 * 1000ul + tv.tv_usec;
+}
+
+static int g_count = 1000000;
+static int g_keys = 1000;
+static std::vector<std::string> s_names;
+static volatile uint64_t s_sink = 0;
+
+template<class Map>
+class LockedMap {
+public:
+    bool Find(const std::string& key, uint64_t& v) {
+        dx::RWMutex::ReadLock g(m_mutex);
+        auto it = m_map.find(key);
+        if(it == m_map.end())
+            return false;
+        v = it->second;
+        return true;
+    }
+    void Set(const std::string& key, uint64_t v) {
+        dx::RWMutex::WriteLock g(m_mutex);
+        m_map[key] = v;
+    }
+    bool Erase(const std::string& key) {
+        dx::RWMutex::WriteLock g(m_mutex);
+        return m_map.erase(key) > 0;
+    }
+    size_t Size() {
+        dx::RWMutex::ReadLock g(m_mutex);
+        return m_map.size();
+    }
+private:
+    dx::RWMutex m_mutex;
+    Map m_map;
+};
+
+typedef LockedMap<std::map<std::string, uint64_t> > LockedStdMap;
+typedef LockedMap<std::unordered_map<std::string, uint64_t> > LockedUnorderedMap;
+typedef dx::ConcurrentHashMap<std::string, uint64_t> ConcurrentMap;
+
+/**
+ * @brief 伪随机选键, 避免所有线程按同样顺序访问
+ */
+static uint32_t NextRand(uint32_t& s) {
+    s ^= s << 13;
+    s ^= s >> 17;
+    s ^= s << 5;
+    return s;
+}
+
+template<class Map>
+void run(const std::string& name, int thread_cnt, int write_pct) {
+    Map map;
+    for(int i = 0; i < g_keys; i++) {
+        map.Set(s_names[i], i);
+    }
+    std::atomic<uint64_t> hits(0);
+    std::vector<dx::Thread::ptr> thrs;
+    uint64_t begin = GetCurrentUS();
+    for(int i = 0; i < thread_cnt; i++) {
+        thrs.push_back(dx::Thread::ptr(new dx::Thread([&map, &hits, write_pct, i]() {
+            uint32_t seed = 2463534242u + i * 7919;
+            uint64_t local = 0;
+            for(int n = 0; n < g_count; n++) {
+                uint32_t r = NextRand(seed);
+                const std::string& key = s_names[r % g_keys];
+                if(write_pct && (r >> 16) % 100 < (uint32_t)write_pct) {
+                    if(r & 0x8000) {
+                        map.Set(key, n);
+                    } else {
+                        map.Erase(key);
+                        map.Set(key, n);
+                    }
+                    continue;
+                }
+                uint64_t v = 0;
+                if(map.Find(key, v))
+                    ++local;
+            }
+            hits += local;
+        }, name + "_" + std::to_string(i))));
+    }
+    for(auto& i : thrs) {
+        i->Join();
+    }
+    uint64_t used = GetCurrentUS() - begin;
+    s_sink = hits;
+
+    uint64_t total = (uint64_t)thread_cnt * g_count;
+    std::cout << "map=" << name
+              << " workload=" << (write_pct ? "read_mostly" : "read_only")
+              << " threads=" << thread_cnt
+              << " keys=" << g_keys
+              << " ops=" << total
+              << " used_us=" << used
+              << " ops_per_sec=" << (used ? total * 1000000 / used : 0)
+              << " ns_per_op=" << (total ? used * 1000.0 * thread_cnt / total : 0)
+              << std::endl;
+}
+
+/**
+ * @brief 每个线程负责 i % thread_cnt 的键, 反复插入/替换/删除, 最后偶数轮留下的键应当存在
+ */
+bool check(int thread_cnt) {
+    ConcurrentMap map;
+    int keys = g_keys * 8;
+    std::vector<std::string> names;
+    for(int i = 0; i < keys; i++) {
+        names.push_back("check.key" + std::to_string(i));
+    }
+    std::vector<dx::Thread::ptr> thrs;
+    std::atomic<uint64_t> bad(0);
+    for(int t = 0; t < thread_cnt; t++) {
+        thrs.push_back(dx::Thread::ptr(new dx::Thread([&map, &names, &bad, keys, thread_cnt, t]() {
+            uint64_t b = 0;
+            for(int round = 0; round < 4; round++) {
+                for(int i = t; i < keys; i += thread_cnt) {
+                    if(round % 2 == 0) {
+                        // 第一轮 和 上一轮删除过的键 插入成功, 其余已经存在
+                        bool expect = round == 0 || i % 3 == 0;
+                        if(map.Insert(names[i], i) != expect)
+                            ++b;
+                        map.Set(names[i], i * 2);
+                    } else if(i % 3 == 0) {
+                        if(!map.Erase(names[i]))
+                            ++b;
+                    }
+                }
+                // 其他线程的键同时在变化, 只检查自己的
+                for(int i = t; i < keys; i += thread_cnt) {
+                    uint64_t v = 0;
+                    bool found = map.Find(names[i], v);
+                    bool expect = round % 2 == 0 || i % 3 != 0;
+                    if(found != expect || (found && v != (uint64_t)i * 2))
+                        ++b;
+                }
+            }
+            bad += b;
+        }, "check_" + std::to_string(t))));
+    }
+    for(auto& i : thrs) {
+        i->Join();
+    }
+    size_t visited = 0;
+    map.Visit([&visited](const std::string&, uint64_t) {
+        ++visited;
+    });
+    // 最后一轮删除了 i % 3 == 0 的键
+    size_t expect = keys - (keys + 2) / 3;
+    bool ok = bad == 0 && map.Size() == expect && visited == expect;
+    std::cout << "check threads=" << thread_cnt
+              << " keys=" << keys
+              << " size=" << map.Size()
+              << " visited=" << visited
+              << " bad=" << bad
+              << " ok=" << ok
+              << std::endl;
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+    g_count = argc > 2 ? atoi(argv[2]) : 1000000;
+    g_keys = argc > 3 ? atoi(argv[3]) : 1000;
+    for(int i = 0; i < g_keys; i++) {
+        s_names.push_back("system.module" + std::to_string(i % 37) + ".key" + std::to_string(i));
+    }
+
+    bool ok = true;
+    for(int i = 1; i <= max_threads; i *= 2) {
+        ok = check(i) && ok;
+    }
+    int write_pcts[] = {0, 10};
+    for(int pct : write_pcts) {
+        for(int i = 1; i <= max_threads; i *= 2) {
+            run<LockedStdMap>("map_rwmutex", i, pct);
+            run<LockedUnorderedMap>("umap_rwmutex", i, pct);
+            run<ConcurrentMap>("concurrent", i, pct);
+        }
+    }
+    dx::EpochManager::Synchronize();
+    std::cout << "sink=" << s_sink << " ok=" << ok << std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,94 @@
+#include "src/server.h"
+#include <atomic>
+
+/**
+ * 锁竞争分析测试: 一把热点锁(多线程反复加锁, 临界区较长) 和 一把冷锁,
+ * 报告中热点锁和它的加锁位置应当排在最前面
+ * 临时锁: 反复创建, 加锁, 销毁, 按实例统计的锁个数不增加, 加锁次数仍计入加锁位置
+ * 需要 cmake -DSERVER_LOCK_PROFILE=ON 编译, 否则只输出空报告
+ * 用法: test_lock_profile [线程数] [每个线程加锁次数]
+ */
+
+static dx::FastMutex s_hot;
+static dx::SMutex s_cold;
+static dx::RWMutex s_rw;
+static volatile uint64_t s_sink = 0;
+
+void worker(int count) {
+    for(int i = 0; i < count; i++) {
+        {
+            dx::FastMutex::MutexGuard g(s_hot);
+            uint64_t v = s_sink;
+            for(int k = 0; k < 200; k++) {
+                v = v * 6364136223846793005ull + 1;
+            }
+            s_sink = v;
+        }
+        if(i % 100 == 0) {
+            dx::SMutex::MutexGuard g(s_cold);
+            ++s_sink;
+        }
+        dx::RWMutex::ReadLock g(s_rw);
+        ++s_sink;
+    }
+}
+
+/**
+ * @brief 报告第一行里的数值, 如 locks=
+ */
+static uint64_t ReportValue(const std::string& report, const std::string& name) {
+    size_t pos = report.find(" " + name + "=");
+    if(pos == std::string::npos)
+        return 0;
+    return strtoull(report.c_str() + pos + name.size() + 2, nullptr, 10);
+}
+
+bool test_temp_locks() {
+    std::string before = dx::LockProfiler::Report(0);
+    for(int i = 0; i < 1000; i++) {
+        dx::SMutex* m = new dx::SMutex;
+        {
+            dx::SMutex::MutexGuard g(*m);
+            ++s_sink;
+        }
+        delete m;
+    }
+    std::string after = dx::LockProfiler::Report(0);
+    bool ok = ReportValue(after, "locks") == ReportValue(before, "locks")
+                && ReportValue(after, "acquires") >= ReportValue(before, "acquires") + 1000;
+    std::cout << "temp_locks locks=" << ReportValue(after, "locks")
+              << " acquires=" << ReportValue(after, "acquires") << " ok=" << ok << std::endl;
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    int thread_cnt = argc > 1 ? atoi(argv[1]) : 4;
+    int count = argc > 2 ? atoi(argv[2]) : 100000;
+
+    dx::LockProfiler::Reset();
+    dx::LockProfiler::SetName(&s_hot, "hot");
+    dx::LockProfiler::SetName(&s_cold, "cold");
+
+    std::vector<dx::Thread::ptr> thrs;
+    for(int i = 0; i < thread_cnt; i++) {
+        thrs.push_back(dx::Thread::ptr(new dx::Thread(std::bind(&worker, count), "worker_" + std::to_string(i))));
+    }
+    for(auto& i : thrs) {
+        i->Join();
+    }
+
+    std::string report = dx::LockProfiler::Report(10);
+    std::cout << report;
+#if SERVER_LOCK_PROFILE
+    // 线程都已退出, 计数已经并入, 热点锁应当是按等待时间排序的第一项
+    size_t pos = report.find("by lock");
+    size_t line = report.find('\n', pos) + 1;
+    if(report.find("name=hot", line) != report.find("name=", line)) {
+        std::cout << "hot lock is not ranked first" << std::endl;
+        return 1;
+    }
+    if(!test_temp_locks())
+        return 1;
+#endif
+    return 0;
+}
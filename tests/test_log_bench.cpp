@@ -0,0 +1,324 @@
+#include "src/server.h"
+#include <sys/time.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <new>
+
+/**
+ * 日志子系统基准测试
+ *  - 每种appender(stdout, stdout direct, file, mmap) 在 1..N 线程下的单次调用延迟分布(p50/p99/p999)与总吞吐
+ *  - 关闭级别日志的开销
+ *  - 格式器开销(pattern / json)
+ *  - 每条日志的内存分配次数
+ *  - Logger 取Appender集合的开销: atomic_load(shared_ptr) 与 EBR 下的裸指针对比, 以及空Appender下 Log() 的开销
+ * 结果以JSON输出, 便于跟踪性能回归
+ * 用法: test_log_bench [最大线程数] [每个线程日志条数] [JSON结果文件, 默认输出到stdout]
+ */
+
+static std::atomic<uint64_t> s_alloc_cnt(0);
+
+// 不内联, 否则编译器会把内联后的 free 与 new 表达式配对检查并报 mismatched-new-delete
+__attribute__((noinline)) void* operator new(size_t size) {
+    s_alloc_cnt.fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(size ? size : 1);
+    if(!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    free(p);
+}
+
+static uint64_t GetCurrentUS() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000 * 1000ul + tv.tv_usec;
+}
+
+static uint64_t GetCurrentNS() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+static uint32_t Percentile(const std::vector<uint32_t>& sorted, double p) {
+    if(sorted.empty())
+        return 0;
+    size_t idx = (size_t)(p * (sorted.size() - 1));
+    return sorted[idx];
+}
+
+static dx::Logger::ptr g_bench_logger;
+static int g_count = 100000;
+static std::vector<std::vector<uint32_t> > g_latency; // 每个线程的单次调用耗时(ns)
+
+static std::ostream& out() {
+    static std::stringstream s_ss;
+    return s_ss;
+}
+
+void bench_log(int idx) {
+    std::vector<uint32_t>& lat = g_latency[idx];
+    for(int i = 0; i < g_count; i++) {
+        uint64_t begin = GetCurrentNS();
+        SERVER_LOG_INFO(g_bench_logger) << "contention bench i=" << i;
+        lat[i] = GetCurrentNS() - begin;
+    }
+}
+
+/**
+ * @brief 在 thread_cnt 个线程下测一种appender, 输出一条JSON记录
+ */
+void run_contention(const std::string& name, int thread_cnt, bool first) {
+    g_latency.assign(thread_cnt, std::vector<uint32_t>(g_count));
+
+    std::vector<dx::Thread::ptr> thrs;
+    uint64_t allocs = s_alloc_cnt.load();
+    uint64_t begin = GetCurrentUS();
+    for(int i = 0; i < thread_cnt; i++) {
+        thrs.push_back(dx::Thread::ptr(new dx::Thread(std::bind(&bench_log, i), "bench_" + std::to_string(i))));
+    }
+    for(auto& i : thrs) {
+        i->Join();
+    }
+    uint64_t used = GetCurrentUS() - begin;
+    // 线程创建本身的分配不多, 与日志条数相比可以忽略
+    allocs = s_alloc_cnt.load() - allocs;
+    uint64_t total = (uint64_t)thread_cnt * g_count;
+
+    std::vector<uint32_t> all;
+    all.reserve(total);
+    for(auto& i : g_latency) {
+        all.insert(all.end(), i.begin(), i.end());
+    }
+    std::sort(all.begin(), all.end());
+
+    out() << (first ? "" : ",") << "\n    {\"appender\":\"" << name << "\""
+          << ",\"threads\":" << thread_cnt
+          << ",\"logs\":" << total
+          << ",\"used_us\":" << used
+          << ",\"logs_per_sec\":" << (used ? total * 1000000 / used : 0)
+          << ",\"p50_ns\":" << Percentile(all, 0.5)
+          << ",\"p99_ns\":" << Percentile(all, 0.99)
+          << ",\"p999_ns\":" << Percentile(all, 0.999)
+          << ",\"max_ns\":" << all.back()
+          << ",\"allocs_per_log\":" << (total ? (double)allocs / total : 0)
+          << "}";
+}
+
+static uint64_t s_eval_cnt = 0;
+
+static int ExpensiveArg(int i) {
+    ++s_eval_cnt;
+    return i * 2;
+}
+
+/**
+ * 关闭级别的日志开销: DEBUG 低于 logger 级别(运行期过滤),
+ * 或低于 SERVER_LOG_MIN_LEVEL(编译期删除, 参数不会被求值)
+ */
+void bench_disabled(int count) {
+    dx::Logger::ptr logger(new dx::Logger("disabled"));
+    logger->SetLevel(dx::LogLevel::INFO);
+
+    s_eval_cnt = 0;
+    uint64_t allocs = s_alloc_cnt.load();
+    uint64_t begin = GetCurrentUS();
+    for(int i = 0; i < count; i++) {
+        SERVER_LOG_DEBUG(logger) << "disabled " << ExpensiveArg(i);
+        // 防止编译器把级别判断提到循环外, 模拟真实代码中日志语句周围的内存访问
+        asm volatile("" ::: "memory");
+    }
+    uint64_t used = GetCurrentUS() - begin;
+    allocs = s_alloc_cnt.load() - allocs;
+
+    out() << "\n  \"disabled\":{\"min_level\":" << SERVER_LOG_MIN_LEVEL
+          << ",\"loops\":" << count
+          << ",\"used_us\":" << used
+          << ",\"ns_per_op\":" << (count ? used * 1000.0 / count : 0)
+          << ",\"arg_evals\":" << s_eval_cnt
+          << ",\"allocs\":" << allocs
+          << "},";
+}
+
+/**
+ * @brief 只测格式化, 不经过appender输出
+ */
+void bench_formatter(const std::string& name, dx::LogFormatter::ptr fmt, int count, bool first) {
+    dx::Logger::ptr logger(new dx::Logger("fmt"));
+    dx::LogEvent::ptr event(new dx::LogEvent(logger, dx::LogLevel::INFO, __FILE__, __LINE__, 0,
+                            dx::GetThreadId(), dx::GetFiberId(), time(0), dx::Thread::GetNameS()));
+    event->GetSS() << "formatter bench message with \"quotes\" and some text";
+    dx::LogKV(event.get()).kv("conn", 42).kv("lat_us", 1.25).kv("peer", "127.0.0.1:8080");
+
+    size_t bytes = 0;
+    uint64_t allocs = s_alloc_cnt.load();
+    uint64_t begin = GetCurrentUS();
+    for(int i = 0; i < count; i++) {
+        bytes += fmt->Format(logger, dx::LogLevel::INFO, event).size();
+        asm volatile("" ::: "memory");
+    }
+    uint64_t used = GetCurrentUS() - begin;
+    allocs = s_alloc_cnt.load() - allocs;
+
+    out() << (first ? "" : ",") << "\n    {\"formatter\":\"" << name << "\""
+          << ",\"loops\":" << count
+          << ",\"used_us\":" << used
+          << ",\"ns_per_op\":" << (count ? used * 1000.0 / count : 0)
+          << ",\"bytes_per_op\":" << (count ? bytes / count : 0)
+          << ",\"allocs_per_op\":" << (count ? (double)allocs / count : 0)
+          << "}";
+}
+
+/**
+ * @brief 什么都不做的Appender, 只测 Logger::Log 的分发开销
+ */
+class NullLogAppender : public dx::LogAppender {
+public:
+    void Log(std::shared_ptr<dx::Logger> logger, dx::LogLevel::Level level, dx::LogEvent::ptr event) override {
+        asm volatile("" ::: "memory");
+    }
+    std::string ToYamlString() override { return ""; }
+};
+
+typedef std::vector<dx::LogAppender::ptr> AppenderList;
+static std::shared_ptr<const AppenderList> s_shared_list;
+static std::atomic<const AppenderList*> s_raw_list(nullptr);
+static dx::LogEvent::ptr s_dispatch_event;
+static volatile uint64_t s_sink = 0;
+
+void dispatch_atomic_load() {
+    uint64_t sum = 0;
+    for(int i = 0; i < g_count; i++) {
+        std::shared_ptr<const AppenderList> list = std::atomic_load(&s_shared_list);
+        sum += list->size();
+    }
+    s_sink += sum;
+}
+
+void dispatch_epoch() {
+    uint64_t sum = 0;
+    for(int i = 0; i < g_count; i++) {
+        dx::EpochGuard g;
+        sum += s_raw_list.load(std::memory_order_acquire)->size();
+    }
+    s_sink += sum;
+}
+
+void dispatch_logger() {
+    for(int i = 0; i < g_count; i++) {
+        g_bench_logger->Log(dx::LogLevel::INFO, s_dispatch_event);
+    }
+}
+
+void run_dispatch(const std::string& name, void (*fn)(), int thread_cnt, bool first) {
+    std::vector<dx::Thread::ptr> thrs;
+    uint64_t begin = GetCurrentUS();
+    for(int i = 0; i < thread_cnt; i++) {
+        thrs.push_back(dx::Thread::ptr(new dx::Thread(fn, "dispatch_" + std::to_string(i))));
+    }
+    for(auto& i : thrs) {
+        i->Join();
+    }
+    uint64_t used = GetCurrentUS() - begin;
+    uint64_t total = (uint64_t)thread_cnt * g_count;
+    out() << (first ? "" : ",") << "\n    {\"mode\":\"" << name << "\""
+          << ",\"threads\":" << thread_cnt
+          << ",\"loops\":" << total
+          << ",\"used_us\":" << used
+          << ",\"ns_per_op\":" << (total ? used * 1000.0 / total : 0)
+          << "}";
+}
+
+/**
+ * @brief Log() 每次都要读取Appender集合, 对比两种读取方式和整个 Log() 的分发开销
+ */
+void bench_dispatch(int max_threads) {
+    AppenderList* list = new AppenderList(1, dx::LogAppender::ptr(new NullLogAppender));
+    s_shared_list.reset(new AppenderList(*list));
+    s_raw_list.store(list);
+    g_bench_logger.reset(new dx::Logger("dispatch"));
+    g_bench_logger->AddAppender(dx::LogAppender::ptr(new NullLogAppender));
+    s_dispatch_event.reset(new dx::LogEvent(g_bench_logger, dx::LogLevel::INFO, __FILE__, __LINE__, 0,
+                            dx::GetThreadId(), dx::GetFiberId(), time(0), dx::Thread::GetNameS()));
+
+    out() << "\n  \"dispatch\":[";
+    bool first = true;
+    for(int t = 1; t <= max_threads; t *= 2) {
+        run_dispatch("atomic_load_shared_ptr", &dispatch_atomic_load, t, first);
+        first = false;
+        run_dispatch("epoch_raw_ptr", &dispatch_epoch, t, false);
+        run_dispatch("logger_log_null_appender", &dispatch_logger, t, false);
+    }
+    out() << "\n  ],";
+
+    s_dispatch_event.reset();
+    g_bench_logger.reset();
+    s_raw_list.store(nullptr);
+    delete list;
+}
+
+int main(int argc, char** argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 4;
+    g_count = argc > 2 ? atoi(argv[2]) : 100000;
+    std::string result = argc > 3 ? argv[3] : "";
+
+    out() << "{";
+    bench_disabled(g_count * 100);
+
+    out() << "\n  \"formatter\":[";
+    bench_formatter("pattern", dx::LogFormatter::ptr(new dx::LogFormatter(
+                    "%d{%Y-%m-%d %H:%M:%S}%T%t%T%N%T%F%T[%p]%T[%c]%T%f:%l%T%m%n")), g_count, true);
+    bench_formatter("json", dx::LogFormatter::ptr(new dx::JsonLogFormatter), g_count, false);
+    out() << "\n  ],";
+    bench_dispatch(max_threads);
+
+    std::string file = "/tmp/test_log_bench.log";
+    std::string mmap_file = "/tmp/test_log_bench.mmap.log";
+    unlink(file.c_str());
+    unlink(mmap_file.c_str());
+
+    std::vector<std::pair<std::string, dx::LogAppender::ptr> > appenders = {
+        {"stdout", dx::LogAppender::ptr(new dx::StdoutLogAppender)},
+        {"stdout_direct", dx::LogAppender::ptr(new dx::StdoutLogAppender(true))},
+        {"file", dx::LogAppender::ptr(new dx::FileLogAppender(file))},
+        {"mmap", dx::LogAppender::ptr(new dx::MmapFileLogAppender(mmap_file))}
+    };
+
+    // stdout appender 的输出丢到 /dev/null, 不和结果混在一起
+    std::cout.flush();
+    int saved_stdout = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+
+    out() << "\n  \"appender\":[";
+    bool first = true;
+    for(auto& i : appenders) {
+        g_bench_logger.reset(new dx::Logger("bench"));
+        g_bench_logger->AddAppender(i.second);
+        for(int t = 1; t <= max_threads; t *= 2) {
+            run_contention(i.first, t, first);
+            first = false;
+        }
+        std::cout.flush();
+    }
+    out() << "\n  ]\n}\n";
+
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+
+    std::string str = static_cast<std::stringstream&>(out()).str();
+    if(result.empty()) {
+        std::cout << str;
+    } else {
+        std::ofstream ofs(result);
+        ofs << str;
+    }
+    return 0;
+}
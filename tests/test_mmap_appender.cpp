@@ -0,0 +1,128 @@
+#include "src/server.h"
+#include <sys/resource.h>
+#include <signal.h>
+
+/**
+ * MmapFileLogAppender 测试
+ * 段切换: 段大小为一页, 写入多页日志, 关闭后文件内容与写入顺序一致, 没有预分配的 '\0'
+ * 重新打开: 模拟上次未正常关闭(文件尾部是预分配的 '\0'), 新日志接在已有日志之后
+ * FATAL: 不启动后台msync线程, FATAL日志写入后立即可以从文件读到
+ * 映射失败: 用 RLIMIT_FSIZE 限制文件大小, 新段分配失败后退化为write(), 仍失败计入丢弃条数;
+ *  取消限制后下一秒重新映射
+ * 用法: test_mmap_appender [测试文件]
+ */
+
+static dx::Logger::ptr g_logger = SERVER_LOG_ROOT();
+static dx::Logger::ptr s_test = SERVER_LOG_NAME("mmap_test");
+static std::string s_file = "mmap_test.log";
+
+static std::string ReadAll(const std::string& name) {
+    std::ifstream ifs(name, std::ios::binary);
+    std::stringstream ss;
+    ss << ifs.rdbuf();
+    return ss.str();
+}
+
+static dx::MmapFileLogAppender::ptr Open(uint64_t segment_size, uint32_t sync_interval_ms) {
+    dx::MmapFileLogAppender::ptr ap(new dx::MmapFileLogAppender(s_file, segment_size, sync_interval_ms));
+    ap->SetFormatter("%m%n");
+    s_test->ClearAppenders();
+    s_test->AddAppender(ap);
+    return ap;
+}
+
+static void Close(dx::MmapFileLogAppender::ptr& ap) {
+    s_test->ClearAppenders();
+    ap.reset();
+}
+
+/**
+ * @brief 写入 [begin, end) 编号的日志, 返回期望的文件内容
+ */
+static std::string Write(int begin, int end) {
+    std::string expect;
+    for(int i = begin; i < end; i++) {
+        std::string line = "record " + std::to_string(i) + " " + std::string(i % 97, 'x');
+        SERVER_LOG_INFO(s_test) << line;
+        expect += line + "\n";
+    }
+    return expect;
+}
+
+bool test_rollover() {
+    unlink(s_file.c_str());
+    auto ap = Open(4096, 10);
+    std::string expect = Write(0, 500);
+    Close(ap);
+    std::string data = ReadAll(s_file);
+    bool ok = data == expect && expect.size() > 4096 * 4;
+    SERVER_LOG_INFO(g_logger) << "rollover size=" << data.size() << " expect=" << expect.size() << " ok=" << ok;
+    return ok;
+}
+
+bool test_reopen() {
+    std::string expect = ReadAll(s_file);
+    // 未正常关闭时尾部留有预分配的 '\0'
+    if(truncate(s_file.c_str(), expect.size() + 10000) != 0)
+        return false;
+    auto ap = Open(4096, 0);
+    expect += Write(500, 600);
+    Close(ap);
+    std::string data = ReadAll(s_file);
+    bool ok = data == expect;
+    SERVER_LOG_INFO(g_logger) << "reopen size=" << data.size() << " expect=" << expect.size() << " ok=" << ok;
+    return ok;
+}
+
+bool test_fatal() {
+    unlink(s_file.c_str());
+    auto ap = Open(4096, 0);
+    Write(0, 10);
+    SERVER_LOG_FATAL(s_test) << "fatal marker";
+    std::string data = ReadAll(s_file);
+    bool ok = data.find("fatal marker\n") != std::string::npos;
+    Close(ap);
+    SERVER_LOG_INFO(g_logger) << "fatal ok=" << ok;
+    return ok;
+}
+
+bool test_map_fail() {
+    unlink(s_file.c_str());
+    signal(SIGXFSZ, SIG_IGN);
+    struct rlimit old;
+    getrlimit(RLIMIT_FSIZE, &old);
+    struct rlimit lim = old;
+    lim.rlim_cur = 4096 * 2;
+    setrlimit(RLIMIT_FSIZE, &lim);
+
+    auto ap = Open(4096, 0);
+    Write(0, 200);
+    uint64_t dropped = ap->GetDropped();
+
+    setrlimit(RLIMIT_FSIZE, &old);
+    sleep(1);
+    std::string tail = Write(200, 300);
+    Close(ap);
+
+    std::string data = ReadAll(s_file);
+    bool ok = dropped > 0 && data.size() > tail.size()
+                && data.compare(data.size() - tail.size(), tail.size(), tail) == 0
+                && data.find('\0') == std::string::npos;
+    SERVER_LOG_INFO(g_logger) << "map_fail dropped=" << dropped << " size=" << data.size() << " ok=" << ok;
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    if(argc > 1)
+        s_file = argv[1];
+    s_test->SetLevel(dx::LogLevel::DEBUG);
+
+    int failed = 0;
+    failed += !test_rollover();
+    failed += !test_reopen();
+    failed += !test_fatal();
+    failed += !test_map_fail();
+    unlink(s_file.c_str());
+    std::cout << "failed=" << failed << std::endl;
+    return failed ? 1 : 0;
+}
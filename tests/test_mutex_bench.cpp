@@ -0,0 +1,281 @@
+#include "src/server.h"
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <atomic>
+#include <algorithm>
+
+/**
+ * 互斥量对比测试: SMutex / SpinLock / CASLock / TTASLock / MCSLock / FastMutex
+ * 在短临界区(加计数) 和 长临界区(约1us计算) 下, 1..N 个线程竞争同一把锁
+ * 除了吞吐, 还输出进程消耗的CPU时间, 自旋锁在长临界区和线程数超过核数时会空转;
+ * 每16次加锁采样一次等待时间, 输出 p99 / 最大值, 用来比较公平性
+ * 读写锁: RWMutex / DistRWMutex 只读, 以及另有一个线程每毫秒写一次
+ *  DistRWMutex 嵌套读锁: 持有读锁时有写者在等待, 再次加读锁不能死锁
+ * 顺序锁: SeqLock 与 RWMutex 读取一个小结构体, 写线程不停写入, 检查读到的值是否撕裂
+ * 用法: test_mutex_bench [最大线程数] [每个线程加锁次数]
+ */
+
+static uint64_t GetCurrentUS() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000 * 1000ul + tv.tv_usec;
+}
+
+static uint64_t GetCpuUS() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec * 1000 * 1000ul + ru.ru_utime.tv_usec
+         + ru.ru_stime.tv_sec * 1000 * 1000ul + ru.ru_stime.tv_usec;
+}
+
+static uint64_t GetCurrentNS() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 * 1000 * 1000ul + ts.tv_nsec;
+}
+
+static int g_count = 200000;
+static uint64_t s_counter = 0;
+static volatile uint64_t s_sink = 0;
+
+/**
+ * @brief 临界区内的工作量, 0 只加计数
+ */
+static void Work(int loops) {
+    uint64_t v = s_counter;
+    for(int i = 0; i < loops; i++) {
+        v = v * 6364136223846793005ull + 1442695040888963407ull;
+    }
+    s_sink = v;
+    ++s_counter;
+}
+
+template<class MutexType>
+void run(const std::string& name, int thread_cnt, int loops) {
+    MutexType mutex;
+    s_counter = 0;
+    dx::SMutex wait_mutex;
+    std::vector<uint64_t> waits;
+    std::vector<dx::Thread::ptr> thrs;
+    uint64_t cpu = GetCpuUS();
+    uint64_t begin = GetCurrentUS();
+    for(int i = 0; i < thread_cnt; i++) {
+        thrs.push_back(dx::Thread::ptr(new dx::Thread([&mutex, &wait_mutex, &waits, loops]() {
+            std::vector<uint64_t> local;
+            local.reserve(g_count / 16 + 1);
+            for(int n = 0; n < g_count; n++) {
+                if(n % 16) {
+                    typename MutexType::MutexGuard g(mutex);
+                    Work(loops);
+                    continue;
+                }
+                uint64_t t0 = GetCurrentNS();
+                typename MutexType::MutexGuard g(mutex);
+                local.push_back(GetCurrentNS() - t0);
+                Work(loops);
+            }
+            dx::SMutex::MutexGuard g(wait_mutex);
+            waits.insert(waits.end(), local.begin(), local.end());
+        }, name + "_" + std::to_string(i))));
+    }
+    for(auto& i : thrs) {
+        i->Join();
+    }
+    uint64_t used = GetCurrentUS() - begin;
+    cpu = GetCpuUS() - cpu;
+    std::sort(waits.begin(), waits.end());
+
+    uint64_t total = (uint64_t)thread_cnt * g_count;
+    std::cout << "mutex=" << name
+              << " section=" << (loops ? "long" : "short")
+              << " threads=" << thread_cnt
+              << " ops=" << total
+              << " used_us=" << used
+              << " ops_per_sec=" << (used ? total * 1000000 / used : 0)
+              << " cpu_us=" << cpu
+              << " wait_p99_ns=" << (waits.empty() ? 0 : waits[waits.size() * 99 / 100])
+              << " wait_max_ns=" << (waits.empty() ? 0 : waits.back())
+              << " ok=" << (s_counter == total)
+              << std::endl;
+}
+
+static std::atomic<bool> s_stop(false);
+
+template<class MutexType>
+void run_read(const std::string& name, int thread_cnt, bool with_writer) {
+    MutexType mutex;
+    uint64_t value = 1;
+    std::atomic<uint64_t> sum(0);
+    s_stop = false;
+    dx::Thread::ptr w;
+    if(with_writer) {
+        w.reset(new dx::Thread([&mutex, &value]() {
+            while(!s_stop) {
+                {
+                    typename MutexType::WriteLock g(mutex);
+                    ++value;
+                }
+                usleep(1000);
+            }
+        }, name + "_writer"));
+    }
+
+    std::vector<dx::Thread::ptr> thrs;
+    uint64_t begin = GetCurrentUS();
+    for(int i = 0; i < thread_cnt; i++) {
+        thrs.push_back(dx::Thread::ptr(new dx::Thread([&mutex, &value, &sum]() {
+            uint64_t local = 0;
+            for(int n = 0; n < g_count; n++) {
+                typename MutexType::ReadLock g(mutex);
+                local += value;
+            }
+            sum += local;
+        }, name + "_" + std::to_string(i))));
+    }
+    for(auto& i : thrs) {
+        i->Join();
+    }
+    uint64_t used = GetCurrentUS() - begin;
+    s_stop = true;
+    if(w)
+        w->Join();
+    s_sink = sum;
+
+    uint64_t total = (uint64_t)thread_cnt * g_count;
+    std::cout << "rwmutex=" << name
+              << " workload=" << (with_writer ? "read_mostly" : "read_only")
+              << " threads=" << thread_cnt
+              << " reads=" << total
+              << " used_us=" << used
+              << " reads_per_sec=" << (used ? total * 1000000 / used : 0)
+              << " ns_per_read=" << (total ? used * 1000.0 * thread_cnt / total : 0)
+              << std::endl;
+}
+
+struct Triple {
+    uint64_t a;
+    uint64_t b;     // a * 2
+    uint64_t c;     // a * 3
+};
+
+/**
+ * @brief RWMutex 保护的 Triple, 与 SeqLock 接口相同
+ */
+class RWTriple {
+public:
+    Triple Load() {
+        dx::RWMutex::ReadLock g(m_mutex);
+        return m_val;
+    }
+    void Store(const Triple& v) {
+        dx::RWMutex::WriteLock g(m_mutex);
+        m_val = v;
+    }
+private:
+    dx::RWMutex m_mutex;
+    Triple m_val = {0, 0, 0};
+};
+
+template<class Holder>
+uint64_t run_seq(const std::string& name, int thread_cnt) {
+    Holder holder;
+    std::atomic<uint64_t> torn(0);
+    s_stop = false;
+    dx::Thread::ptr w(new dx::Thread([&holder]() {
+        for(uint64_t i = 1; !s_stop; i++) {
+            Triple t = {i, i * 2, i * 3};
+            holder.Store(t);
+            if(i % 64 == 0)
+                sched_yield();
+        }
+    }, name + "_writer"));
+
+    std::vector<dx::Thread::ptr> thrs;
+    uint64_t begin = GetCurrentUS();
+    for(int i = 0; i < thread_cnt; i++) {
+        thrs.push_back(dx::Thread::ptr(new dx::Thread([&holder, &torn]() {
+            uint64_t bad = 0;
+            for(int n = 0; n < g_count; n++) {
+                Triple t = holder.Load();
+                if(t.b != t.a * 2 || t.c != t.a * 3)
+                    ++bad;
+            }
+            torn += bad;
+        }, name + "_" + std::to_string(i))));
+    }
+    for(auto& i : thrs) {
+        i->Join();
+    }
+    uint64_t used = GetCurrentUS() - begin;
+    s_stop = true;
+    w->Join();
+
+    uint64_t total = (uint64_t)thread_cnt * g_count;
+    std::cout << "seqlock=" << name
+              << " threads=" << thread_cnt
+              << " reads=" << total
+              << " used_us=" << used
+              << " reads_per_sec=" << (used ? total * 1000000 / used : 0)
+              << " torn=" << torn
+              << std::endl;
+    return torn;
+}
+
+/**
+ * @brief 持有读锁时另一个线程开始等待写锁, 再加一次读锁应立即返回
+ */
+bool run_nested_read() {
+    dx::DistRWMutex mutex;
+    std::atomic<bool> wrote(false);
+    mutex.RdLock();
+    dx::Thread::ptr w(new dx::Thread([&mutex, &wrote]() {
+        mutex.WrLock();
+        wrote = true;
+        mutex.Unlock();
+    }, "nested_writer"));
+    // 等写者置上写标志
+    usleep(100 * 1000);
+    bool ok = mutex.TryRdLock() && !wrote;
+    mutex.RdLock();
+    ok = ok && !wrote;
+    mutex.Unlock();
+    mutex.Unlock();
+    mutex.Unlock();
+    w->Join();
+    ok = ok && wrote && mutex.TryWrLock();
+    mutex.Unlock();
+    std::cout << "dist_rwmutex nested_read ok=" << ok << std::endl;
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 16;
+    g_count = argc > 2 ? atoi(argv[2]) : 200000;
+
+    // 长临界区约1us
+    int loops_list[] = {0, 300};
+    for(int loops : loops_list) {
+        for(int i = 1; i <= max_threads; i *= 2) {
+            run<dx::SMutex>("smutex", i, loops);
+            run<dx::SpinLock>("spinlock", i, loops);
+            run<dx::CASLock>("caslock", i, loops);
+            run<dx::TTASLock>("ttaslock", i, loops);
+            run<dx::MCSLock>("mcslock", i, loops);
+            run<dx::FastMutex>("fastmutex", i, loops);
+        }
+    }
+    bool nested_ok = run_nested_read();
+    for(int i = 1; i <= max_threads; i *= 2) {
+        run_read<dx::RWMutex>("rwmutex", i, false);
+        run_read<dx::DistRWMutex>("dist_rwmutex", i, false);
+        run_read<dx::RWMutex>("rwmutex", i, true);
+        run_read<dx::DistRWMutex>("dist_rwmutex", i, true);
+    }
+    uint64_t torn = 0;
+    for(int i = 1; i <= max_threads; i *= 2) {
+        torn += run_seq<RWTriple>("rwmutex", i);
+        torn += run_seq<dx::SeqLock<Triple> >("seqlock", i);
+    }
+    std::cout << "sink=" << s_sink << std::endl;
+    return (torn || !nested_ok) ? 1 : 0;
+}
@@ -0,0 +1,105 @@
+#include "src/server.h"
+#include <atomic>
+
+/**
+ * 线程参数测试: 一个绑核的忙线程(尝试 SCHED_FIFO) 和 一个降低优先级的后台线程(大部分时间睡眠)
+ * 检查注册表中的线程个数, 绑核和nice值是否生效, CPU时间统计是否区分忙闲, 线程退出后统计仍可读取
+ * 没有 CAP_SYS_NICE 时 SCHED_FIFO 设置失败, 只输出日志, 不算错误
+ * 用法: test_thread_options [运行毫秒数]
+ */
+
+static dx::Logger::ptr g_logger = SERVER_LOG_ROOT();
+static std::atomic<bool> s_stop(false);
+static volatile uint64_t s_sink = 0;
+
+/**
+ * @brief 计算约1ms后睡眠1ms; SCHED_FIFO 下一直空转会饿死同一个CPU上的其他线程
+ */
+void busy() {
+    uint64_t v = 0;
+    while(!s_stop) {
+        for(int i = 0; i < 1000000; i++) {
+            v = v * 6364136223846793005ull + 1;
+        }
+        usleep(1000);
+    }
+    s_sink = v;
+}
+
+void background() {
+    while(!s_stop) {
+        usleep(10 * 1000);
+    }
+}
+
+int main(int argc, char** argv) {
+    int ms = argc > 1 ? atoi(argv[1]) : 500;
+    int failed = 0;
+
+    dx::ThreadOptions reactor;
+    reactor.cpus.push_back(0);
+    reactor.policy = SCHED_FIFO;
+    reactor.priority = 10;
+
+    dx::ThreadOptions bg;
+    bg.nice = 10;
+
+    size_t base = dx::Thread::GetCount();
+    dx::Thread::ptr t1(new dx::Thread(&busy, "reactor", reactor));
+    dx::Thread::ptr t2(new dx::Thread(&background, "background", bg));
+    if(dx::Thread::GetCount() != base + 2) {
+        SERVER_LOG_ERROR(g_logger) << "registry count=" << dx::Thread::GetCount();
+        ++failed;
+    }
+
+    usleep(ms * 1000);
+    for(auto& st : dx::Thread::GetAllStats()) {
+        SERVER_LOG_INFO(g_logger) << st.ToString();
+    }
+
+    dx::ThreadStats s1 = t1->GetStats();
+    dx::ThreadStats s2 = t2->GetStats();
+    if(s1.cpus != std::vector<int>{0}) {
+        SERVER_LOG_ERROR(g_logger) << "affinity not applied: " << s1.ToString();
+        ++failed;
+    }
+    if(s2.nice != 10) {
+        SERVER_LOG_ERROR(g_logger) << "nice not applied: " << s2.ToString();
+        ++failed;
+    }
+    if(!s1.running || s1.cpu_ns <= s2.cpu_ns) {
+        SERVER_LOG_ERROR(g_logger) << "cpu time busy=" << s1.cpu_ns << " background=" << s2.cpu_ns;
+        ++failed;
+    }
+
+    // 运行中修改
+    if(!t2->SetNice(5) || t2->GetStats().nice != 5) {
+        SERVER_LOG_ERROR(g_logger) << "SetNice failed";
+        ++failed;
+    }
+    if(!t1->SetAffinity(std::vector<int>()) || t1->GetStats().cpus.empty()) {
+        SERVER_LOG_ERROR(g_logger) << "SetAffinity reset failed";
+        ++failed;
+    }
+
+    s_stop = true;
+    t1->Join();
+    t2->Join();
+
+    // 退出后返回退出时的CPU时间
+    dx::ThreadStats e1 = t1->GetStats();
+    if(e1.running || e1.cpu_ns < s1.cpu_ns || t1->SetNice(1)) {
+        SERVER_LOG_ERROR(g_logger) << "after join: " << e1.ToString();
+        ++failed;
+    }
+    SERVER_LOG_INFO(g_logger) << "after join: " << e1.ToString();
+
+    t1.reset();
+    t2.reset();
+    if(dx::Thread::GetCount() != base) {
+        SERVER_LOG_ERROR(g_logger) << "registry count after reset=" << dx::Thread::GetCount();
+        ++failed;
+    }
+    std::cout << "failed=" << failed << " sink=" << s_sink << std::endl;
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,19 @@
+#include "src/config_cache.h"
+#include <iostream>
+
+/**
+ * 把yaml配置编译成二进制镜像, 启动时用 ConfigCache::Load 加载
+ * 用法: config_compile <镜像文件> <a.yaml> [b.yaml ...]
+ */
+int main(int argc, char** argv) {
+    if(argc < 3) {
+        std::cout << "usage: " << argv[0] << " <cache_file> <a.yaml> [b.yaml ...]" << std::endl;
+        return 1;
+    }
+    std::vector<std::string> files(argv + 2, argv + argc);
+    if(!dx::ConfigCache::Compile(files, argv[1])) {
+        std::cout << "compile " << argv[1] << " failed" << std::endl;
+        return 1;
+    }
+    return 0;
+}